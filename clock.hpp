@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * clock.hpp
+ *
+ * A header only clock library, the way C++ services usually wrap their
+ * timestamps.  The clock source is a policy picked at compile time:
+ *
+ * Clock<rdtsc_policy>::now() -- raw TSC cycles
+ * Clock<rdtscp_policy>::now() -- raw TSC cycles, waits for earlier instructions
+ * Clock<rdtsc_lfence_policy>::now() -- lfence;rdtsc
+ * Clock<vdso_policy>::now() -- clock_gettime(CLOCK_MONOTONIC) in ns
+ * Clock<calibrated_policy<>>::now() -- TSC cycles converted to ns with a
+ * 		mult/shift calibrated against CLOCK_MONOTONIC_RAW
+ *
+ * chrono_clock<Policy> adapts any of them to a std::chrono clock, so
+ * code written against steady_clock can switch over.  Cycle policies need
+ * tscbench::calibrate() to be called once before they are converted to ns.
+ */
+#ifndef TSCBENCH_CLOCK_HPP
+#define TSCBENCH_CLOCK_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <time.h>
+
+namespace tscbench {
+
+struct rdtsc_policy {
+	static constexpr bool cycles = true;
+	static const char *name() { return "rdtsc"; }
+	static inline uint64_t read()
+	{
+		unsigned int eax, edx;
+		__asm__ __volatile__("rdtsc" : "=a"(eax), "=d"(edx));
+		return ((uint64_t)edx) << 32 | eax;
+	}
+};
+
+struct rdtscp_policy {
+	static constexpr bool cycles = true;
+	static const char *name() { return "rdtscp"; }
+	static inline uint64_t read()
+	{
+		unsigned int eax, edx, ecx;
+		__asm__ __volatile__("rdtscp" : "=a"(eax), "=d"(edx), "=c"(ecx));
+		return ((uint64_t)edx) << 32 | eax;
+	}
+};
+
+struct rdtsc_lfence_policy {
+	static constexpr bool cycles = true;
+	static const char *name() { return "rdtsc_lfence"; }
+	static inline uint64_t read()
+	{
+		unsigned int eax, edx;
+		__asm__ __volatile__("lfence;rdtsc" : "=a"(eax), "=d"(edx));
+		return ((uint64_t)edx) << 32 | eax;
+	}
+};
+
+struct vdso_policy {
+	static constexpr bool cycles = false;
+	static const char *name() { return "clock_gettime"; }
+	static inline uint64_t read()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+};
+
+/*
+ * ns = base_ns + ((tsc - base_tsc) * mult) >> shift, the same trick the
+ * kernel uses to avoid a divide on every read
+ */
+struct tsc_calibration {
+	uint64_t base_tsc;
+	uint64_t base_ns;
+	uint64_t mult;
+	unsigned int shift;
+
+	inline uint64_t to_ns(uint64_t tsc) const
+	{
+		return base_ns + (uint64_t)(((unsigned __int128)(tsc - base_tsc) * mult) >> shift);
+	}
+};
+
+inline tsc_calibration calibration = { 0, 0, 1, 0 };
+
+/* measures the TSC against CLOCK_MONOTONIC_RAW for about 'ms' milliseconds */
+inline void calibrate(int ms = 100)
+{
+	struct timespec t0, t1, sleep = { 0, ms * 1000000L };
+	uint64_t c0, c1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	c0 = rdtsc_policy::read();
+	nanosleep(&sleep, nullptr);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	c1 = rdtsc_policy::read();
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	calibration.shift = 32;
+	calibration.mult = (uint64_t)(((unsigned __int128)ns << calibration.shift) / (c1 - c0));
+	calibration.base_tsc = c1;
+	calibration.base_ns = vdso_policy::read();
+}
+
+template <class Base = rdtsc_policy>
+struct calibrated_policy {
+	static constexpr bool cycles = false;
+	static const char *name() { return "calibrated"; }
+	static inline uint64_t read() { return calibration.to_ns(Base::read()); }
+};
+
+template <class Policy>
+struct Clock {
+	using policy = Policy;
+
+	/* cycles or ns, whatever the policy reads */
+	static inline uint64_t now() { return Policy::read(); }
+
+	static inline uint64_t now_ns()
+	{
+		if constexpr (Policy::cycles)
+			return calibration.to_ns(Policy::read());
+		else
+			return Policy::read();
+	}
+};
+
+template <class Policy>
+struct chrono_clock {
+	using rep = int64_t;
+	using period = std::nano;
+	using duration = std::chrono::duration<rep, period>;
+	using time_point = std::chrono::time_point<chrono_clock>;
+	static constexpr bool is_steady = true;
+
+	static time_point now() noexcept
+	{
+		return time_point(duration((rep)Clock<Policy>::now_ns()));
+	}
+};
+
+} /* namespace tscbench */
+
+#endif
@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * clock_bench.cpp
+ *
+ * The tsc read, low IPC and high IPC loops again, templated over the
+ * clock.hpp policies.  Here the clock is inlined at every site like it
+ * would be in a C++ service, instead of going through read_tsc().  The
+ * std::chrono clocks are run through the same loops, so any abstraction
+ * penalty shows up next to the C numbers.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "clock.hpp"
+#include "clock_bench.h"
+
+using namespace tscbench;
+
+static std::atomic<bool> stopping;
+
+/* no clock at all, the baseline */
+struct none_policy {
+	static constexpr bool cycles = false;
+	static const char *name() { return "none"; }
+	static inline uint64_t read() { return 0; }
+};
+
+/* the std::chrono clocks as policies */
+struct steady_policy {
+	static constexpr bool cycles = false;
+	static const char *name() { return "steady_clock"; }
+	static inline uint64_t read()
+	{
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+};
+
+struct system_policy {
+	static constexpr bool cycles = false;
+	static const char *name() { return "system_clock"; }
+	static inline uint64_t read()
+	{
+		return std::chrono::system_clock::now().time_since_epoch().count();
+	}
+};
+
+struct high_resolution_policy {
+	static constexpr bool cycles = false;
+	static const char *name() { return "high_resolution_clock"; }
+	static inline uint64_t read()
+	{
+		return std::chrono::high_resolution_clock::now().time_since_epoch().count();
+	}
+};
+
+/* our own clock through the std::chrono adaptor */
+template <class Policy>
+struct chrono_policy {
+	static constexpr bool cycles = false;
+	static const char *name()
+	{
+		static const std::string n = std::string("chrono<") + Policy::name() + ">";
+		return n.c_str();
+	}
+	static inline uint64_t read()
+	{
+		return chrono_clock<Policy>::now().time_since_epoch().count();
+	}
+};
+
+template <class Policy>
+static unsigned long low_ipc(struct cxx_bench_args *args, unsigned long *loops)
+{
+	unsigned long *matrix = args->matrix;
+	unsigned long size = args->matrix_size;
+	unsigned long index = rand() % size;
+	volatile unsigned long val = 0;
+	int src, dst = 0;
+
+	for (int i = 0; i < 1024; i++) {
+		src = matrix[index] % size;
+		index = (index + 1) % size;
+		dst = matrix[src] % size;
+
+		for (int j = 0; j < 256; j++) {
+			dst = matrix[(dst + j) % size] % size;
+			if ((i * j) % 500 == 0) {
+				val += Clock<Policy>::now();
+				*loops += 1;
+			}
+		}
+
+		for (int k = 0; k < 2 * args->factor; k++) {
+			matrix[dst] += matrix[(src + k) % size] +
+				matrix[(dst + k) % size];
+		}
+		if (stopping.load(std::memory_order_relaxed))
+			break;
+	}
+	return matrix[dst] + val;
+}
+
+template <class Policy>
+static void high_ipc(struct cxx_bench_args *args, unsigned long *loops)
+{
+	unsigned long n = args->high_ipc_matrix;
+	unsigned long *m1 = &args->matrix[0];
+	unsigned long *m2 = &args->matrix[n * n];
+	unsigned long *m3 = &args->matrix[2 * n * n];
+	unsigned long ops_count = 0;
+	volatile unsigned long val = 0;
+
+	for (unsigned long i = 0; i < n; i++) {
+		for (unsigned long j = 0; j < n; j++) {
+			m3[i * n + j] = 0;
+
+			for (unsigned long k = 0; k < n; k++) {
+				m3[i * n + j] += m1[i * n + k] * m2[k * n + j];
+				ops_count++;
+				if (ops_count % 500 == 0) {
+					val += Clock<Policy>::now();
+					*loops += 1;
+				}
+				if (stopping.load(std::memory_order_relaxed))
+					return;
+			}
+		}
+	}
+}
+
+/*
+ * runs func on a thread for 'secs' seconds, returns loops per second.
+ * Sleeps in short steps so an interrupt doesn't wait for the whole run.
+ */
+template <class Func>
+static unsigned long run_for_secs(struct cxx_bench_args *args, int secs, Func func)
+{
+	unsigned long loops = 0;
+	std::chrono::steady_clock::time_point start, end;
+
+	stopping = false;
+	std::thread worker([&] {
+		start = std::chrono::steady_clock::now();
+		while (!stopping.load(std::memory_order_relaxed))
+			func(&loops);
+		end = std::chrono::steady_clock::now();
+	});
+	for (int ms = secs * 1000; ms > 0 && !*args->interrupted; ms -= 100)
+		std::this_thread::sleep_for(std::chrono::milliseconds(ms < 100 ? ms : 100));
+	stopping = true;
+	worker.join();
+
+	auto usecs = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	return usecs ? loops * 1000000 / usecs : 0;
+}
+
+template <class Policy>
+static void bench_policy(struct cxx_bench_args *args, struct cxx_bench_result *res)
+{
+	volatile uint64_t val = 0;
+
+	res->name = Policy::name();
+	res->calls_per_sec = 0;
+	res->loops_per_sec = 0;
+	if (*args->interrupted)
+		return;
+	res->calls_per_sec = run_for_secs(args, args->runtime, [&](unsigned long *loops) {
+		for (int i = 0; i < 1024; i++)
+			val += Clock<Policy>::now();
+		*loops += 1024;
+	});
+	fprintf(stderr, "c++ %s calls/s %'lu\n", res->name, res->calls_per_sec);
+	if (*args->interrupted)
+		return;
+
+	if (args->high_ipc)
+		res->loops_per_sec = run_for_secs(args, args->runtime, [&](unsigned long *loops) {
+			high_ipc<Policy>(args, loops);
+		});
+	else
+		res->loops_per_sec = run_for_secs(args, args->runtime, [&](unsigned long *loops) {
+			low_ipc<Policy>(args, loops);
+		});
+	fprintf(stderr, "c++ %s IPC (%s) loops/s %'lu\n", args->high_ipc ? "High" : "low",
+		res->name, res->loops_per_sec);
+}
+
+template <class... Policies>
+static int bench_policies(struct cxx_bench_args *args, struct cxx_bench_result *results,
+			  int max)
+{
+	int nr = 0;
+
+	((nr < max ? bench_policy<Policies>(args, &results[nr++]) : void()), ...);
+	return nr;
+}
+
+extern "C" int cxx_bench(struct cxx_bench_args *args, struct cxx_bench_result *results,
+			 int max)
+{
+	calibrate();
+	return bench_policies<none_policy, rdtsc_policy, rdtscp_policy, rdtsc_lfence_policy,
+			      vdso_policy, calibrated_policy<>, chrono_policy<rdtsc_policy>,
+			      steady_policy, system_policy,
+			      high_resolution_policy>(args, results, max);
+}
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * clock_bench.h
+ *
+ * the C side of clock_bench.cpp, which runs the tsc loops templated over
+ * the clock.hpp policies and the std::chrono clocks
+ */
+#ifndef TSCBENCH_CLOCK_BENCH_H
+#define TSCBENCH_CLOCK_BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct cxx_bench_args {
+	unsigned long *matrix;
+	unsigned long matrix_size;
+	unsigned long high_ipc_matrix;
+	int factor;
+	int runtime;
+	int high_ipc;
+	/* set by the C side's signal handler, stops the runs early */
+	volatile int *interrupted;
+};
+
+struct cxx_bench_result {
+	const char *name;
+	unsigned long calls_per_sec;
+	unsigned long loops_per_sec;
+};
+
+#define CXX_BENCH_MAX 16
+
+/* fills in results and returns how many there are */
+int cxx_bench(struct cxx_bench_args *args, struct cxx_bench_result *results, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
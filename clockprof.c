@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * clockprof.c
+ *
+ * gcc -Wall -O2 -g -fPIC -shared -o libclockprof.so clockprof.c -ldl -lpthread
+ *
+ * An LD_PRELOAD shim that counts how often a program reads the clock.
+ * clock_gettime(), gettimeofday() and time() are interposed, and each
+ * thread keeps call counts and a log2 histogram of the gap between calls
+ * for every clock id.  Gaps are measured with rdtsc, so the shim only adds
+ * a handful of instructions to each call.
+ *
+ * When the program exits we print a report.  If tsc has been used to
+ * measure the cost of each clock on this host (tsc costs=FILE), point
+ * CLOCKPROF_COSTS at that file and the report includes the estimated time
+ * spent reading clocks.
+ *
+ * Example usage:
+ *
+ * ./tsc costs=/tmp/clock_costs
+ * CLOCKPROF_COSTS=/tmp/clock_costs LD_PRELOAD=./libclockprof.so ./my_service
+ *
+ * Environment:
+ *
+ * CLOCKPROF_COSTS=FILE -- per clock ns/call as written by tsc costs=FILE
+ * CLOCKPROF_OUTPUT=FILE -- append the report to FILE instead of stderr
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/*
+ * slots 0 .. MAX_CLOCK_ID are clock_gettime() clock ids, anything else
+ * (dynamic posix cpu clocks, fd clocks) lands in SLOT_OTHER
+ */
+#define MAX_CLOCK_ID 15
+#define SLOT_OTHER (MAX_CLOCK_ID + 1)
+#define SLOT_GETTIMEOFDAY (MAX_CLOCK_ID + 2)
+#define SLOT_TIME (MAX_CLOCK_ID + 3)
+#define NR_SLOTS (MAX_CLOCK_ID + 4)
+
+/* gap histogram buckets, bucket N holds gaps of [2^N, 2^(N+1)) cycles */
+#define NR_BUCKETS 64
+
+struct slot_stats {
+	unsigned long calls;
+	unsigned long last_tsc;
+	unsigned long gaps[NR_BUCKETS];
+};
+
+struct thread_stats {
+	struct thread_stats *next;
+	pid_t tid;
+	struct slot_stats slots[NR_SLOTS];
+};
+
+typedef int (*clock_gettime_func)(clockid_t, struct timespec *);
+typedef int (*gettimeofday_func)(struct timeval *, void *);
+typedef time_t (*time_func)(time_t *);
+
+static clock_gettime_func real_clock_gettime;
+static gettimeofday_func real_gettimeofday;
+static time_func real_time;
+
+/* every thread that ever read a clock, never freed so we can report at exit */
+static struct thread_stats *all_threads;
+static __thread struct thread_stats *my_stats;
+static __thread int in_setup;
+
+/* used to convert cycles into ns at exit */
+static unsigned long start_tsc;
+static struct timespec start_ts;
+
+static inline unsigned long rdtsc(void)
+{
+	unsigned int eax, edx;
+	__asm__ __volatile__("rdtsc" : "=a"(eax), "=d"(edx));
+	return ((unsigned long)edx) << 32 | eax;
+}
+
+static void resolve_symbols(void)
+{
+	real_clock_gettime = (clock_gettime_func)dlsym(RTLD_NEXT, "clock_gettime");
+	real_gettimeofday = (gettimeofday_func)dlsym(RTLD_NEXT, "gettimeofday");
+	real_time = (time_func)dlsym(RTLD_NEXT, "time");
+	if (!real_clock_gettime || !real_gettimeofday || !real_time) {
+		fprintf(stderr, "clockprof: dlsym failed: %s\n", dlerror());
+		exit(1);
+	}
+}
+
+/*
+ * the slow path, only taken on the first clock read of each thread.
+ * The stats are pushed onto all_threads without a lock.
+ */
+static struct thread_stats *setup_thread(void)
+{
+	struct thread_stats *ts;
+
+	if (in_setup)
+		return NULL;
+	in_setup = 1;
+	ts = calloc(1, sizeof(*ts));
+	in_setup = 0;
+	if (!ts)
+		return NULL;
+	ts->tid = syscall(SYS_gettid);
+	ts->next = __atomic_load_n(&all_threads, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&all_threads, &ts->next, ts, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	my_stats = ts;
+	return ts;
+}
+
+static inline void record_call(int slot)
+{
+	struct thread_stats *ts = my_stats;
+	struct slot_stats *ss;
+	unsigned long now;
+
+	if (!ts) {
+		ts = setup_thread();
+		if (!ts)
+			return;
+	}
+	ss = &ts->slots[slot];
+	now = rdtsc();
+	if (ss->calls++ && now > ss->last_tsc)
+		ss->gaps[63 - __builtin_clzl(now - ss->last_tsc)]++;
+	ss->last_tsc = now;
+}
+
+int clock_gettime(clockid_t clk, struct timespec *ts)
+{
+	if (!real_clock_gettime)
+		resolve_symbols();
+	record_call(clk >= 0 && clk <= MAX_CLOCK_ID ? clk : SLOT_OTHER);
+	return real_clock_gettime(clk, ts);
+}
+
+int gettimeofday(struct timeval *tv, void *tz)
+{
+	if (!real_gettimeofday)
+		resolve_symbols();
+	record_call(SLOT_GETTIMEOFDAY);
+	return real_gettimeofday(tv, tz);
+}
+
+time_t time(time_t *t)
+{
+	if (!real_time)
+		resolve_symbols();
+	record_call(SLOT_TIME);
+	return real_time(t);
+}
+
+static const char *slot_name(int slot, char *buf, size_t len)
+{
+	static const char *clock_names[] = {
+		"CLOCK_REALTIME", "CLOCK_MONOTONIC", "CLOCK_PROCESS_CPUTIME_ID",
+		"CLOCK_THREAD_CPUTIME_ID", "CLOCK_MONOTONIC_RAW",
+		"CLOCK_REALTIME_COARSE", "CLOCK_MONOTONIC_COARSE",
+		"CLOCK_BOOTTIME", "CLOCK_REALTIME_ALARM", "CLOCK_BOOTTIME_ALARM",
+		NULL, "CLOCK_TAI",
+	};
+
+	if (slot == SLOT_GETTIMEOFDAY)
+		return "gettimeofday";
+	if (slot == SLOT_TIME)
+		return "time";
+	if (slot == SLOT_OTHER)
+		return "clock_gettime(dynamic clock)";
+	if (slot < (int)(sizeof(clock_names) / sizeof(clock_names[0])) &&
+	    clock_names[slot])
+		return clock_names[slot];
+	snprintf(buf, len, "clock_gettime(%d)", slot);
+	return buf;
+}
+
+/*
+ * the cost file has one "name ns_per_call" pair per line, where name is
+ * clock_gettime:<clock id>, gettimeofday or time.  Lines starting
+ * with # are comments.  Returns the number of costs found.
+ */
+static int read_costs(const char *path, double *costs)
+{
+	FILE *f;
+	char line[256];
+	char name[64];
+	double ns;
+	int clk;
+	int found = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "clockprof: unable to open %s\n", path);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%63s %lf", name, &ns) != 2)
+			continue;
+		if (sscanf(name, "clock_gettime:%d", &clk) == 1) {
+			if (clk >= 0 && clk <= MAX_CLOCK_ID)
+				costs[clk] = ns;
+			else
+				continue;
+		} else if (strcmp(name, "gettimeofday") == 0) {
+			costs[SLOT_GETTIMEOFDAY] = ns;
+		} else if (strcmp(name, "time") == 0) {
+			costs[SLOT_TIME] = ns;
+		} else {
+			continue;
+		}
+		found++;
+	}
+	fclose(f);
+
+	/* dynamic clocks go through the syscall, charge them like the cputime clocks */
+	if (costs[CLOCK_THREAD_CPUTIME_ID] > 0)
+		costs[SLOT_OTHER] = costs[CLOCK_THREAD_CPUTIME_ID];
+	return found;
+}
+
+static void print_histogram(FILE *out, struct slot_stats *ss, double ns_per_cycle)
+{
+	int i;
+
+	for (i = 0; i < NR_BUCKETS; i++) {
+		double lo;
+
+		if (!ss->gaps[i])
+			continue;
+		lo = (double)(1UL << i) * ns_per_cycle;
+		fprintf(out, "\t\tgap >= %12.0f ns: %'lu\n", lo, ss->gaps[i]);
+	}
+}
+
+static void reset_start(void)
+{
+	real_clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+	start_tsc = rdtsc();
+}
+
+/*
+ * a forked child only has the forking thread, and its counts belong to
+ * the parent's report.  Start the child over from scratch.
+ */
+static void clockprof_atfork_child(void)
+{
+	all_threads = NULL;
+	my_stats = NULL;
+	reset_start();
+}
+
+static __attribute__((constructor)) void clockprof_init(void)
+{
+	resolve_symbols();
+	pthread_atfork(NULL, NULL, clockprof_atfork_child);
+	reset_start();
+}
+
+static __attribute__((destructor)) void clockprof_report(void)
+{
+	struct thread_stats *ts;
+	struct timespec end_ts;
+	unsigned long end_tsc;
+	unsigned long long elapsed_ns;
+	double ns_per_cycle;
+	double costs[NR_SLOTS] = { 0 };
+	double total_cost_ns = 0;
+	unsigned long total_calls = 0;
+	int have_costs = 0;
+	char *path;
+	char buf[64];
+	FILE *out = stderr;
+	int i;
+
+	/* nothing to say about processes that never read a clock */
+	if (!__atomic_load_n(&all_threads, __ATOMIC_ACQUIRE))
+		return;
+
+	end_tsc = rdtsc();
+	real_clock_gettime(CLOCK_MONOTONIC_RAW, &end_ts);
+	elapsed_ns = (end_ts.tv_sec - start_ts.tv_sec) * NSEC_PER_SEC +
+		end_ts.tv_nsec - start_ts.tv_nsec;
+	if (end_tsc <= start_tsc || !elapsed_ns)
+		return;
+	ns_per_cycle = (double)elapsed_ns / (end_tsc - start_tsc);
+
+	path = getenv("CLOCKPROF_COSTS");
+	if (path)
+		have_costs = read_costs(path, costs);
+
+	path = getenv("CLOCKPROF_OUTPUT");
+	if (path) {
+		out = fopen(path, "a");
+		if (!out) {
+			fprintf(stderr, "clockprof: unable to open %s\n", path);
+			out = stderr;
+		}
+	}
+
+	fprintf(out, "clockprof: pid %d ran for %.3f s, tsc %.3f GHz\n",
+		getpid(), (double)elapsed_ns / NSEC_PER_SEC, 1 / ns_per_cycle);
+
+	for (ts = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); ts; ts = ts->next) {
+		double thread_cost_ns = 0;
+
+		fprintf(out, "thread %d\n", ts->tid);
+		for (i = 0; i < NR_SLOTS; i++) {
+			struct slot_stats *ss = &ts->slots[i];
+
+			if (!ss->calls)
+				continue;
+			fprintf(out, "\t%s calls %'lu", slot_name(i, buf, sizeof(buf)),
+				ss->calls);
+			if (costs[i] > 0) {
+				fprintf(out, " cost %.1f ns/call est %.3f ms",
+					costs[i], ss->calls * costs[i] / 1e6);
+				thread_cost_ns += ss->calls * costs[i];
+			}
+			fprintf(out, "\n");
+			print_histogram(out, ss, ns_per_cycle);
+			total_calls += ss->calls;
+		}
+		total_cost_ns += thread_cost_ns;
+	}
+
+	fprintf(out, "total calls %'lu (%'.0f/s)\n", total_calls,
+		total_calls * (double)NSEC_PER_SEC / elapsed_ns);
+	if (have_costs)
+		fprintf(out, "estimated overhead %.3f ms, %.4f%% of one cpu over the run\n",
+			total_cost_ns / 1e6, total_cost_ns * 100 / elapsed_ns);
+	else
+		fprintf(out, "no clock costs, set CLOCKPROF_COSTS to the output of tsc costs=FILE\n");
+	if (out != stderr)
+		fclose(out);
+}
@@ -2,7 +2,8 @@
 /*
  * tsc.c
  *
- * gcc -Wall -O2 -g -o tsc tsc.c -lpthread
+ * gcc -Wall -O2 -g -c tsc.c && g++ -Wall -O2 -g -c clock_bench.cpp
+ * gcc -o tsc tsc.o clock_bench.o -lpthread -lstdc++ -lm -ldl
  *
  * This program benchmarks the rdtscp instruction against both high and low IPC loops.
  * It allows you see how much rdtscp slows down each loop, and also compares
@@ -14,18 +15,131 @@
  * tsc low_ipc factor=1000 -- runs a low IPC loop with rdtscp, but with a factor of 1000.
  * 		this gives us IPC of ~1.2 instead of ~0.5
  *
+ * tsc low_ipc ipc=1.5 -- searches for the factor that gives the low IPC loop an IPC of 1.5
+ * 		and reports the IPC actually reached.  high_ipc tunes the matrix size instead
+ *
  * tsc low_ipc notsc -- runs a low IPC loop without rdtscp
  * tsc low_ipc rdtsc -- runs a low IPC loop with rdtsc
  * tsc low_ipc clock_gettime -- runs a low IPC loop with clock_gettime()
  * tsc low_ipc cmp -- runs a low IPC loop with and without rdtscp
  * tsc low_ipc cmp rdtsc -- runs a low IPC loop with and without rdtsc
  * tsc low_ipc cmp clock_gettime -- runs a low IPC loop with and without clock_gettime
+ * tsc low_ipc cmp twin -- runs the loops with and without rdtscp at the same time on
+ * 		two cores of one package, swapping cores every second, and compares them
+ * 		over the same 250ms intervals
  *
  * You can run all of the above with high_ipc instead of low_ipc
  *
+ * tsc low_ipc matrix_file=/dev/shm/tsc_matrix -- builds the matrix once in a shm (or
+ * 		hugetlbfs) file and reuses it on later runs
+ *
+ * tsc low_ipc compact -- uses 32 bit matrix entries and a power of two matrix size,
+ * 		which halves the memory footprint
+ * tsc layout_check -- runs the low IPC loop with both matrix layouts and compares
+ * 		their cache miss rates
+ * tsc low_ipc matrix_mb=64 -- shrinks the matrix for small machines
+ *
+ * tsc cxx -- runs the clock and low IPC loops from the C++ clock.hpp policies and the
+ * 		std::chrono clocks next to the C read_tsc() versions
+ *
+ * tsc tracepoints -- runs both IPC loops with the clock read behind a volatile flag,
+ * 		a plain flag, a per thread flag and a runtime patched asm goto nop, with
+ * 		tracing off and on, and times switching each one
+ *
+ * tsc icache -- generates 64 to 16384 small functions, each with its own inlined
+ * 		rdtsc or rdtscp, out of line read_tsc() call or vdso clock_gettime() call,
+ * 		and reports throughput with front end stall and i-cache miss counters
+ * tsc icache functions=4096 -- same, for one function count
+ *
+ * tsc wakeup -- pinned threads on every cpu sleep with clock_nanosleep (absolute and
+ * 		relative), nanosleep, timerfd+epoll and futex timeouts, and report
+ * 		histograms of how late they woke up, measured with the TSC
+ * tsc wakeup period_us=100 slack_ns=0 -- 100us periods with the smallest timer slack
+ *
+ * tsc delay -- waits for TSC deadlines from 100ns to 1ms with a pause loop, tpause,
+ * 		umwait (when the cpu has WAITPKG), sleep then spin hybrids and a plain
+ * 		sleep, and reports overshoot, cpu use and the slowdown of the SMT sibling
+ * tsc delay delay_ns=2000 -- same, for one delay
+ *
+ * tsc capture=/tmp/cap -- a thread on every cpu reads the clock in a loop and keeps
+ * 		every (tsc, delta, cpu) sample, written to /tmp/cap/capture.N.bin at the end
+ * tsc analyze /tmp/cap/capture.*.bin -- percentiles, per cpu breakdowns and
+ * 		periodic spikes (like the timer tick) from captured samples
+ *
+ * tsc tickphase -- times every clock_gettime() of each clock id and folds the slow
+ * 		ones modulo the tick period, to show the seqlock retries on the tick
+ * tsc tickphase hz=250 -- same, with the tick rate given instead of CONFIG_HZ
+ *
+ * tsc oversub -- runs the clock read loop and the low IPC loop with one thread per
+ * 		cpu and then two, reads the cgroup cpu.stat throttling counters around
+ * 		every 250ms window and reports clean and throttled windows apart
+ * tsc oversub ratio=4 high_ipc -- four threads per cpu, with the high IPC loop
+ *
+ * tsc sampling -- runs the low IPC loop with each inline clock, then without one
+ * 		under a perf_event_open() sampler read from its mmap ring and under a
+ * 		timer_create() SIGPROF sampler at 100, 1000 and 10000 Hz, and reports
+ * 		the overhead per timestamp or sample
+ * tsc sampling sample_hz=4000 high_ipc -- one sampling rate, with the high IPC loop
+ *
+ * tsc cxx journal=/tmp/cxx.journal -- appends each phase to the journal as it ends,
+ * 		^C stops the running phase and prints everything so far, marked partial
+ * tsc cxx journal=/tmp/cxx.journal resume -- reruns only the phases the journal
+ * 		doesn't have yet
+ *
+ * tsc model=/tmp/model -- runs synth loops over a grid of IPCs and stamp spacings
+ * 		with every clock, and fits each clock's cycles per stamp to the IPC,
+ * 		cache misses and spacing, with error bars
+ * tsc advise /tmp/model overhead=1 insns=2000 ipc=1.5 -- predicts each clock's
+ * 		overhead on that hot path, the most stamps/s that stay under 1%, and
+ * 		recommends the cheapest clock that fits
+ *
+ * tsc stream -- the STREAM copy, scale, add and triad kernels over 256MB arrays with
+ * 		a clock read every 16 cache lines, GB/s for every clock against no reads
+ * tsc stream threads=8 lines=4 stream_mb=1024 -- eight threads to saturate memory
+ * 		bandwidth, a read every 4 lines
+ *
+ * tsc alloc -- malloc/free of mostly small objects with 1% of the mallocs timed by
+ * 		each clock into a per thread histogram, allocs/s against no timing
+ * tsc alloc threads=4 stamp_pct=100 -- four threads, every malloc timed
+ * LD_PRELOAD=libjemalloc.so.2 tsc alloc -- the same against jemalloc
+ *
+ * tsc ntp -- times clock_gettime(CLOCK_MONOTONIC) in 500ms windows with the slow read
+ * 		rate and how fast MONOTONIC and REALTIME drift from MONOTONIC_RAW, and
+ * 		flags windows where ntpd or chrony changed the slew
+ * tsc ntp_adjust -- (root, disposable VMs only) the same around adjtimex() frequency
+ * 		offsets, clock steps and an adjtime() slew, all undone at the end
+ *
+ * tsc cold -- the first read of each clock after 50us, 1ms and 20ms of sleep, after
+ * 		a migration and after a 64MB cache/TLB thrash, against warm reads
+ * tsc cold idle_us=5000 thrash_mb=256 -- one sleep depth and a bigger thrash
+ *
+ * tsc variants low_ipc cmp -- runs "low_ipc cmp" with every tsc.<compiler>-<flags>
+ * 		binary built by make variants, and reports the spread between them
+ *
  * tsc rdtscp -- just runs rdtscp to see how many calls per second it can down
  * tsc rdtsc -- just runs rdtsc to see how many calls per second it can down
  * tsc clock_gettime -- just runs clock_gettime to see how many calls per second it can down
+ *
+ * tsc costs=FILE -- measures the ns/call of every clock_gettime() clock id, gettimeofday()
+ * 		and time(), and writes them to FILE for libclockprof.so
+ *
+ * tsc timens -- runs the clock_gettime calls/s and low IPC loops in the root namespace
+ * 		and again inside a time namespace, and reports the difference
+ *
+ * tsc virt -- detects the hypervisor and clocksource, benchmarks reading the kvm pvclock
+ * 		page directly, and checks if rdtsc is trapped by the hypervisor
+ * tsc virt cycle_clocksources -- (root only) also reruns the clock and low IPC loops
+ * 		with every available clocksource
+ *
+ * tsc uarch -- measures cycles and uops of rdtsc, rdtscp, lfence;rdtsc, rdpid and
+ * 		rdtscp;lfence as independent reads, in a dependency chain, and mixed
+ * 		with loads, stores, multiplies and divides
+ *
+ * tsc synth -- generates loops at runtime, tunes them to a range of IPCs and reports
+ * 		the timestamp overhead at each one
+ * tsc synth ipc=2.0 -- same, but only for one target IPC
+ * tsc synth mix=1,64,1,1 stamp_every=1000 -- runs a fixed mix of loads, alu ops,
+ * 		branches and alu dependency depth per body, with a stamp every 1000 instructions
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,8 +147,38 @@
 #include <sys/time.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
 #include <locale.h>
 #include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <cpuid.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/prctl.h>
+#include <sys/utsname.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/timex.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <linux/futex.h>
+#include <glob.h>
+#include <libgen.h>
+#include <limits.h>
+#include <dlfcn.h>
+
+#include "clock_bench.h"
 
 #define USEC_PER_SEC 1000000
 #ifndef CLOCK_NON_MONOTONIC
@@ -44,12 +188,26 @@
 /* we want a large matrix to force cache misses */
 static unsigned long matrix_size = 64 * 1024 * 1024ULL;
 static unsigned long *global_matrix;
+/*
+ * the compact layout stores 32 bit entries in a power of two sized
+ * matrix, so indexes are masked instead of divided
+ */
+static unsigned int *global_matrix32;
+static unsigned long matrix_mask;
+static int compact_matrix = 0;
+static unsigned int matrix_seed = 1;
+/* matrix_file=PATH, keep the filled matrix in shm or hugetlbfs between runs */
+static char *matrix_file;
 static volatile unsigned long stopping = 0;
 char *tsc_variant = "rdtscp";
 static volatile int skip_rdtsc = 0;
 static int runtime = 10;
 static int run_mode = 0;
 static int factor = 1;
+/* ipc=X, calibrate the loops to this IPC */
+static double target_ipc = 0;
+/* threads=N, for the stream and alloc workloads */
+static int bench_threads = 1;
 
 /*
  * example valid modes
@@ -73,6 +231,28 @@ enum modes {
 	MODE_RDTSC_LFENCE = 1 << 6,
         MODE_GETTIME = 1 << 7,
         MODE_GETTIME_NON_MONOTONIC = 1 << 8,
+	MODE_COSTS = 1 << 9,
+	MODE_TIMENS = 1 << 10,
+	MODE_VIRT = 1 << 11,
+	MODE_CYCLE_CLOCKSOURCES = 1 << 12,
+	MODE_UARCH = 1 << 13,
+	MODE_SYNTH = 1 << 14,
+	MODE_LAYOUT_CHECK = 1 << 15,
+	MODE_CXX = 1 << 16,
+	MODE_TRACEPOINTS = 1 << 17,
+	MODE_ICACHE = 1 << 18,
+	MODE_WAKEUP = 1 << 19,
+	MODE_DELAY = 1 << 20,
+	MODE_CAPTURE = 1 << 21,
+	MODE_TICKPHASE = 1 << 22,
+	MODE_OVERSUB = 1 << 23,
+	MODE_SAMPLING = 1 << 24,
+	MODE_MODEL = 1 << 25,
+	MODE_STREAM = 1 << 26,
+	MODE_ALLOC = 1 << 27,
+	MODE_TWIN = 1 << 28,
+	MODE_NTP = 1 << 29,
+	MODE_COLD = 1 << 30,
 };
 
 #define IPC_MODE_MASK (MODE_LOW_IPC | MODE_HIGH_IPC)
@@ -84,9 +264,18 @@ enum modes {
 static unsigned long high_ipc_matrix = 105;
 
 typedef void *(*thread_func)(void *);
+/* what the ipc loops call for each stamp, read_tsc() or read_none() */
+typedef unsigned long (*read_func)(unsigned int *aux);
 
 struct thread_data {
         unsigned long calls_per_sec;
+	/* count cycles and instructions in the ipc loops */
+	int count_ipc;
+	/* don't print the loops/s line, used for calibration probes */
+	int quiet;
+	double ipc;
+	/* last level cache misses per thousand instructions */
+	double mpki;
 };
 
 void tvsub(struct timeval *tdiff, struct timeval *t1, struct timeval *t0)
@@ -126,6 +315,200 @@ unsigned long long tvdelta(struct timeval *start, struct timeval *stop)
 	return (usecs);
 }
 
+static unsigned long matrix_entry_size(void)
+{
+	return compact_matrix ? sizeof(*global_matrix32) : sizeof(*global_matrix);
+}
+
+static void set_matrix(void *p)
+{
+	if (compact_matrix)
+		global_matrix32 = p;
+	else
+		global_matrix = p;
+}
+
+/*
+ * the randoms the matrix repeats.  The low ipc loops take their starting
+ * index from the rand() calls after these, so a reused matrix_file still
+ * draws them to leave rand() where building the matrix would
+ */
+static void matrix_randoms(int numbers[2048])
+{
+	int i;
+
+	srand(matrix_seed);
+	for (i = 0; i < 2048; i++)
+		numbers[i] = rand();
+}
+
+/* fill the matrix with a repeating set of randoms */
+static void fill_matrix(void)
+{
+	unsigned long i;
+	int numbers[2048];
+
+	matrix_randoms(numbers);
+	if (compact_matrix) {
+		for (i = 0; i < matrix_size; i++)
+			global_matrix32[i] = numbers[i % 2048];
+		return;
+	}
+	for (i = 0; i < matrix_size; i++)
+		global_matrix[i] = numbers[i % 2048];
+}
+
+#define MATRIX_MAGIC 0x7872746d63737400UL
+#define MATRIX_LAYOUT_VERSION 1
+
+/*
+ * the first page of a matrix file describes the matrix that follows it.
+ * complete is only set once the matrix is filled, so a run that died
+ * halfway through building it doesn't leave a file we'd trust.
+ */
+struct matrix_header {
+	unsigned long magic;
+	unsigned long version;
+	unsigned long seed;
+	unsigned long entries;
+	unsigned long entry_size;
+	unsigned long data_offset;
+	unsigned long complete;
+};
+
+static int matrix_header_ok(struct matrix_header *hdr, unsigned long data_offset)
+{
+	return hdr->magic == MATRIX_MAGIC &&
+		hdr->version == MATRIX_LAYOUT_VERSION &&
+		hdr->seed == matrix_seed &&
+		hdr->entries == matrix_size &&
+		hdr->entry_size == matrix_entry_size() &&
+		hdr->data_offset == data_offset &&
+		hdr->complete;
+}
+
+/*
+ * maps the matrix from a file in shm or hugetlbfs, building it first if
+ * the file is missing or was made with a different layout.  The runs
+ * write into the matrix, so they get a private copy on write mapping and
+ * the file always holds the same data.  Every page of the copy is written
+ * before we return, so the copy on write faults don't land in a timed run.
+ */
+static void map_matrix_file(char *path)
+{
+	struct matrix_header *hdr;
+	struct statfs sfs;
+	struct stat st;
+	struct timeval start, now;
+	int numbers[2048];
+	unsigned long page;
+	unsigned long total;
+	unsigned long off;
+	char *map;
+	int built = 0;
+	int fd;
+
+	gettimeofday(&start, NULL);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror("open matrix_file");
+		exit(1);
+	}
+	/* only one run gets to build the file */
+	if (flock(fd, LOCK_EX) < 0 || fstatfs(fd, &sfs) < 0 || fstat(fd, &st) < 0) {
+		perror("matrix_file");
+		exit(1);
+	}
+
+	/* hugetlbfs reports the huge page size here, mappings must be aligned to it */
+	page = sfs.f_bsize;
+	if (page < sizeof(struct matrix_header))
+		page = 4096;
+	total = page + matrix_size * matrix_entry_size();
+	total = (total + page - 1) / page * page;
+
+	if ((unsigned long)st.st_size == total) {
+		map = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap matrix_file");
+			exit(1);
+		}
+		hdr = (struct matrix_header *)map;
+		built = !matrix_header_ok(hdr, page);
+		munmap(map, page);
+	} else {
+		built = 1;
+	}
+
+	if (built) {
+		fprintf(stderr, "building matrix in %s\n", path);
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, total) < 0) {
+			perror("ftruncate matrix_file");
+			exit(1);
+		}
+		map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap matrix_file");
+			exit(1);
+		}
+		hdr = (struct matrix_header *)map;
+		set_matrix(map + page);
+		fill_matrix();
+		hdr->magic = MATRIX_MAGIC;
+		hdr->version = MATRIX_LAYOUT_VERSION;
+		hdr->seed = matrix_seed;
+		hdr->entries = matrix_size;
+		hdr->entry_size = matrix_entry_size();
+		hdr->data_offset = page;
+		__atomic_store_n(&hdr->complete, 1, __ATOMIC_RELEASE);
+		munmap(map, total);
+	} else {
+		matrix_randoms(numbers);
+	}
+
+	map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap matrix_file");
+		exit(1);
+	}
+	for (off = 0; off < total; off += page)
+		((volatile char *)map)[off] = ((volatile char *)map)[off];
+	set_matrix(map + page);
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	gettimeofday(&now, NULL);
+	fprintf(stderr, "matrix %s %s in %llu ms\n", path, built ? "built" : "reused",
+		tvdelta(&start, &now) / 1000);
+}
+
+/*
+ * sets up the matrix for the current layout, either in memory or from
+ * matrix_file
+ */
+static void alloc_matrix(void)
+{
+	void *p;
+
+	if (compact_matrix) {
+		/* round down to a power of two */
+		while (matrix_size & (matrix_size - 1))
+			matrix_size &= matrix_size - 1;
+		matrix_mask = matrix_size - 1;
+	}
+	if (matrix_file) {
+		map_matrix_file(matrix_file);
+		return;
+	}
+	p = malloc(matrix_size * matrix_entry_size());
+	if (!p) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	set_matrix(p);
+	fill_matrix();
+}
+
 static inline unsigned long rdtscp(unsigned int *aux)
 {
 	unsigned int eax, edx;
@@ -176,48 +559,330 @@ static __attribute__((noinline)) unsigned long read_tsc(unsigned int *aux)
         return rdtsc(aux);
 }
 
-/* just a little bit of math and a lot of cache misses */
-static unsigned long low_ipc(unsigned long *loops)
+/* read_tsc() for a loop that must not read the clock whatever skip_rdtsc says */
+static __attribute__((noinline)) unsigned long read_none(unsigned int *aux)
 {
-	int i;
-        int j;
-        int k;
-	int src = 0;
-	int dst = 0;
+	(void)aux;
+	return 0;
+}
+
+/* TSC ticks per ns, measured once against CLOCK_MONOTONIC_RAW */
+static double tsc_ghz(void)
+{
+	static double ghz;
+	struct timespec t0, t1;
+	unsigned long c0, c1;
 	unsigned int aux;
-        unsigned long index = 0;
-        volatile unsigned long val = 0;
-
-        if (index == 0)
-                index = rand() % matrix_size;
-
-	for (i = 0; i < 1024; i++) {
-		src = global_matrix[index] % matrix_size;
-                index = (index + 1) % matrix_size;
-		dst = global_matrix[src] % matrix_size;
-
-                for (j = 0; j < 256; j++) {
-                        dst = global_matrix[(dst + j) % matrix_size] % matrix_size;
-                        if ((i * j) % 500 == 0) {
-                                val += read_tsc(&aux);
-				*loops += 1;
-                        }
-                }
 
-                /*
-                 * adjust this loop with more rounds in order to increase IPC
-                 * the goal is around 0.5
-                 */
-                for (k = 0; k < 2 * factor; k++) {
-                        global_matrix[dst] += global_matrix[(src + k) % matrix_size] +
-                                global_matrix[(dst + k) % matrix_size];
-                }
-                if (stopping)
-                        break;
+	if (ghz)
+		return ghz;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	c0 = rdtscp(&aux);
+	usleep(50000);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	c1 = rdtscp(&aux);
+	ghz = (c1 - c0) / ((t1.tv_sec - t0.tv_sec) * 1e9 + t1.tv_nsec - t0.tv_nsec);
+	return ghz;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long ua = *(const unsigned long *)a;
+	unsigned long ub = *(const unsigned long *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * the histogram bucket below which 'pct' percent of 'total' samples fall,
+ * or nr_buckets when that is past the last bucket
+ */
+static unsigned long hist_percentile(unsigned long *hist, unsigned long nr_buckets,
+				     unsigned long total, double pct)
+{
+	unsigned long want = total * pct / 100;
+	unsigned long seen = 0;
+	unsigned long i;
+
+	for (i = 0; i < nr_buckets; i++) {
+		seen += hist[i];
+		if (seen > want)
+			break;
+	}
+	return i;
+}
+
+/*
+ * per thread hardware counters.  uops don't have a generic perf event,
+ * so they are only counted on cpus where we know the raw event.
+ */
+enum perf_counter_ids {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_UOPS,
+	PERF_CACHE_MISSES,
+	PERF_FRONTEND_STALLS,
+	PERF_L1I_MISSES,
+	PERF_ITLB_MISSES,
+	NR_PERF_COUNTERS,
+};
+
+/*
+ * front end counters replace uops and cache misses when set, there
+ * usually aren't enough counters for all of them in one group
+ */
+static int perf_frontend = 0;
+/* the front end counter is the intel raw event, which counts issue slots */
+static int perf_frontend_slots = 0;
+
+struct perf_counters {
+	int fds[NR_PERF_COUNTERS];
+	unsigned long values[NR_PERF_COUNTERS];
+};
+
+static int perf_open_one(unsigned int type, unsigned long config, int group)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = group < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+#define PERF_CACHE_CONFIG(cache, op, result) \
+	((cache) | ((op) << 8) | ((result) << 16))
+
+/*
+ * the generic stalled cycles event is missing on most intel cpus, fall
+ * back to uops not delivered by the front end there (in issue slots)
+ */
+static int perf_open_frontend_stalls(int group)
+{
+	unsigned int eax, ebx, ecx, edx;
+	int fd;
+
+	fd = perf_open_one(PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND, group);
+	if (fd >= 0)
+		return fd;
+	__cpuid(0, eax, ebx, ecx, edx);
+	if (ebx == 0x756e6547) { /* "Genu" */
+		fd = perf_open_one(PERF_TYPE_RAW, 0x019c, group);
+		if (fd >= 0)
+			perf_frontend_slots = 1;
+		return fd;
+	}
+	return -1;
+}
+
+/* uops issued on intel, retired ops on amd */
+static unsigned long uops_raw_event(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	char vendor[13];
+
+	__cpuid(0, eax, ebx, ecx, edx);
+	memcpy(vendor, &ebx, 4);
+	memcpy(vendor + 4, &edx, 4);
+	memcpy(vendor + 8, &ecx, 4);
+	vendor[12] = '\0';
+	if (strcmp(vendor, "GenuineIntel") == 0)
+		return 0x010e;
+	if (strcmp(vendor, "AuthenticAMD") == 0)
+		return 0x00c1;
+	return 0;
+}
+
+/*
+ * returns -1 if we can't even count cycles, the other counters are
+ * left at -1 when they aren't available
+ */
+static int perf_open(struct perf_counters *pc)
+{
+	unsigned long uops = uops_raw_event();
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++)
+		pc->fds[i] = -1;
+	pc->fds[PERF_CYCLES] = perf_open_one(PERF_TYPE_HARDWARE,
+					     PERF_COUNT_HW_CPU_CYCLES, -1);
+	if (pc->fds[PERF_CYCLES] < 0)
+		return -1;
+	pc->fds[PERF_INSTRUCTIONS] = perf_open_one(PERF_TYPE_HARDWARE,
+						   PERF_COUNT_HW_INSTRUCTIONS,
+						   pc->fds[PERF_CYCLES]);
+	if (perf_frontend) {
+		pc->fds[PERF_FRONTEND_STALLS] = perf_open_frontend_stalls(pc->fds[PERF_CYCLES]);
+		pc->fds[PERF_L1I_MISSES] = perf_open_one(PERF_TYPE_HW_CACHE,
+			PERF_CACHE_CONFIG(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_OP_READ,
+					  PERF_COUNT_HW_CACHE_RESULT_MISS), pc->fds[PERF_CYCLES]);
+		pc->fds[PERF_ITLB_MISSES] = perf_open_one(PERF_TYPE_HW_CACHE,
+			PERF_CACHE_CONFIG(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_OP_READ,
+					  PERF_COUNT_HW_CACHE_RESULT_MISS), pc->fds[PERF_CYCLES]);
+		return 0;
+	}
+	if (uops)
+		pc->fds[PERF_UOPS] = perf_open_one(PERF_TYPE_RAW, uops,
+						   pc->fds[PERF_CYCLES]);
+	pc->fds[PERF_CACHE_MISSES] = perf_open_one(PERF_TYPE_HARDWARE,
+						   PERF_COUNT_HW_CACHE_MISSES,
+						   pc->fds[PERF_CYCLES]);
+	return 0;
+}
+
+static void perf_close(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		if (pc->fds[i] >= 0)
+			close(pc->fds[i]);
+		pc->fds[i] = -1;
+	}
+}
+
+static void perf_start(struct perf_counters *pc)
+{
+	ioctl(pc->fds[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(pc->fds[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void perf_stop(struct perf_counters *pc)
+{
+	int i;
+
+	ioctl(pc->fds[PERF_CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	for (i = 0; i < NR_PERF_COUNTERS; i++) {
+		pc->values[i] = 0;
+		if (pc->fds[i] >= 0 &&
+		    read(pc->fds[i], &pc->values[i], sizeof(pc->values[i])) < 0)
+			pc->values[i] = 0;
 	}
-	return global_matrix[dst] + val;
 }
 
+/*
+ * the ipc loops count their own instructions and cycles when asked to,
+ * perf counters only follow the thread that opened them
+ */
+static int thread_perf_start(struct thread_data *td, struct perf_counters *pc)
+{
+	if (!td->count_ipc)
+		return 0;
+	if (perf_open(pc))
+		return 0;
+	perf_start(pc);
+	return 1;
+}
+
+static void thread_perf_stop(struct thread_data *td, struct perf_counters *pc, int counting)
+{
+	td->ipc = 0;
+	td->mpki = 0;
+	if (!counting)
+		return;
+	perf_stop(pc);
+	if (pc->values[PERF_CYCLES])
+		td->ipc = (double)pc->values[PERF_INSTRUCTIONS] / pc->values[PERF_CYCLES];
+	if (pc->values[PERF_INSTRUCTIONS])
+		td->mpki = (double)pc->values[PERF_CACHE_MISSES] * 1000 /
+			pc->values[PERF_INSTRUCTIONS];
+	perf_close(pc);
+}
+
+/*
+ * low_ipc() is just a little bit of math and a lot of cache misses,
+ * high_ipc() is dumb matrix multiplication, and every so often both call
+ * read.  IPC_LOOPS makes them for one matrix layout: TYPE is the entry
+ * and WRAP keeps an index inside the matrix.  They are inlined so a
+ * constant read becomes a direct call.
+ */
+#define IPC_LOOPS(suffix, TYPE, WRAP)						\
+static inline __attribute__((always_inline)) unsigned long			\
+low_ipc##suffix(TYPE *matrix, unsigned long *loops, read_func read)		\
+{										\
+	int i, j, k;								\
+	TYPE src = 0;								\
+	TYPE dst = 0;								\
+	unsigned int aux;							\
+	unsigned long index = WRAP(rand());					\
+	volatile unsigned long val = 0;						\
+										\
+	for (i = 0; i < 1024; i++) {						\
+		src = WRAP(matrix[index]);					\
+		index = WRAP(index + 1);					\
+		dst = WRAP(matrix[src]);					\
+										\
+		for (j = 0; j < 256; j++) {					\
+			dst = WRAP(matrix[WRAP(dst + j)]);			\
+			if ((i * j) % 500 == 0) {				\
+				val += read(&aux);				\
+				*loops += 1;					\
+			}							\
+		}								\
+										\
+		/*								\
+		 * adjust this loop with more rounds in order to increase IPC	\
+		 * the goal is around 0.5					\
+		 */								\
+		for (k = 0; k < 2 * factor; k++) {				\
+			matrix[dst] += matrix[WRAP(src + k)] +			\
+				matrix[WRAP(dst + k)];				\
+		}								\
+		if (stopping)							\
+			break;							\
+	}									\
+	return matrix[dst] + val;						\
+}										\
+										\
+static inline __attribute__((always_inline)) void				\
+high_ipc##suffix(TYPE *matrix, unsigned long *loops, read_func read)		\
+{										\
+	unsigned long i, j, k;							\
+	TYPE *m1 = &matrix[0];							\
+	TYPE *m2 = &matrix[high_ipc_matrix * high_ipc_matrix];			\
+	TYPE *m3 = &matrix[2 * high_ipc_matrix * high_ipc_matrix];		\
+	unsigned int aux = 0;							\
+	unsigned long ops_count = 0;						\
+										\
+	for (i = 0; i < high_ipc_matrix; i++) {					\
+		for (j = 0; j < high_ipc_matrix; j++) {				\
+			m3[i * high_ipc_matrix + j] = 0;			\
+										\
+			for (k = 0; k < high_ipc_matrix; k++) {			\
+				m3[i * high_ipc_matrix + j] +=			\
+					m1[i * high_ipc_matrix + k] *		\
+					m2[k * high_ipc_matrix + j];		\
+				ops_count++;					\
+				if (ops_count % 500 == 0) {			\
+					read(&aux);				\
+					*loops += 1;				\
+				}						\
+				if (stopping)					\
+					return;					\
+			}							\
+		}								\
+	}									\
+}
+
+#define MATRIX_WRAP(x) ((x) % matrix_size)
+/* the compact layout has 32 bit entries and masks instead of divides */
+#define MATRIX_WRAP_COMPACT(x) ((x) & matrix_mask)
+
+IPC_LOOPS(, unsigned long, MATRIX_WRAP)
+IPC_LOOPS(_compact, unsigned int, MATRIX_WRAP_COMPACT)
+
 /*
  * does our low IPC math, which bounces around in our global matrix
  * On most machines this gives us IPC of less than 1.
@@ -230,55 +895,34 @@ void *low_ipc_thread(void *arg)
 	unsigned long long delta;
 	struct timeval now;
 	struct timeval start;
+	struct perf_counters pc;
+	int counting;
 
+	counting = thread_perf_start(td, &pc);
 	gettimeofday(&start, NULL);
 	while (!stopping) {
-		low_ipc(&loops);
+		if (compact_matrix)
+			low_ipc_compact(global_matrix32, &loops, read_tsc);
+		else
+			low_ipc(global_matrix, &loops, read_tsc);
 	}
         gettimeofday(&now, NULL);
+	thread_perf_stop(td, &pc, counting);
         delta = tvdelta(&start, &now);
 
 	calls_s = (loops * USEC_PER_SEC) / delta;
         td->calls_per_sec = calls_s;
-	fprintf(stderr, "low IPC (%s%s) loops/s %'lu\n",
-                skip_rdtsc ? "no " : "", tsc_variant, calls_s);
+	if (td->quiet)
+		return NULL;
+	if (counting)
+		fprintf(stderr, "low IPC (%s%s) loops/s %'lu ipc %.2f\n",
+			skip_rdtsc ? "no " : "", tsc_variant, calls_s, td->ipc);
+	else
+		fprintf(stderr, "low IPC (%s%s) loops/s %'lu\n",
+			skip_rdtsc ? "no " : "", tsc_variant, calls_s);
         return NULL;
 }
 
-/*
- * dumb matrix multiplication, every so often it also reads the tsc
- */
-static void high_ipc(unsigned long *loops)
-{
-	unsigned long i, j, k;
-	unsigned long *m1, *m2, *m3;
-	unsigned int aux = 0;
-        unsigned long ops_count = 0;
-
-	m1 = &global_matrix[0];
-	m2 = &global_matrix[high_ipc_matrix* high_ipc_matrix];
-	m3 = &global_matrix[2 * high_ipc_matrix * high_ipc_matrix];
-
-        for (i = 0; i < high_ipc_matrix; i++) {
-                for (j = 0; j < high_ipc_matrix; j++) {
-                        m3[i * high_ipc_matrix + j] = 0;
-
-                        for (k = 0; k < high_ipc_matrix; k++) {
-                                m3[i * high_ipc_matrix + j] +=
-                                        m1[i * high_ipc_matrix + k] *
-                                        m2[k * high_ipc_matrix + j];
-                                ops_count++;
-                                if (ops_count % 500 == 0) {
-                                        read_tsc(&aux);
-					*loops += 1;
-                                }
-                                if (stopping)
-                                        return;
-                        }
-                }
-        }
-}
-
 /*
  * does our high IPC matrix multiplication
  * on most machines this gives us IPC of at least 3.
@@ -291,18 +935,31 @@ void *high_ipc_thread(void *arg)
 	unsigned long long delta;
 	struct timeval now;
 	struct timeval start;
+	struct perf_counters pc;
+	int counting;
 
+	counting = thread_perf_start(td, &pc);
 	gettimeofday(&start, NULL);
 	while (!stopping) {
-		high_ipc(&loops);
+		if (compact_matrix)
+			high_ipc_compact(global_matrix32, &loops, read_tsc);
+		else
+			high_ipc(global_matrix, &loops, read_tsc);
 	}
         gettimeofday(&now, NULL);
+	thread_perf_stop(td, &pc, counting);
         delta = tvdelta(&start, &now);
 
 	calls_s = (loops * USEC_PER_SEC) / delta;
         td->calls_per_sec = calls_s;
-	fprintf(stderr, "High IPC (%s%s) loops/s %'lu\n",
-                skip_rdtsc ? "no " : "", tsc_variant, calls_s);
+	if (td->quiet)
+		return NULL;
+	if (counting)
+		fprintf(stderr, "High IPC (%s%s) loops/s %'lu ipc %.2f\n",
+			skip_rdtsc ? "no " : "", tsc_variant, calls_s, td->ipc);
+	else
+		fprintf(stderr, "High IPC (%s%s) loops/s %'lu\n",
+			skip_rdtsc ? "no " : "", tsc_variant, calls_s);
         return NULL;
 }
 
@@ -336,27 +993,6285 @@ void *read_tsc_thread(void *arg)
 }
 
 /*
- * makes a thread, sleeps for N seconds, sets stopping to 1, waits for completion
+ * every run_for_msecs() phase is appended to journal=FILE as soon as it
+ * finishes, one line each:
+ *
+ * <key> <seq> <thread> <clock> <calls/s> <ipc> <mpki> complete|partial
+ *
+ * key is a hash of the command line and seq counts the phases of the run.
+ * With resume, phases the journal already has complete are taken from it
+ * instead of being run again, so a sweep picks up where it was stopped.
  */
-void run_for_secs(int secs, thread_func func, struct thread_data *td)
+#define MAX_JOURNAL_PHASES 4096
+
+struct journal_phase {
+	char thread[16];
+	char clock[32];
+	unsigned long calls_per_sec;
+	double ipc;
+	double mpki;
+	int complete;
+};
+
+static char *journal_file;
+static int journal_resume;
+static unsigned long journal_key;
+static int journal_seq;
+/* what the journal had for this key, indexed by seq */
+static struct journal_phase *journal_old;
+static int nr_journal_old;
+/* phases of this run, printed again if we're interrupted */
+static struct journal_phase journal_done[MAX_JOURNAL_PHASES];
+static int nr_journal_done;
+static volatile sig_atomic_t interrupted;
+
+/* fnv-1a of the arguments that change what gets measured */
+static unsigned long journal_hash(int ac, char **av)
+{
+	unsigned long hash = 0xcbf29ce484222325UL;
+	char *p;
+	int i;
+
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "resume") == 0 || strncmp(av[i], "journal=", 8) == 0)
+			continue;
+		for (p = av[i]; ; p++) {
+			hash = (hash ^ (unsigned char)*p) * 0x100000001b3UL;
+			if (!*p)
+				break;
+		}
+	}
+	return hash;
+}
+
+static void journal_load(void)
+{
+	struct journal_phase ph;
+	char line[256], state[16];
+	unsigned long key;
+	int seq;
+	FILE *f;
+
+	f = fopen(journal_file, "r");
+	if (!f) {
+		fprintf(stderr, "no journal at %s, starting from scratch\n", journal_file);
+		return;
+	}
+	journal_old = calloc(MAX_JOURNAL_PHASES, sizeof(*journal_old));
+	if (!journal_old) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx %d %15s %31s %lu %lf %lf %15s", &key, &seq, ph.thread,
+			   ph.clock, &ph.calls_per_sec, &ph.ipc, &ph.mpki, state) != 8)
+			continue;
+		if (key != journal_key || seq < 0 || seq >= MAX_JOURNAL_PHASES)
+			continue;
+		ph.complete = strcmp(state, "complete") == 0;
+		/* a complete line wins over a partial one for the same phase */
+		if (ph.complete || !journal_old[seq].complete)
+			journal_old[seq] = ph;
+		if (seq >= nr_journal_old)
+			nr_journal_old = seq + 1;
+	}
+	fclose(f);
+	fprintf(stderr, "resuming from %s, %d phases recorded\n", journal_file, nr_journal_old);
+}
+
+static void journal_append(struct journal_phase *ph)
+{
+	char line[256];
+	int fd, len;
+
+	if (nr_journal_done < MAX_JOURNAL_PHASES)
+		journal_done[nr_journal_done++] = *ph;
+	if (!journal_file)
+		return;
+	len = snprintf(line, sizeof(line), "%016lx %d %s %s %lu %.4f %.4f %s\n", journal_key,
+		       journal_seq, ph->thread, ph->clock, ph->calls_per_sec, ph->ipc, ph->mpki,
+		       ph->complete ? "complete" : "partial");
+	/* one write per line, so a kill never leaves half of one behind */
+	fd = open(journal_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0 || write(fd, line, len) != len || fsync(fd)) {
+		fprintf(stderr, "unable to write journal %s: %s\n", journal_file, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+}
+
+static void interrupt_handler(int sig)
+{
+	interrupted = sig;
+	stopping = 1;
+}
+
+/*
+ * modes with their own threads and sleeps that don't check interrupted.
+ * A swallowed ^C would just hand back a short run as a normal result,
+ * so they keep the default signal actions.  cycle_clocksources has to
+ * put the clocksource back, which an early exit would skip.
+ */
+#define UNINTERRUPTIBLE_MODES (MODE_COSTS | MODE_UARCH | MODE_SYNTH | MODE_ICACHE | \
+	MODE_WAKEUP | MODE_DELAY | MODE_CAPTURE | MODE_TICKPHASE | MODE_OVERSUB | \
+	MODE_MODEL | MODE_STREAM | MODE_ALLOC | MODE_CYCLE_CLOCKSOURCES)
+
+/*
+ * the first ^C or SIGTERM stops the running phase and flushes what we
+ * have, a second one kills us the usual way
+ */
+static void journal_signals(void)
+{
+	struct sigaction sa;
+
+	if (run_mode & UNINTERRUPTIBLE_MODES)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = interrupt_handler;
+	sa.sa_flags = SA_RESETHAND;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static void journal_init(int ac, char **av)
+{
+	journal_key = journal_hash(ac, av);
+	if (journal_resume) {
+		if (!journal_file) {
+			fprintf(stderr, "resume needs journal=FILE\n");
+			exit(1);
+		}
+		journal_load();
+	}
+}
+
+static void journal_interrupted(void)
+{
+	int i;
+
+	fprintf(stderr, "interrupted by signal %d, results so far:\n", (int)interrupted);
+	for (i = 0; i < nr_journal_done; i++)
+		fprintf(stderr, "\t%d %s %s calls/s %'lu%s\n", i, journal_done[i].thread,
+			journal_done[i].clock, journal_done[i].calls_per_sec,
+			journal_done[i].complete ? "" : " (partial)");
+	if (journal_file)
+		fprintf(stderr, "rerun with the same arguments and resume to continue\n");
+	exit(128 + interrupted);
+}
+
+static char *thread_name(thread_func func)
+{
+	if (func == read_tsc_thread)
+		return "read";
+	if (func == low_ipc_thread)
+		return "low_ipc";
+	if (func == high_ipc_thread)
+		return "high_ipc";
+	return "other";
+}
+
+/*
+ * fills in td from the journal when resuming and it has this phase,
+ * returns 1 if it did
+ */
+static int journal_replay(thread_func func, struct thread_data *td, char *clock)
+{
+	struct journal_phase *ph;
+
+	if (journal_seq >= nr_journal_old)
+		return 0;
+	ph = &journal_old[journal_seq];
+	if (!ph->complete)
+		return 0;
+	if (strcmp(ph->thread, thread_name(func)) || strcmp(ph->clock, clock)) {
+		fprintf(stderr, "journal phase %d was %s %s, not %s %s, not resuming\n",
+			journal_seq, ph->thread, ph->clock, thread_name(func), clock);
+		nr_journal_old = 0;
+		return 0;
+	}
+	td->calls_per_sec = ph->calls_per_sec;
+	td->ipc = ph->ipc;
+	td->mpki = ph->mpki;
+	if (!td->quiet)
+		fprintf(stderr, "%s (%s) calls/s %'lu from journal\n", ph->thread, ph->clock,
+			ph->calls_per_sec);
+	if (nr_journal_done < MAX_JOURNAL_PHASES)
+		journal_done[nr_journal_done++] = *ph;
+	return 1;
+}
+
+/*
+ * makes a thread, sleeps for N milliseconds, sets stopping to 1, waits for completion
+ */
+void run_for_msecs(int msecs, thread_func func, struct thread_data *td)
 {
         pthread_t thread;
+	struct journal_phase ph = { 0 };
+	char *clock = skip_rdtsc ? "notsc" : tsc_variant;
         int ret;
 
+	if (interrupted)
+		journal_interrupted();
+	if (journal_replay(func, td, clock)) {
+		journal_seq++;
+		return;
+	}
+
         stopping = 0;
         ret = pthread_create(&thread, NULL, func, td);
         if (ret) {
                 fprintf(stderr, "pthread_create failed: %d\n", ret);
                 exit(1);
         }
-        sleep(secs);
+	/* short sleeps, the signal may land on the worker instead of us */
+	while (msecs > 0 && !interrupted) {
+		usleep((msecs < 100 ? msecs : 100) * 1000);
+		msecs -= 100;
+	}
         stopping = 1;
         pthread_join(thread, NULL);
+
+	snprintf(ph.thread, sizeof(ph.thread), "%s", thread_name(func));
+	snprintf(ph.clock, sizeof(ph.clock), "%s", clock);
+	ph.calls_per_sec = td->calls_per_sec;
+	ph.ipc = td->ipc;
+	ph.mpki = td->mpki;
+	ph.complete = !interrupted;
+	journal_append(&ph);
+	journal_seq++;
+	if (interrupted)
+		journal_interrupted();
 }
 
-#if 0
-void test_clock_gettime(void)
-{
+/*
+ * makes a thread, sleeps for N seconds, sets stopping to 1, waits for completion
+ */
+void run_for_secs(int secs, thread_func func, struct thread_data *td)
+{
+	run_for_msecs(secs * 1000, func, td);
+}
+
+#define CALIBRATE_PROBE_MSECS 250
+#define CALIBRATE_MAX_FACTOR (1 << 20)
+#define CALIBRATE_MIN_MATRIX 8
+
+/* one short quiet run of the ipc loop without tsc reads, returns its IPC */
+static double probe_ipc(thread_func func)
+{
+	struct thread_data td = { 0 };
+
+	td.count_ipc = 1;
+	td.quiet = 1;
+	run_for_msecs(CALIBRATE_PROBE_MSECS, func, &td);
+	return td.ipc;
+}
+
+/*
+ * more rounds of the inner loop in low_ipc() raise IPC, binary search
+ * for the smallest factor that reaches the target
+ */
+static void calibrate_low_ipc(double target)
+{
+	int lo = 1;
+	int hi = 1;
+	double ipc;
+
+	factor = 1;
+	ipc = probe_ipc(low_ipc_thread);
+	while (ipc < target && hi < CALIBRATE_MAX_FACTOR) {
+		lo = hi;
+		hi *= 2;
+		factor = hi;
+		ipc = probe_ipc(low_ipc_thread);
+	}
+	while (lo < hi) {
+		factor = (lo + hi) / 2;
+		if (probe_ipc(low_ipc_thread) < target)
+			lo = factor + 1;
+		else
+			hi = factor;
+	}
+	factor = lo;
+	fprintf(stderr, "calibrated factor=%d for ipc %.2f\n", factor, target);
+}
+
+/*
+ * a bigger matrix in high_ipc() misses the cache more often and lowers
+ * IPC, binary search for the largest matrix that still reaches the target
+ */
+static void calibrate_high_ipc(double target)
+{
+	unsigned long lo = CALIBRATE_MIN_MATRIX;
+	unsigned long hi = CALIBRATE_MIN_MATRIX;
+
+	/* three matrices have to fit in global_matrix */
+	while ((hi + 1) * (hi + 1) * 3 <= matrix_size)
+		hi++;
+	while (lo < hi) {
+		high_ipc_matrix = (lo + hi + 1) / 2;
+		if (probe_ipc(high_ipc_thread) >= target)
+			lo = high_ipc_matrix;
+		else
+			hi = high_ipc_matrix - 1;
+	}
+	high_ipc_matrix = lo;
+	fprintf(stderr, "calibrated high_ipc_matrix=%lu for ipc %.2f\n",
+		high_ipc_matrix, target);
+}
+
+/*
+ * ipc=X picks the loop knob with short perf counted probes, so runs on
+ * different cpus can be compared at the same IPC.  The probes run
+ * without tsc reads, the IPC is a property of the workload.
+ */
+static int calibrate_ipc(double target)
+{
+	struct perf_counters pc;
+	int saved_skip = skip_rdtsc;
+
+	if (perf_open(&pc)) {
+		fprintf(stderr, "perf counters unavailable, can't calibrate for ipc %.2f\n",
+			target);
+		return -1;
+	}
+	perf_close(&pc);
+
+	skip_rdtsc = 1;
+	if (run_mode & MODE_LOW_IPC)
+		calibrate_low_ipc(target);
+	if (run_mode & MODE_HIGH_IPC)
+		calibrate_high_ipc(target);
+	skip_rdtsc = saved_skip;
+	return 0;
+}
+
+/*
+ * costs=FILE measures each of the calls libclockprof.so interposes.
+ * Clock ids >= 0 are read with clock_gettime()
+ */
+#define COST_GETTIMEOFDAY -1
+#define COST_TIME -2
+static int cost_clock;
+static int cost_secs = 1;
+static char *cost_file;
+
+/*
+ * reads cost_clock in a loop until stopping is set
+ */
+void *clock_cost_thread(void *arg)
+{
+        struct thread_data *td = arg;
+	unsigned long loops = 0;
+	unsigned long long delta;
+	struct timeval now;
+	struct timeval start;
+	struct timespec ts;
+	struct timeval tv;
+
+	gettimeofday(&start, NULL);
+	while (!stopping) {
+		loops++;
+		if (cost_clock == COST_GETTIMEOFDAY)
+			gettimeofday(&tv, NULL);
+		else if (cost_clock == COST_TIME)
+			time(NULL);
+		else
+			clock_gettime(cost_clock, &ts);
+	}
+        gettimeofday(&now, NULL);
+        delta = tvdelta(&start, &now);
+
+        td->calls_per_sec = (loops * USEC_PER_SEC) / delta;
+        return NULL;
+}
+
+/*
+ * writes one "name ns_per_call" line for each clock, in the format
+ * libclockprof.so reads from CLOCKPROF_COSTS
+ */
+void write_clock_costs(char *path)
+{
+	struct thread_data td = { 0 };
+	struct timespec ts;
+	char name[64];
+	double ns;
+	FILE *f;
+	int clk;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror("fopen");
+		exit(1);
+	}
+	fprintf(f, "# tsc clock costs, ns per call\n");
+	for (clk = COST_TIME; clk <= CLOCK_NON_MONOTONIC; clk++) {
+		/* skip the clock ids this kernel doesn't have */
+		if (clk >= 0 && clock_gettime(clk, &ts) < 0)
+			continue;
+		if (clk == COST_GETTIMEOFDAY)
+			strcpy(name, "gettimeofday");
+		else if (clk == COST_TIME)
+			strcpy(name, "time");
+		else
+			snprintf(name, sizeof(name), "clock_gettime:%d", clk);
+
+		cost_clock = clk;
+		run_for_secs(cost_secs, clock_cost_thread, &td);
+		ns = 1e9 / td.calls_per_sec;
+		fprintf(stderr, "%s %.2f ns/call\n", name, ns);
+		fprintf(f, "%s %.2f\n", name, ns);
+	}
+	fclose(f);
+}
+
+#ifndef CLONE_NEWTIME
+#define CLONE_NEWTIME 0x00000080
+#endif
+
+/* how far the time namespace moves CLOCK_MONOTONIC and CLOCK_BOOTTIME */
+#define TIMENS_OFFSET_SECS (7 * 24 * 3600)
+
+struct timens_result {
+	unsigned long read_calls;
+	unsigned long ipc_loops;
+};
+
+/*
+ * forks a child to run read_tsc_thread() and the IPC loop, and sends the
+ * results back over a pipe.  Children of a process that unshared
+ * CLONE_NEWTIME are the first ones to actually live in the new namespace.
+ */
+static int timens_fork_measure(struct timens_result *res)
+{
+	struct thread_data td = { 0 };
+	struct timespec before;
+	struct timespec mono;
+	int fds[2];
+	int status;
+	pid_t pid;
+	int ret;
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		/* sanity check that the namespace offset is really there */
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		fprintf(stderr, "CLOCK_MONOTONIC offset %ld s\n",
+			(long)(mono.tv_sec - before.tv_sec));
+
+		run_for_secs(runtime, read_tsc_thread, &td);
+		res->read_calls = td.calls_per_sec;
+		if (run_mode & MODE_HIGH_IPC)
+			run_for_secs(runtime, high_ipc_thread, &td);
+		else
+			run_for_secs(runtime, low_ipc_thread, &td);
+		res->ipc_loops = td.calls_per_sec;
+
+		if (write(fds[1], res, sizeof(*res)) != sizeof(*res))
+			_exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	ret = read(fds[0], res, sizeof(*res));
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	if (ret != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "timens child failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * moves our future children into a new time namespace with shifted
+ * monotonic and boottime clocks.  Unprivileged users get the time
+ * namespace inside a new user namespace.  quiet only keeps the notes
+ * to ourselves, failures are always printed.
+ */
+static int enter_timens(int quiet)
+{
+	char buf[128];
+	int len;
+	int fd;
+
+	if (unshare(CLONE_NEWTIME) < 0) {
+		if (errno != EPERM ||
+		    unshare(CLONE_NEWUSER | CLONE_NEWTIME) < 0) {
+			fprintf(stderr, "time namespaces unavailable: %s, skipping\n",
+				strerror(errno));
+			return -1;
+		}
+		if (!quiet)
+			fprintf(stderr, "using a user namespace for the time namespace\n");
+	}
+
+	len = snprintf(buf, sizeof(buf), "monotonic %d 0\nboottime %d 0\n",
+		       TIMENS_OFFSET_SECS, TIMENS_OFFSET_SECS);
+	fd = open("/proc/self/timens_offsets", O_WRONLY);
+	if (fd < 0 || write(fd, buf, len) != len) {
+		fprintf(stderr, "unable to set time namespace offsets: %s, skipping\n",
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * tries enter_timens() in a throwaway child, so we find out if time
+ * namespaces work before spending the runtime in the root namespace
+ */
+static int probe_timens(void)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0)
+		_exit(enter_timens(1) ? 1 : 0);
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+ * inside a time namespace the vDSO reads a per-namespace vvar page and
+ * adds the offsets to CLOCK_MONOTONIC and CLOCK_BOOTTIME.  Measure the
+ * same loops in the root namespace and in a time namespace.  Both runs
+ * happen in forked children so they pay the same copy on write costs
+ * for the matrix.
+ */
+void run_timens(void)
+{
+	struct timens_result root = { 0 };
+	struct timens_result ns = { 0 };
+	char *ipc = (run_mode & MODE_HIGH_IPC) ? "high" : "low";
+
+	if (probe_timens())
+		return;
+
+	fprintf(stderr, "root namespace:\n");
+	if (timens_fork_measure(&root)) {
+		if (interrupted)
+			journal_interrupted();
+		exit(1);
+	}
+
+	if (enter_timens(0))
+		return;
+
+	fprintf(stderr, "time namespace:\n");
+	if (timens_fork_measure(&ns)) {
+		if (interrupted)
+			journal_interrupted();
+		exit(1);
+	}
+
+	fprintf(stderr, "%s calls/s root %'lu timens %'lu ratio %.3f (%+.2f ns/call)\n",
+		tsc_variant, root.read_calls, ns.read_calls,
+		(double)ns.read_calls / root.read_calls,
+		1e9 / ns.read_calls - 1e9 / root.read_calls);
+	fprintf(stderr, "%s IPC loops/s root %'lu timens %'lu ratio %.3f\n",
+		ipc, root.ipc_loops, ns.ipc_loops,
+		(double)ns.ipc_loops / root.ipc_loops);
+}
+
+#define CLOCKSOURCE_DIR "/sys/devices/system/clocksource/clocksource0"
+
+/* the vcpu 0 entry of the pvclock page the vDSO reads for kvm-clock */
+struct pvclock_vcpu_time_info {
+	unsigned int version;
+	unsigned int pad0;
+	unsigned long tsc_timestamp;
+	unsigned long system_time;
+	unsigned int tsc_to_system_mul;
+	signed char tsc_shift;
+	unsigned char flags;
+	unsigned char pad[2];
+} __attribute__((__packed__));
+
+#define PVCLOCK_TSC_STABLE_BIT (1 << 0)
+
+static volatile struct pvclock_vcpu_time_info *pvclock_page;
+static sigjmp_buf probe_jmp;
+
+/*
+ * reads a sysfs file into buf and strips the newline
+ */
+static int read_sysfs(char *path, char *buf, int len)
+{
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int write_sysfs(char *path, char *val)
+{
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	if (fputs(val, f) < 0)
+		ret = -1;
+	if (fclose(f))
+		ret = -1;
+	return ret;
+}
+
+/*
+ * returns the hypervisor vendor string from cpuid, or NULL on bare metal
+ */
+static char *hypervisor_vendor(char *buf)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (!(ecx & (1U << 31)))
+		return NULL;
+	__cpuid(0x40000000, eax, ebx, ecx, edx);
+	memcpy(buf, &ebx, 4);
+	memcpy(buf + 4, &ecx, 4);
+	memcpy(buf + 8, &edx, 4);
+	buf[12] = '\0';
+	return buf;
+}
+
+static inline unsigned long pvclock_read(volatile struct pvclock_vcpu_time_info *pv)
+{
+	unsigned int version;
+	unsigned int aux;
+	unsigned long delta;
+	unsigned long ns;
+
+	do {
+		version = pv->version;
+		delta = rdtsc_lfence(&aux) - pv->tsc_timestamp;
+		if (pv->tsc_shift < 0)
+			delta >>= -pv->tsc_shift;
+		else
+			delta <<= pv->tsc_shift;
+		ns = pv->system_time +
+			(unsigned long)(((unsigned __int128)delta * pv->tsc_to_system_mul) >> 32);
+		__asm__ __volatile__("" ::: "memory");
+	} while ((version & 1) || version != pv->version);
+	return ns;
+}
+
+static void probe_fault(int sig)
+{
+	siglongjmp(probe_jmp, sig);
+}
+
+/*
+ * pages in the vvar area that don't apply to the current clocksource
+ * SIGBUS when touched, so probe them with a handler installed
+ */
+static int probe_pvclock(volatile struct pvclock_vcpu_time_info *pv)
+{
+	struct sigaction sa = { 0 };
+	struct sigaction old_bus;
+	struct sigaction old_segv;
+	struct timespec t0, t1;
+	unsigned long pv0, pv1;
+	double rate;
+	int ret = 0;
+
+	sa.sa_handler = probe_fault;
+	sigaction(SIGBUS, &sa, &old_bus);
+	sigaction(SIGSEGV, &sa, &old_segv);
+	if (sigsetjmp(probe_jmp, 1) == 0) {
+		if (!(pv->version & 1) && (pv->flags & PVCLOCK_TSC_STABLE_BIT) &&
+		    pv->tsc_to_system_mul && pv->tsc_shift >= -32 && pv->tsc_shift <= 32) {
+			/* the page has to tick at the same rate as the real clock */
+			clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+			pv0 = pvclock_read(pv);
+			usleep(10000);
+			clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+			pv1 = pvclock_read(pv);
+			rate = (double)(pv1 - pv0) /
+				((t1.tv_sec - t0.tv_sec) * 1e9 + t1.tv_nsec - t0.tv_nsec);
+			ret = rate > 0.99 && rate < 1.01;
+		}
+	}
+	sigaction(SIGBUS, &old_bus, NULL);
+	sigaction(SIGSEGV, &old_segv, NULL);
+	return ret;
+}
+
+/*
+ * the kernel doesn't tell us where the pvclock page is, so look at the
+ * start of every page in the vvar mappings for something that acts like one
+ */
+static volatile struct pvclock_vcpu_time_info *find_pvclock_page(void)
+{
+	FILE *f;
+	char line[512];
+	unsigned long start, end, addr;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		return NULL;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strstr(line, "[vvar"))
+			continue;
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+			continue;
+		for (addr = start; addr < end; addr += 4096) {
+			if (probe_pvclock((void *)addr)) {
+				fclose(f);
+				return (void *)addr;
+			}
+		}
+	}
+	fclose(f);
+	return NULL;
+}
+
+/*
+ * reads the pvclock page in a loop until stopping is set
+ */
+void *pvclock_thread(void *arg)
+{
+        struct thread_data *td = arg;
+	unsigned long loops = 0;
+	unsigned long calls_s;
+	unsigned long long delta;
+	struct timeval now;
+	struct timeval start;
+	volatile unsigned long val = 0;
+
+	gettimeofday(&start, NULL);
+	while (!stopping) {
+		loops++;
+		val += pvclock_read(pvclock_page);
+	}
+        gettimeofday(&now, NULL);
+        delta = tvdelta(&start, &now);
+
+	calls_s = (loops * USEC_PER_SEC) / delta;
+        td->calls_per_sec = calls_s;
+	fprintf(stderr, "pvclock page calls/s %'lu\n", calls_s);
+        return NULL;
+}
+
+#define TRAP_SAMPLES 100000
+
+/*
+ * a trapped rdtsc costs a full VM exit, and the emulated TSC keeps
+ * running while the hypervisor handles it.  cpuid always exits, so it
+ * gives us the exit cost to compare against.
+ */
+static void check_rdtsc_trapping(char *vendor)
+{
+	unsigned long t0, t1;
+	unsigned long rdtsc_min = ~0UL;
+	unsigned long cpuid_min = ~0UL;
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int aux;
+	int i;
+
+	for (i = 0; i < TRAP_SAMPLES; i++) {
+		t0 = rdtsc(&aux);
+		t1 = rdtsc(&aux);
+		if (t1 - t0 < rdtsc_min)
+			rdtsc_min = t1 - t0;
+
+		t0 = rdtsc(&aux);
+		__cpuid(0, eax, ebx, ecx, edx);
+		t1 = rdtsc(&aux);
+		if (t1 - t0 < cpuid_min)
+			cpuid_min = t1 - t0;
+	}
+	fprintf(stderr, "rdtsc back to back min %lu cycles, cpuid min %lu cycles\n",
+		rdtsc_min, cpuid_min);
+	if (!vendor)
+		return;
+	if (rdtsc_min * 4 > cpuid_min)
+		fprintf(stderr, "rdtsc costs about as much as a VM exit, it is probably trapped\n");
+	else
+		fprintf(stderr, "rdtsc is not trapped\n");
+}
+
+/*
+ * runs the clock loop and the IPC loop with the current clocksource
+ */
+static void run_clocksource(char *name, struct thread_data *td)
+{
+	struct thread_data ipc = { 0 };
+
+	run_for_secs(runtime, read_tsc_thread, td);
+	if (run_mode & MODE_HIGH_IPC)
+		run_for_secs(runtime, high_ipc_thread, &ipc);
+	else
+		run_for_secs(runtime, low_ipc_thread, &ipc);
+	fprintf(stderr, "clocksource %s %s calls/s %'lu IPC loops/s %'lu\n",
+		name, tsc_variant, td->calls_per_sec, ipc.calls_per_sec);
+}
+
+/*
+ * switches between every available clocksource through sysfs, and puts
+ * the original back when we're done.  Only meant for test VMs.
+ */
+static void cycle_clocksources(char *current)
+{
+	struct thread_data td = { 0 };
+	char available[512];
+	char *name;
+	char *save;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "cycle_clocksources needs root, skipping\n");
+		return;
+	}
+	if (read_sysfs(CLOCKSOURCE_DIR "/available_clocksource", available,
+		       sizeof(available))) {
+		fprintf(stderr, "unable to read available clocksources, skipping\n");
+		return;
+	}
+	for (name = strtok_r(available, " ", &save); name;
+	     name = strtok_r(NULL, " ", &save)) {
+		if (write_sysfs(CLOCKSOURCE_DIR "/current_clocksource", name)) {
+			fprintf(stderr, "unable to switch to clocksource %s\n", name);
+			continue;
+		}
+		run_clocksource(name, &td);
+	}
+	if (write_sysfs(CLOCKSOURCE_DIR "/current_clocksource", current))
+		fprintf(stderr, "unable to restore clocksource %s\n", current);
+}
+
+void run_virt(void)
+{
+	struct thread_data td = { 0 };
+	char vendor_buf[13];
+	char current[64];
+	char *vendor;
+
+	vendor = hypervisor_vendor(vendor_buf);
+	fprintf(stderr, "hypervisor: %s\n", vendor ? vendor : "none");
+	if (read_sysfs(CLOCKSOURCE_DIR "/current_clocksource", current, sizeof(current)))
+		strcpy(current, "unknown");
+	fprintf(stderr, "clocksource: %s\n", current);
+
+	check_rdtsc_trapping(vendor);
+
+	pvclock_page = find_pvclock_page();
+	if (pvclock_page) {
+		fprintf(stderr, "found pvclock page at %p\n", pvclock_page);
+		run_for_secs(runtime, pvclock_thread, &td);
+	} else {
+		fprintf(stderr, "no pvclock page mapped, skipping pvclock reads\n");
+	}
+	run_for_secs(runtime, read_tsc_thread, &td);
+
+	if (run_mode & MODE_CYCLE_CLOCKSOURCES)
+		cycle_clocksources(current);
+}
+
+/*
+ * uarch-bench style kernels.  Every kernel runs 8 copies of a timestamp
+ * read followed by a fixed body per loop iteration.  The "none" variant
+ * has no read at all and gives us the baseline for each body.
+ *
+ * indep: reads with nothing else, results thrown away (reciprocal throughput)
+ * chain: each result is folded into an add/imul dependency chain ending in
+ *        an lfence.  The reads take no input, so the lfence is what makes
+ *        the next read wait for the chain and with it the last read (latency)
+ * load, store, mul, div: reads mixed with a fixed set of other work, to
+ *        show which ports and resources the read competes for
+ */
+#define REP8(x) x x x x x x x x
+
+#define UARCH_PROLOGUE \
+	"mov $3, %%r8\n\t" \
+	"mov $0x7fffffff, %%r9d\n\t" \
+	"mov $5, %%r10\n\t" \
+	"mov $7, %%r11d\n\t" \
+	"mov $1, %%rbx\n\t" \
+	"xor %%eax, %%eax\n\t"
+
+#define UARCH_CHAIN "add %%rax, %%rbx\n\timul %%rbx, %%rbx\n\tlfence\n\t"
+#define UARCH_LOAD \
+	"mov (%[buf]), %%r8\n\tmov 8(%[buf]), %%r9\n\t" \
+	"mov 16(%[buf]), %%r10\n\tmov 24(%[buf]), %%r8\n\t"
+#define UARCH_STORE \
+	"mov %%r8, 32(%[buf])\n\tmov %%r9, 40(%[buf])\n\t" \
+	"mov %%r10, 48(%[buf])\n\tmov %%r8, 56(%[buf])\n\t"
+#define UARCH_MUL \
+	"imul %%r8, %%r8\n\timul %%r9, %%r9\n\t" \
+	"imul %%r10, %%r10\n\timul %%rbx, %%rbx\n\t"
+#define UARCH_DIV "mov %%r9d, %%eax\n\txor %%edx, %%edx\n\tdiv %%r11d\n\t"
+
+#define UARCH_KERNEL(name, rd, body)					\
+static void uarch_##name(unsigned long iters, unsigned long *buf)	\
+{									\
+	__asm__ __volatile__(UARCH_PROLOGUE				\
+			     "1:\n\t"					\
+			     REP8(rd body)				\
+			     "dec %[iters]\n\t"				\
+			     "jnz 1b\n\t"				\
+			     : [iters] "+r"(iters)			\
+			     : [buf] "r"(buf)				\
+			     : "rax", "rbx", "rcx", "rdx", "r8", "r9",	\
+			       "r10", "r11", "memory", "cc");		\
+}
+
+#define UARCH_VARIANT(v, rd)				\
+	UARCH_KERNEL(v##_indep, rd, "")			\
+	UARCH_KERNEL(v##_chain, rd, UARCH_CHAIN)	\
+	UARCH_KERNEL(v##_load, rd, UARCH_LOAD)		\
+	UARCH_KERNEL(v##_store, rd, UARCH_STORE)	\
+	UARCH_KERNEL(v##_mul, rd, UARCH_MUL)		\
+	UARCH_KERNEL(v##_div, rd, UARCH_DIV)
+
+UARCH_VARIANT(none, "")
+UARCH_VARIANT(rdtsc, "rdtsc\n\t")
+UARCH_VARIANT(rdtscp, "rdtscp\n\t")
+UARCH_VARIANT(rdtsc_lfence, "lfence\n\trdtsc\n\t")
+UARCH_VARIANT(rdpid, "rdpid %%rax\n\t")
+UARCH_VARIANT(rdtscp_lfence, "rdtscp\n\tlfence\n\t")
+
+enum uarch_features {
+	UARCH_NEEDS_RDTSCP = 1 << 0,
+	UARCH_NEEDS_RDPID = 1 << 1,
+};
+
+#define UARCH_NR_SHAPES 6
+#define UARCH_ENTRIES(v, features)				\
+	{ #v, "indep", uarch_##v##_indep, features },		\
+	{ #v, "chain", uarch_##v##_chain, features },		\
+	{ #v, "load", uarch_##v##_load, features },		\
+	{ #v, "store", uarch_##v##_store, features },		\
+	{ #v, "mul", uarch_##v##_mul, features },		\
+	{ #v, "div", uarch_##v##_div, features }
+
+struct uarch_kernel {
+	char *variant;
+	char *shape;
+	void (*func)(unsigned long iters, unsigned long *buf);
+	int features;
+};
+
+static struct uarch_kernel uarch_kernels[] = {
+	UARCH_ENTRIES(none, 0),
+	UARCH_ENTRIES(rdtsc, 0),
+	UARCH_ENTRIES(rdtscp, UARCH_NEEDS_RDTSCP),
+	UARCH_ENTRIES(rdtsc_lfence, 0),
+	UARCH_ENTRIES(rdpid, UARCH_NEEDS_RDPID),
+	UARCH_ENTRIES(rdtscp_lfence, UARCH_NEEDS_RDTSCP),
+};
+
+#define UARCH_ITERS 100000
+#define UARCH_RUNS 5
+
+static int cpu_features(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	int features = 0;
+
+	if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (edx & (1U << 27)))
+		features |= UARCH_NEEDS_RDTSCP;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ecx & (1U << 22)))
+		features |= UARCH_NEEDS_RDPID;
+	return features;
+}
+
+/*
+ * runs one kernel a few times and keeps the fastest run.  Without perf
+ * counters we fall back to TSC cycles and have no uops.
+ */
+static void uarch_measure(struct uarch_kernel *k, struct perf_counters *pc,
+			  int have_perf, double *cycles, double *uops)
+{
+	static unsigned long buf[8] __attribute__((aligned(64)));
+	unsigned long best = ~0UL;
+	unsigned long best_uops = 0;
+	unsigned long t0, t1;
+	unsigned int aux;
+	int i;
+
+	/* warm up */
+	k->func(UARCH_ITERS / 10, buf);
+	for (i = 0; i < UARCH_RUNS; i++) {
+		unsigned long c;
+
+		if (have_perf)
+			perf_start(pc);
+		t0 = rdtscp(&aux);
+		k->func(UARCH_ITERS, buf);
+		t1 = rdtscp(&aux);
+		if (have_perf) {
+			perf_stop(pc);
+			c = pc->values[PERF_CYCLES];
+		} else {
+			c = t1 - t0;
+		}
+		if (c < best) {
+			best = c;
+			best_uops = have_perf ? pc->values[PERF_UOPS] : 0;
+		}
+	}
+	*cycles = (double)best / (UARCH_ITERS * 8);
+	*uops = (double)best_uops / (UARCH_ITERS * 8);
+}
+
+void run_uarch(void)
+{
+	struct perf_counters pc;
+	double base_cycles[UARCH_NR_SHAPES];
+	double base_uops[UARCH_NR_SHAPES];
+	int nr = sizeof(uarch_kernels) / sizeof(uarch_kernels[0]);
+	int features = cpu_features();
+	int have_perf;
+	int have_uops;
+	int i;
+
+	have_perf = perf_open(&pc) == 0;
+	have_uops = have_perf && pc.fds[PERF_UOPS] >= 0;
+	if (!have_perf)
+		fprintf(stderr, "perf counters unavailable, using TSC cycles and no uops\n");
+	else if (!have_uops)
+		fprintf(stderr, "no uops counter on this cpu\n");
+
+	for (i = 0; i < nr; i++) {
+		struct uarch_kernel *k = &uarch_kernels[i];
+		int shape = i % UARCH_NR_SHAPES;
+		double cycles, uops;
+
+		if ((k->features & features) != k->features) {
+			if (shape == 0)
+				fprintf(stderr, "%s not supported, skipping\n", k->variant);
+			continue;
+		}
+		uarch_measure(k, &pc, have_perf, &cycles, &uops);
+		if (i < UARCH_NR_SHAPES) {
+			base_cycles[shape] = cycles;
+			base_uops[shape] = uops;
+			fprintf(stderr, "%-14s %-6s baseline cycles/body %6.2f", k->variant,
+				k->shape, cycles);
+			if (have_uops)
+				fprintf(stderr, " uops/body %6.2f", uops);
+			fprintf(stderr, "\n");
+			continue;
+		}
+		fprintf(stderr, "%-14s %-6s cycles/read %6.2f (%+6.2f)", k->variant,
+			k->shape, cycles, cycles - base_cycles[shape]);
+		if (have_uops)
+			fprintf(stderr, " uops/read %6.2f (%+6.2f)", uops,
+				uops - base_uops[shape]);
+		fprintf(stderr, "\n");
+	}
+	if (have_perf)
+		perf_close(&pc);
+}
+
+/*
+ * synth generates its workload at runtime.  A loop body has a mix of
+ * pointer chasing loads, add chains and never taken branches, and the
+ * timestamp read is spliced in every stamp_every instructions.  Since
+ * we write the code ourselves we know exactly how many instructions it
+ * runs, and the mix can be tuned until the loop hits a target IPC.
+ */
+struct synth_mix {
+	int loads;
+	int alu;
+	int branches;
+	/* how many alu ops in a row depend on each other */
+	int depth;
+};
+
+static struct synth_mix synth_mix = { 1, 64, 1, 1 };
+static int synth_mix_set = 0;
+static int stamp_every = 1000;
+
+/* buffer sizes (in entries) the tuner tries, roughly DRAM, LLC, L2 and L1 */
+static unsigned long synth_levels[] = { 8 << 20, 512 << 10, 16 << 10, 1 << 10 };
+#define SYNTH_NR_LEVELS (sizeof(synth_levels) / sizeof(synth_levels[0]))
+#define SYNTH_MAX_ALU 1024
+
+static unsigned long *synth_buf;
+static unsigned long synth_buf_entries;
+
+typedef unsigned long (*synth_func)(unsigned long iters, unsigned long *buf);
+
+struct jit {
+	unsigned char *code;
+	size_t size;
+	size_t len;
+};
+
+static void jit_emit(struct jit *j, const unsigned char *bytes, size_t n)
+{
+	if (j->len + n > j->size) {
+		fprintf(stderr, "jit buffer overflow\n");
+		exit(1);
+	}
+	memcpy(j->code + j->len, bytes, n);
+	j->len += n;
+}
+
+#define EMIT(j, ...) do {					\
+	unsigned char __b[] = { __VA_ARGS__ };			\
+	jit_emit(j, __b, sizeof(__b));				\
+} while (0)
+
+/* registers for the add chains, r8, r9, r10 and rbx */
+static int synth_chain_regs[] = { 8, 9, 10, 3 };
+
+/* mov (%rsi,%r11,8), %r11 -- every load depends on the one before it */
+static void emit_load(struct jit *j)
+{
+	EMIT(j, 0x4e, 0x8b, 0x1c, 0xde);
+}
+
+/*
+ * add %rdi, %reg -- register to register, newer cores fold chains of
+ * add $imm into the renamer
+ */
+static void emit_alu(struct jit *j, int reg)
+{
+	EMIT(j, 0x48 | (reg >> 3), 0x01, 0xf8 | (reg & 7));
+}
+
+/* lea 1(%rdi), %reg -- starts a new chain, it doesn't read the old value */
+static void emit_chain_start(struct jit *j, int reg)
+{
+	EMIT(j, 0x48 | ((reg >> 3) << 2), 0x8d, 0x47 | ((reg & 7) << 3), 0x01);
+}
+
+/* test %rsi, %rsi; jz .+0 -- rsi is the buffer, so this is never taken */
+static void emit_branch(struct jit *j)
+{
+	EMIT(j, 0x48, 0x85, 0xf6, 0x74, 0x00);
+}
+
+/*
+ * the stamp matches the clock mode.  Plain instructions are inlined,
+ * clock_gettime goes through read_tsc() like the other loops do, so we
+ * have to save the registers the body is using.
+ */
+static void emit_stamp(struct jit *j)
+{
+	unsigned long addr = (unsigned long)read_tsc;
+	int i;
+
+	if (run_mode & MODE_NO_TSC)
+		return;
+	if (run_mode & MODE_RDTSCP) {
+		EMIT(j, 0x0f, 0x01, 0xf9);
+		return;
+	}
+	if (run_mode & MODE_RDTSC_LFENCE) {
+		EMIT(j, 0x0f, 0xae, 0xe8, 0x0f, 0x31);
+		return;
+	}
+	if (run_mode & MODE_RDTSC) {
+		EMIT(j, 0x0f, 0x31);
+		return;
+	}
+	/*
+	 * the prologue pushed rbx, so after pushing rdi, rsi, r8-r11 and rcx
+	 * we need 8 more bytes for the stack to be 16 byte aligned at the call
+	 */
+	EMIT(j, 0x48, 0x83, 0xec, 0x08);
+	EMIT(j, 0x57, 0x56, 0x41, 0x50, 0x41, 0x51, 0x41, 0x52, 0x41, 0x53, 0x51);
+	/* mov %rsp, %rdi; read_tsc() writes aux over the saved rcx */
+	EMIT(j, 0x48, 0x89, 0xe7);
+	/* movabs $read_tsc, %rax; call *%rax */
+	EMIT(j, 0x48, 0xb8);
+	for (i = 0; i < 8; i++)
+		EMIT(j, (addr >> (i * 8)) & 0xff);
+	EMIT(j, 0xff, 0xd0);
+	EMIT(j, 0x59, 0x41, 0x5b, 0x41, 0x5a, 0x41, 0x59, 0x41, 0x58, 0x5e, 0x5f);
+	EMIT(j, 0x48, 0x83, 0xc4, 0x08);
+}
+
+/* spread the loads, alu ops and branches evenly over the body */
+static void emit_body(struct jit *j, struct synth_mix *m)
+{
+	int l = 0, a = 0, b = 0;
+	int depth = m->depth > 0 ? m->depth : 1;
+
+	while (l < m->loads || a < m->alu || b < m->branches) {
+		double fl = l < m->loads ? (double)l / m->loads : 2;
+		double fa = a < m->alu ? (double)a / m->alu : 2;
+		double fb = b < m->branches ? (double)b / m->branches : 2;
+
+		if (fl <= fa && fl <= fb) {
+			emit_load(j);
+			l++;
+		} else if (fa <= fb) {
+			/* chains are 'depth' ops long, taking turns on the registers */
+			int reg = synth_chain_regs[(a / depth) % 4];
+
+			if (a % depth == 0)
+				emit_chain_start(j, reg);
+			else
+				emit_alu(j, reg);
+			a++;
+		} else {
+			emit_branch(j);
+			b++;
+		}
+	}
+}
+
+static int synth_body_insns(struct synth_mix *m)
+{
+	return m->loads + m->alu + 2 * m->branches;
+}
+
+/* how many bodies we run between stamps */
+static int synth_bodies(struct synth_mix *m)
+{
+	int insns = synth_body_insns(m);
+
+	if (!insns || stamp_every <= insns)
+		return 1;
+	return stamp_every / insns;
+}
+
+/*
+ * builds unsigned long func(unsigned long iters, unsigned long *buf).
+ * Every iteration runs 'bodies' copies of the body and, if stamped,
+ * one timestamp read.
+ */
+static synth_func synth_generate(struct synth_mix *m, int bodies, int stamped,
+				 struct jit *j)
+{
+	size_t loop;
+	int rel;
+	int i;
+
+	j->size = (size_t)bodies * (m->loads * 4 + m->alu * 4 + m->branches * 5) + 4096;
+	j->size = (j->size + 4095) & ~4095UL;
+	j->len = 0;
+	j->code = mmap(NULL, j->size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j->code == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	/* push %rbx; seed the chains; xor %r11, %r11 */
+	EMIT(j, 0x53);
+	for (i = 0; i < 4; i++) {
+		int reg = synth_chain_regs[i];
+
+		EMIT(j, 0x48 | (reg >> 3), 0xc7, 0xc0 | (reg & 7), i + 1, 0, 0, 0);
+	}
+	EMIT(j, 0x4d, 0x31, 0xdb);
+
+	loop = j->len;
+	for (i = 0; i < bodies; i++)
+		emit_body(j, m);
+	if (stamped)
+		emit_stamp(j);
+	/* dec %rdi; jnz loop */
+	EMIT(j, 0x48, 0xff, 0xcf);
+	rel = (int)loop - (int)(j->len + 6);
+	EMIT(j, 0x0f, 0x85, rel & 0xff, (rel >> 8) & 0xff, (rel >> 16) & 0xff,
+	     (rel >> 24) & 0xff);
+
+	/* mov %r11, %rax; pop %rbx; ret */
+	EMIT(j, 0x4c, 0x89, 0xd8, 0x5b, 0xc3);
+
+	if (mprotect(j->code, j->size, PROT_READ | PROT_EXEC)) {
+		perror("mprotect");
+		exit(1);
+	}
+	return (synth_func)j->code;
+}
+
+static void synth_free(struct jit *j)
+{
+	munmap(j->code, j->size);
+}
+
+/*
+ * links the first 'entries' slots of the buffer into one random cycle
+ * (Sattolo's algorithm), so the loads can't be prefetched
+ */
+static void synth_build_chase(unsigned long entries)
+{
+	unsigned long i;
+
+	if (!synth_buf) {
+		synth_buf = malloc(synth_levels[0] * sizeof(unsigned long));
+		if (!synth_buf) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+	}
+	if (entries == synth_buf_entries)
+		return;
+	for (i = 0; i < entries; i++)
+		synth_buf[i] = i;
+	for (i = entries - 1; i > 0; i--) {
+		unsigned long k = ((unsigned long)rand() * RAND_MAX + rand()) % i;
+		unsigned long tmp = synth_buf[i];
+
+		synth_buf[i] = synth_buf[k];
+		synth_buf[k] = tmp;
+	}
+	synth_buf_entries = entries;
+}
+
+struct synth_sample {
+	unsigned long tsc;
+	unsigned long cycles;
+	unsigned long insns;
+};
+
+/*
+ * runs func for iters loops, cycles come from perf when we have it and
+ * from the TSC otherwise
+ */
+static void synth_run(synth_func func, unsigned long iters, struct perf_counters *pc,
+		      int have_perf, struct synth_sample *s)
+{
+	unsigned long t0, t1;
+	unsigned int aux;
+
+	if (have_perf)
+		perf_start(pc);
+	t0 = rdtscp(&aux);
+	func(iters, synth_buf);
+	t1 = rdtscp(&aux);
+	s->tsc = t1 - t0;
+	s->cycles = s->tsc;
+	s->insns = 0;
+	if (have_perf) {
+		perf_stop(pc);
+		s->cycles = pc->values[PERF_CYCLES];
+		s->insns = pc->values[PERF_INSTRUCTIONS];
+	}
+}
+
+/* finds an iteration count that runs for about 'ms' milliseconds */
+static unsigned long synth_calibrate(synth_func func, int ms)
+{
+	struct timeval start, now;
+	unsigned long iters = 1;
+	unsigned long long usecs;
+
+	while (1) {
+		gettimeofday(&start, NULL);
+		func(iters, synth_buf);
+		gettimeofday(&now, NULL);
+		usecs = tvdelta(&start, &now);
+		if (usecs >= 10000 || iters >= (1UL << 40))
+			break;
+		iters *= 2;
+	}
+	if (!usecs)
+		usecs = 1;
+	iters = iters * ms * 1000 / usecs;
+	return iters ? iters : 1;
+}
+
+/* IPC of the unstamped loop, instructions come from perf or our own count */
+static double synth_ipc(struct synth_mix *m, struct synth_sample *s, unsigned long iters,
+			int bodies)
+{
+	double insns = s->insns;
+
+	if (!insns)
+		insns = (double)iters * (bodies * synth_body_insns(m) + 2);
+	return insns / s->cycles;
+}
+
+static double synth_probe(struct synth_mix *m, struct perf_counters *pc, int have_perf)
+{
+	struct synth_sample s;
+	struct jit j;
+	synth_func func;
+	unsigned long iters;
+	int bodies = synth_bodies(m);
+
+	func = synth_generate(m, bodies, 0, &j);
+	iters = synth_calibrate(func, 20);
+	synth_run(func, iters, pc, have_perf, &s);
+	synth_free(&j);
+	return synth_ipc(m, &s, iters, bodies);
+}
+
+/*
+ * more independent alu ops between the loads raise IPC, so binary search
+ * the alu count.  If the loads miss too often to ever reach the target
+ * we move to a smaller buffer.  Returns the IPC we ended up with.
+ */
+static double synth_tune(struct synth_mix *m, double target, struct perf_counters *pc,
+			 int have_perf)
+{
+	unsigned int level;
+	double ipc = 0;
+	int lo, hi;
+
+	for (level = 0; level < SYNTH_NR_LEVELS; level++) {
+		synth_build_chase(synth_levels[level]);
+		m->alu = SYNTH_MAX_ALU;
+		ipc = synth_probe(m, pc, have_perf);
+		if (ipc >= target || !m->loads)
+			break;
+	}
+	if (level == SYNTH_NR_LEVELS)
+		level--;
+
+	lo = 0;
+	hi = SYNTH_MAX_ALU;
+	while (lo < hi) {
+		m->alu = (lo + hi) / 2;
+		ipc = synth_probe(m, pc, have_perf);
+		if (ipc < target)
+			lo = m->alu + 1;
+		else
+			hi = m->alu;
+	}
+	m->alu = lo;
+	return synth_probe(m, pc, have_perf);
+}
+
+#define SYNTH_ROUNDS 3
+
+/*
+ * times the stamped and unstamped loops for about 'ms' each, alternating a
+ * few rounds and keeping the fastest of each.  Returns the overhead in percent.
+ */
+static double synth_overhead(struct synth_mix *m, struct perf_counters *pc, int have_perf,
+			     double *ipc, double *cycles_per_stamp, int ms)
+{
+	struct synth_sample s;
+	struct jit plain_jit, stamp_jit;
+	synth_func plain, stamped;
+	unsigned long plain_best = ~0UL;
+	unsigned long stamp_best = ~0UL;
+	unsigned long iters;
+	int bodies = synth_bodies(m);
+	int i;
+
+	plain = synth_generate(m, bodies, 0, &plain_jit);
+	stamped = synth_generate(m, bodies, 1, &stamp_jit);
+	iters = synth_calibrate(plain, ms);
+	*ipc = 0;
+	for (i = 0; i < SYNTH_ROUNDS; i++) {
+		synth_run(plain, iters, pc, have_perf, &s);
+		if (s.tsc < plain_best) {
+			plain_best = s.tsc;
+			*ipc = synth_ipc(m, &s, iters, bodies);
+		}
+		synth_run(stamped, iters, pc, have_perf, &s);
+		if (s.tsc < stamp_best)
+			stamp_best = s.tsc;
+	}
+	synth_free(&plain_jit);
+	synth_free(&stamp_jit);
+	*cycles_per_stamp = ((double)stamp_best - plain_best) / iters;
+	return ((double)stamp_best / plain_best - 1) * 100;
+}
+
+static void synth_report(struct synth_mix *m, double target, double ipc,
+			 double overhead, double cycles_per_stamp)
+{
+	char tbuf[32] = "-";
+
+	if (target > 0)
+		snprintf(tbuf, sizeof(tbuf), "%.2f", target);
+	fprintf(stderr, "target %5s ipc %5.2f mix %d,%d,%d,%d buf %7luKB %s every %d insns "
+		"overhead %6.2f%% (%.1f tsc cycles/stamp)\n", tbuf, ipc, m->loads, m->alu,
+		m->branches, m->depth, synth_buf_entries * sizeof(unsigned long) / 1024,
+		tsc_variant, synth_bodies(m) * synth_body_insns(m), overhead,
+		cycles_per_stamp);
+}
+
+/* the IPC points of the default curve */
+static double synth_curve[] = { 0.1, 0.25, 0.5, 0.75, 1.0, 1.5, 2.0, 2.5, 3.0, 3.5 };
+
+void run_synth(void)
+{
+	struct perf_counters pc;
+	struct synth_mix m;
+	double ipc, overhead, cycles_per_stamp;
+	int have_perf;
+	unsigned int i;
+
+	have_perf = perf_open(&pc) == 0;
+	if (!have_perf)
+		fprintf(stderr, "perf counters unavailable, IPC uses TSC cycles\n");
+
+	/* a fixed mix and no target, just run it */
+	if (synth_mix_set && target_ipc <= 0) {
+		m = synth_mix;
+		synth_build_chase(synth_levels[0]);
+		overhead = synth_overhead(&m, &pc, have_perf, &ipc, &cycles_per_stamp,
+					  runtime * 100);
+		synth_report(&m, 0, ipc, overhead, cycles_per_stamp);
+	} else if (target_ipc > 0) {
+		m = synth_mix;
+		ipc = synth_tune(&m, target_ipc, &pc, have_perf);
+		fprintf(stderr, "tuned to ipc %.2f\n", ipc);
+		overhead = synth_overhead(&m, &pc, have_perf, &ipc, &cycles_per_stamp,
+					  runtime * 100);
+		synth_report(&m, target_ipc, ipc, overhead, cycles_per_stamp);
+	} else {
+		for (i = 0; i < sizeof(synth_curve) / sizeof(synth_curve[0]); i++) {
+			m = synth_mix;
+			ipc = synth_tune(&m, synth_curve[i], &pc, have_perf);
+			overhead = synth_overhead(&m, &pc, have_perf, &ipc, &cycles_per_stamp,
+					  runtime * 100);
+			synth_report(&m, synth_curve[i], ipc, overhead, cycles_per_stamp);
+		}
+	}
+	if (have_perf)
+		perf_close(&pc);
+}
+
+/*
+ * the ipc loops have a single timestamp site, so they never show what
+ * inlining clock code at thousands of sites does to the i-cache and the
+ * uop cache.  This generates lots of small functions, each with its own
+ * stamp, and calls them in a random order.
+ *
+ * The functions keep their state in rbx and r12-r15, which the driver
+ * saves, so out of line calls don't need to save anything.
+ */
+enum icache_stamps {
+	ICACHE_NONE,
+	ICACHE_RDTSC,
+	ICACHE_RDTSCP,
+	ICACHE_READ_TSC,
+	ICACHE_VDSO,
+	ICACHE_NR_STAMPS,
+};
+
+static char *icache_stamp_names[] = { "none", "rdtsc", "rdtscp", "read_tsc()", "vdso" };
+
+/* functions=N, zero runs the sweep */
+static unsigned long icache_functions = 0;
+static unsigned long icache_sweep[] = { 64, 512, 4096, 16384 };
+#define ICACHE_NR_SWEEP (sizeof(icache_sweep) / sizeof(icache_sweep[0]))
+/* alu ops in each function */
+#define ICACHE_ALU 16
+#define ICACHE_ALIGN 16
+#define ICACHE_MAX_FUNC 128
+
+struct icache_result {
+	unsigned long tsc;
+	unsigned long iters;
+	unsigned long code_bytes;
+	unsigned long values[NR_PERF_COUNTERS];
+};
+
+/* add %src, %dst */
+static void emit_add(struct jit *j, int src, int dst)
+{
+	EMIT(j, 0x48 | ((src >> 3) << 2) | (dst >> 3), 0x01,
+	     0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+/* call rel32 when the target is close enough, call *%r11 otherwise */
+static void emit_call(struct jit *j, unsigned long addr)
+{
+	long rel = (long)addr - (long)(j->code + j->len + 5);
+	int i;
+
+	if (rel == (int)rel) {
+		EMIT(j, 0xe8, rel & 0xff, (rel >> 8) & 0xff, (rel >> 16) & 0xff,
+		     (rel >> 24) & 0xff);
+		return;
+	}
+	EMIT(j, 0x49, 0xbb);
+	for (i = 0; i < 8; i++)
+		EMIT(j, (addr >> (i * 8)) & 0xff);
+	EMIT(j, 0x41, 0xff, 0xd3);
+}
+
+static void emit_icache_stamp(struct jit *j, int stamp)
+{
+	switch (stamp) {
+	case ICACHE_RDTSC:
+		EMIT(j, 0x0f, 0x31);
+		break;
+	case ICACHE_RDTSCP:
+		EMIT(j, 0x0f, 0x01, 0xf9);
+		break;
+	case ICACHE_READ_TSC:
+		/* sub $8, %rsp; mov %rsp, %rdi; call read_tsc; add $8, %rsp */
+		EMIT(j, 0x48, 0x83, 0xec, 0x08, 0x48, 0x89, 0xe7);
+		emit_call(j, (unsigned long)read_tsc);
+		EMIT(j, 0x48, 0x83, 0xc4, 0x08);
+		break;
+	case ICACHE_VDSO:
+		/* sub $24, %rsp; mov $CLOCK_MONOTONIC, %edi; mov %rsp, %rsi */
+		EMIT(j, 0x48, 0x83, 0xec, 0x18, 0xbf, CLOCK_MONOTONIC, 0, 0, 0,
+		     0x48, 0x89, 0xe6);
+		emit_call(j, (unsigned long)clock_gettime);
+		EMIT(j, 0x48, 0x83, 0xc4, 0x18);
+		break;
+	}
+}
+
+static void icache_align(struct jit *j)
+{
+	while (j->len % ICACHE_ALIGN)
+		EMIT(j, 0xcc);
+}
+
+/*
+ * builds 'nr' functions and a driver that calls all of them in a random
+ * order, 'iters' times.  Returns the driver.
+ */
+static synth_func icache_generate(unsigned long nr, int stamp, unsigned long *order,
+				  struct jit *j)
+{
+	static const int chains[] = { 3, 12, 13, 14 };
+	unsigned long *funcs;
+	size_t driver, loop;
+	unsigned long i;
+	int rel;
+	int k;
+
+	funcs = malloc(nr * sizeof(*funcs));
+	if (!funcs) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	j->size = nr * (ICACHE_MAX_FUNC + 13) + 4096;
+	j->size = (j->size + 4095) & ~4095UL;
+	j->len = 0;
+	/* try to land near read_tsc() so the calls can be rel32 */
+	j->code = mmap((void *)(((unsigned long)read_tsc + (1UL << 28)) & ~4095UL), j->size,
+		       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j->code == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	for (i = 0; i < nr; i++) {
+		funcs[i] = (unsigned long)(j->code + j->len);
+		for (k = 0; k < ICACHE_ALU; k++)
+			emit_add(j, 15, chains[k % 4]);
+		emit_icache_stamp(j, stamp);
+		EMIT(j, 0xc3);
+		icache_align(j);
+	}
+
+	driver = j->len;
+	/* push rbx, rbp, r12-r15; sub $8, %rsp keeps the calls aligned */
+	EMIT(j, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+	EMIT(j, 0x48, 0x83, 0xec, 0x08);
+	/* mov %rdi, %rbp; mov $1, %r15d; zero the chains */
+	EMIT(j, 0x48, 0x89, 0xfd, 0x41, 0xbf, 0x01, 0x00, 0x00, 0x00);
+	EMIT(j, 0x31, 0xdb, 0x45, 0x31, 0xe4, 0x45, 0x31, 0xed, 0x45, 0x31, 0xf6);
+	loop = j->len;
+	for (i = 0; i < nr; i++)
+		emit_call(j, funcs[order[i]]);
+	/* dec %rbp; jnz loop */
+	EMIT(j, 0x48, 0xff, 0xcd);
+	rel = (int)loop - (int)(j->len + 6);
+	EMIT(j, 0x0f, 0x85, rel & 0xff, (rel >> 8) & 0xff, (rel >> 16) & 0xff,
+	     (rel >> 24) & 0xff);
+	/* mov %rbx, %rax; add $8, %rsp; pop everything; ret */
+	EMIT(j, 0x48, 0x89, 0xd8, 0x48, 0x83, 0xc4, 0x08);
+	EMIT(j, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3);
+
+	if (mprotect(j->code, j->size, PROT_READ | PROT_EXEC)) {
+		perror("mprotect");
+		exit(1);
+	}
+	free(funcs);
+	return (synth_func)(j->code + driver);
+}
+
+#define PER_K(v, total) ((total) ? (double)(v) * 1000 / (total) : 0)
+
+/* best of a few rounds for every stamp, alternating between them */
+static void icache_measure(unsigned long nr, struct icache_result *res,
+			   struct perf_counters *pc, int have_perf)
+{
+	struct synth_sample s;
+	struct jit jits[ICACHE_NR_STAMPS];
+	synth_func funcs[ICACHE_NR_STAMPS];
+	unsigned long *order;
+	unsigned long iters;
+	unsigned long i;
+	int stamp, round;
+
+	order = malloc(nr * sizeof(*order));
+	if (!order) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (i = 0; i < nr; i++)
+		order[i] = i;
+	for (i = nr - 1; i > 0; i--) {
+		unsigned long k = rand() % (i + 1);
+		unsigned long tmp = order[i];
+
+		order[i] = order[k];
+		order[k] = tmp;
+	}
+
+	for (stamp = 0; stamp < ICACHE_NR_STAMPS; stamp++) {
+		funcs[stamp] = icache_generate(nr, stamp, order, &jits[stamp]);
+		res[stamp].tsc = ~0UL;
+		res[stamp].code_bytes = jits[stamp].len;
+	}
+	/* every stamp runs the same number of calls, sized by the slowest */
+	iters = synth_calibrate(funcs[ICACHE_VDSO], runtime * 100);
+	for (round = 0; round < SYNTH_ROUNDS; round++) {
+		for (stamp = 0; stamp < ICACHE_NR_STAMPS; stamp++) {
+			synth_run(funcs[stamp], iters, pc, have_perf, &s);
+			if (s.tsc >= res[stamp].tsc)
+				continue;
+			res[stamp].tsc = s.tsc;
+			res[stamp].iters = iters;
+			if (have_perf)
+				memcpy(res[stamp].values, pc->values, sizeof(pc->values));
+		}
+	}
+	for (stamp = 0; stamp < ICACHE_NR_STAMPS; stamp++)
+		synth_free(&jits[stamp]);
+	free(order);
+}
+
+static void icache_report(unsigned long nr, struct icache_result *res, int have_perf)
+{
+	double base = (double)res[ICACHE_NONE].tsc / (res[ICACHE_NONE].iters * nr);
+	int stamp;
+
+	for (stamp = 0; stamp < ICACHE_NR_STAMPS; stamp++) {
+		struct icache_result *r = &res[stamp];
+		double per_call = (double)r->tsc / (r->iters * nr);
+
+		fprintf(stderr, "functions %6lu code %6luKB %-10s calls/s %'14.0f tsc cycles/call %6.1f "
+			"overhead %7.2f%%", nr, r->code_bytes >> 10, icache_stamp_names[stamp],
+			r->iters * nr / ((double)r->tsc / tsc_ghz() / 1e9), per_call,
+			(per_call / base - 1) * 100);
+		if (have_perf) {
+			unsigned long cycles = r->values[PERF_CYCLES];
+
+			fprintf(stderr, " ipc %5.2f fe %s/kcycle %6.1f l1i mpki %6.2f itlb mpki %6.2f",
+				cycles ? (double)r->values[PERF_INSTRUCTIONS] / cycles : 0,
+				perf_frontend_slots ? "slots" : "stalls",
+				PER_K(r->values[PERF_FRONTEND_STALLS], cycles),
+				PER_K(r->values[PERF_L1I_MISSES], r->values[PERF_INSTRUCTIONS]),
+				PER_K(r->values[PERF_ITLB_MISSES], r->values[PERF_INSTRUCTIONS]));
+		}
+		fprintf(stderr, "\n");
+	}
+}
+
+void run_icache(void)
+{
+	struct icache_result res[ICACHE_NR_STAMPS];
+	struct perf_counters pc;
+	int have_perf;
+	unsigned long i;
+
+	perf_frontend = 1;
+	have_perf = perf_open(&pc) == 0;
+	if (!have_perf)
+		fprintf(stderr, "perf counters unavailable, using TSC cycles without front end stalls\n");
+	fprintf(stderr, "read_tsc() uses %s\n", tsc_variant);
+
+	if (icache_functions) {
+		icache_measure(icache_functions, res, &pc, have_perf);
+		icache_report(icache_functions, res, have_perf);
+	} else {
+		for (i = 0; i < ICACHE_NR_SWEEP; i++) {
+			icache_measure(icache_sweep[i], res, &pc, have_perf);
+			icache_report(icache_sweep[i], res, have_perf);
+		}
+	}
+	if (have_perf)
+		perf_close(&pc);
+}
+
+/*
+ * cyclictest style wakeup latency.  We take a timestamp after every
+ * blocking wait, so how late the wait returns matters as much as the
+ * cost of the read.  One pinned thread per cpu sleeps with each mechanism
+ * in turn and records how far past the expected time it woke up,
+ * measured with the TSC.
+ */
+enum wakeup_mechs {
+	WAKEUP_ABS,
+	WAKEUP_REL,
+	WAKEUP_NANOSLEEP,
+	WAKEUP_TIMERFD,
+	WAKEUP_FUTEX,
+	WAKEUP_NR_MECHS,
+};
+
+static char *wakeup_mech_names[] = {
+	"clock_nanosleep_abs", "clock_nanosleep_rel", "nanosleep", "timerfd_epoll", "futex",
+};
+
+/*
+ * period_us=N and slack_ns=N, a negative slack leaves the default alone.
+ * PR_SET_TIMERSLACK treats 0 as "back to the default", so 0 becomes 1ns.
+ */
+static long wakeup_period_us = 1000;
+static long wakeup_slack_ns = -1;
+
+/* 1us buckets, anything later lands in overflow */
+#define WAKEUP_BUCKETS 1000
+
+struct wakeup_hist {
+	unsigned long samples;
+	unsigned long overflow;
+	unsigned long min_ns;
+	unsigned long max_ns;
+	double sum_ns;
+	unsigned long buckets[WAKEUP_BUCKETS];
+};
+
+struct wakeup_thread {
+	pthread_t thread;
+	int cpu;
+	int mech;
+	int ret;
+	struct wakeup_hist hist;
+};
+
+static inline unsigned long mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void ns_to_timespec(unsigned long ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static void wakeup_record(struct wakeup_hist *h, unsigned long now, unsigned long target,
+			  double ghz)
+{
+	unsigned long ns = now > target ? (now - target) / ghz : 0;
+
+	if (!h->samples || ns < h->min_ns)
+		h->min_ns = ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->samples++;
+	h->sum_ns += ns;
+	if (ns / 1000 < WAKEUP_BUCKETS)
+		h->buckets[ns / 1000]++;
+	else
+		h->overflow++;
+}
+
+/*
+ * the TSC value where CLOCK_MONOTONIC reaches deadline_ns.  tsc_ghz() is
+ * measured against MONOTONIC_RAW and MONOTONIC is slewed, so the anchor
+ * pair is read again right before every sleep, which keeps the error
+ * down to one period's worth of slew.
+ */
+static unsigned long wakeup_target(unsigned long deadline_ns, double ghz)
+{
+	unsigned long anchor_tsc, anchor_ns;
+	unsigned int aux;
+
+	anchor_tsc = rdtscp(&aux);
+	anchor_ns = mono_ns();
+	return anchor_tsc + (long)(deadline_ns - anchor_ns) * ghz;
+}
+
+void *wakeup_thread(void *arg)
+{
+	struct wakeup_thread *wt = arg;
+	struct wakeup_hist *h = &wt->hist;
+	unsigned long period_ns = wakeup_period_us * 1000;
+	unsigned long next_ns, target;
+	double ghz = tsc_ghz();
+	struct timespec ts;
+	struct itimerspec its;
+	struct epoll_event ev;
+	unsigned long expirations = 0;
+	unsigned long exp;
+	unsigned int aux;
+	int futex_word = 0;
+	int tfd = -1, ep = -1;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(wt->cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		wt->ret = -errno;
+		return NULL;
+	}
+	if (wakeup_slack_ns >= 0 && prctl(PR_SET_TIMERSLACK, wakeup_slack_ns ? wakeup_slack_ns : 1)) {
+		wt->ret = -errno;
+		return NULL;
+	}
+
+	/* absolute targets are in CLOCK_MONOTONIC, wakeup_target() maps them onto the TSC */
+	next_ns = mono_ns() + period_ns;
+
+	if (wt->mech == WAKEUP_TIMERFD) {
+		tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+		ep = epoll_create1(0);
+		if (tfd < 0 || ep < 0) {
+			wt->ret = -errno;
+			goto out;
+		}
+		ev.events = EPOLLIN;
+		ev.data.fd = tfd;
+		ns_to_timespec(next_ns, &its.it_value);
+		ns_to_timespec(period_ns, &its.it_interval);
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev) ||
+		    timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+			wt->ret = -errno;
+			goto out;
+		}
+	}
+
+	while (!stopping) {
+		switch (wt->mech) {
+		case WAKEUP_ABS:
+			ns_to_timespec(next_ns, &ts);
+			target = wakeup_target(next_ns, ghz);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			next_ns += period_ns;
+			break;
+		case WAKEUP_REL:
+			ns_to_timespec(period_ns, &ts);
+			target = rdtscp(&aux) + period_ns * ghz;
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+			break;
+		case WAKEUP_NANOSLEEP:
+			ns_to_timespec(period_ns, &ts);
+			target = rdtscp(&aux) + period_ns * ghz;
+			nanosleep(&ts, NULL);
+			break;
+		case WAKEUP_TIMERFD:
+			/* next_ns stays the first expiration, the timer keeps the period */
+			target = wakeup_target(next_ns + expirations * period_ns, ghz);
+			if (epoll_wait(ep, &ev, 1, -1) != 1 ||
+			    read(tfd, &exp, sizeof(exp)) != sizeof(exp))
+				continue;
+			/* we're late for the most recent expiration */
+			target += (exp - 1) * period_ns * ghz;
+			expirations += exp;
+			break;
+		case WAKEUP_FUTEX:
+		default:
+			/* nobody ever wakes the futex, so this always times out */
+			ns_to_timespec(next_ns, &ts);
+			target = wakeup_target(next_ns, ghz);
+			syscall(SYS_futex, &futex_word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, 0,
+				&ts, NULL, FUTEX_BITSET_MATCH_ANY);
+			next_ns += period_ns;
+			break;
+		}
+		wakeup_record(h, rdtscp(&aux), target, ghz);
+	}
+out:
+	if (tfd >= 0)
+		close(tfd);
+	if (ep >= 0)
+		close(ep);
+	return NULL;
+}
+
+/* the latency in us below which 'pct' percent of the samples fall */
+static double wakeup_percentile(struct wakeup_hist *h, double pct)
+{
+	unsigned long i = hist_percentile(h->buckets, WAKEUP_BUCKETS, h->samples, pct);
+
+	return i < WAKEUP_BUCKETS ? i + 1 : h->max_ns / 1000.0;
+}
+
+static void wakeup_report(struct wakeup_thread *wt)
+{
+	struct wakeup_hist *h = &wt->hist;
+	unsigned long count;
+	int lo, hi, i;
+
+	if (wt->ret) {
+		fprintf(stderr, "%-20s cpu %3d failed: %s\n", wakeup_mech_names[wt->mech], wt->cpu,
+			strerror(-wt->ret));
+		return;
+	}
+	if (!h->samples)
+		return;
+	fprintf(stderr, "%-20s cpu %3d samples %'9lu min %7.1f avg %7.1f p50 %5.0f p99 %5.0f "
+		"p99.9 %5.0f max %9.1f us\n", wakeup_mech_names[wt->mech], wt->cpu, h->samples,
+		h->min_ns / 1000.0, h->sum_ns / h->samples / 1000, wakeup_percentile(h, 50),
+		wakeup_percentile(h, 99), wakeup_percentile(h, 99.9), h->max_ns / 1000.0);
+
+	/* the 1us buckets folded into power of two ranges */
+	for (lo = 0, hi = 1; lo < WAKEUP_BUCKETS; lo = hi, hi *= 2) {
+		count = 0;
+		for (i = lo; i < hi && i < WAKEUP_BUCKETS; i++)
+			count += h->buckets[i];
+		if (count)
+			fprintf(stderr, "\t[%4d, %4d) us: %'lu\n", lo,
+				hi < WAKEUP_BUCKETS ? hi : WAKEUP_BUCKETS, count);
+	}
+	if (h->overflow)
+		fprintf(stderr, "\t>= %d us: %'lu\n", WAKEUP_BUCKETS, h->overflow);
+}
+
+void run_wakeup(void)
+{
+	struct wakeup_thread *threads;
+	cpu_set_t set;
+	int nr_cpus, cpu, mech, i, ret;
+
+	if (wakeup_period_us <= 0) {
+		fprintf(stderr, "period_us must be at least 1\n");
+		exit(1);
+	}
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+	nr_cpus = CPU_COUNT(&set);
+	threads = calloc(nr_cpus, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	/* calibrate before the threads all want it */
+	fprintf(stderr, "tsc %.3f GHz, period %ld us, %d cpus\n", tsc_ghz(), wakeup_period_us,
+		nr_cpus);
+	if (wakeup_slack_ns >= 0)
+		fprintf(stderr, "timer slack %ld ns\n", wakeup_slack_ns ? wakeup_slack_ns : 1);
+	else
+		fprintf(stderr, "default timer slack\n");
+
+	for (mech = 0; mech < WAKEUP_NR_MECHS; mech++) {
+		memset(threads, 0, nr_cpus * sizeof(*threads));
+		stopping = 0;
+		for (cpu = 0, i = 0; i < nr_cpus; cpu++) {
+			if (!CPU_ISSET(cpu, &set))
+				continue;
+			threads[i].cpu = cpu;
+			threads[i].mech = mech;
+			ret = pthread_create(&threads[i].thread, NULL, wakeup_thread, &threads[i]);
+			if (ret) {
+				fprintf(stderr, "pthread_create failed: %d\n", ret);
+				exit(1);
+			}
+			i++;
+		}
+		usleep(runtime * USEC_PER_SEC);
+		stopping = 1;
+		for (i = 0; i < nr_cpus; i++)
+			pthread_join(threads[i].thread, NULL);
+		for (i = 0; i < nr_cpus; i++)
+			wakeup_report(&threads[i]);
+	}
+	free(threads);
+}
+
+/*
+ * delay primitives for pacing, all of them wait for a TSC deadline.
+ * tpause and umwait need WAITPKG, everything else runs everywhere.
+ * The hybrids sleep for all but the last margin_ns and spin the rest.
+ */
+enum delay_strategies {
+	DELAY_SPIN,
+	DELAY_TPAUSE,
+	DELAY_UMWAIT,
+	DELAY_HYBRID_50,
+	DELAY_HYBRID_10,
+	DELAY_SLEEP,
+	DELAY_NR_STRATEGIES,
+};
+
+struct delay_strategy {
+	char *name;
+	int waitpkg;
+	unsigned long margin_ns;
+};
+
+static struct delay_strategy delay_strategies[] = {
+	{ "pause_spin", 0, 0 },
+	{ "tpause", 1, 0 },
+	{ "umwait", 1, 0 },
+	{ "hybrid_50us", 0, 50000 },
+	{ "hybrid_10us", 0, 10000 },
+	{ "sleep", 0, 0 },
+};
+
+/* delay_ns=N, zero runs the sweep */
+static unsigned long delay_ns = 0;
+static unsigned long delay_sweep[] = { 100, 500, 1000, 5000, 20000, 100000, 1000000 };
+#define DELAY_NR_SWEEP (sizeof(delay_sweep) / sizeof(delay_sweep[0]))
+#define DELAY_MAX_SAMPLES (1 << 20)
+
+/* umwait waits for a write to this line, and nobody writes it */
+static unsigned long delay_monitor[8] __attribute__((aligned(64)));
+
+static volatile unsigned long sibling_loops;
+static volatile int sibling_stop;
+
+static int has_waitpkg(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ecx & (1U << 5));
+}
+
+/* tpause %ecx, C0.1 so we wake up quickly */
+static inline void tpause(unsigned long deadline)
+{
+	__asm__ __volatile__(".byte 0x66, 0x0f, 0xae, 0xf1"
+			     : : "c"(1), "a"((unsigned int)deadline),
+			       "d"((unsigned int)(deadline >> 32)) : "cc");
+}
+
+/* umonitor %rax */
+static inline void umonitor(void *addr)
+{
+	__asm__ __volatile__(".byte 0xf3, 0x0f, 0xae, 0xf0" : : "a"(addr));
+}
+
+/* umwait %ecx */
+static inline void umwait(unsigned long deadline)
+{
+	__asm__ __volatile__(".byte 0xf2, 0x0f, 0xae, 0xf1"
+			     : : "c"(1), "a"((unsigned int)deadline),
+			       "d"((unsigned int)(deadline >> 32)) : "cc");
+}
+
+static inline void delay_spin(unsigned long deadline)
+{
+	unsigned int aux;
+
+	while (rdtsc(&aux) < deadline)
+		__asm__ __volatile__("pause");
+}
+
+static void delay_until(int strategy, unsigned long deadline, unsigned long ns)
+{
+	struct delay_strategy *d = &delay_strategies[strategy];
+	struct timespec ts;
+	unsigned int aux;
+
+	switch (strategy) {
+	case DELAY_TPAUSE:
+		/* tpause can return early for interrupts and the OS time limit */
+		while (rdtsc(&aux) < deadline)
+			tpause(deadline);
+		break;
+	case DELAY_UMWAIT:
+		while (rdtsc(&aux) < deadline) {
+			umonitor(delay_monitor);
+			umwait(deadline);
+		}
+		break;
+	case DELAY_HYBRID_50:
+	case DELAY_HYBRID_10:
+		if (ns > d->margin_ns) {
+			ns_to_timespec(ns - d->margin_ns, &ts);
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+		}
+		delay_spin(deadline);
+		break;
+	case DELAY_SLEEP:
+		ns_to_timespec(ns, &ts);
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+		break;
+	case DELAY_SPIN:
+	default:
+		delay_spin(deadline);
+		break;
+	}
+}
+
+static int pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* the first cpu in thread_siblings_list that isn't 'cpu', or -1 */
+static int smt_sibling(int cpu)
+{
+	char path[128];
+	char buf[256];
+	char *p = buf;
+	long lo, hi;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	if (read_sysfs(path, buf, sizeof(buf)))
+		return -1;
+	while (*p) {
+		lo = strtol(p, &p, 10);
+		hi = lo;
+		if (*p == '-')
+			hi = strtol(p + 1, &p, 10);
+		for (; lo <= hi; lo++) {
+			if (lo != cpu)
+				return lo;
+		}
+		if (*p == ',')
+			p++;
+		else
+			break;
+	}
+	return -1;
+}
+
+/* plain alu work on the SMT sibling, it counts how much it got done */
+void *delay_sibling_thread(void *arg)
+{
+	int cpu = *(int *)arg;
+	unsigned long x = 1;
+	int i;
+
+	pin_to_cpu(cpu);
+	while (!sibling_stop) {
+		for (i = 0; i < 1000; i++)
+			x = x * 3 + 1;
+		sibling_loops += 1000;
+	}
+	return (void *)x;
+}
+
+/* sibling loops per second while we wait for 'tsc_cycles' */
+static double sibling_rate(unsigned long start_loops, unsigned long tsc_cycles)
+{
+	return (sibling_loops - start_loops) / (tsc_cycles / tsc_ghz() / 1e9);
+}
+
+static void delay_measure(int strategy, unsigned long ns, double *samples,
+			  double sibling_base, int have_sibling)
+{
+	double ghz = tsc_ghz();
+	unsigned long budget = runtime * 100 * 1000000UL * ghz;
+	unsigned long start, end, t0, t1, loops0;
+	unsigned long nr = 0;
+	struct timespec c0, c1;
+	double sum = 0, cpu;
+	unsigned int aux;
+
+	loops0 = sibling_loops;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0);
+	start = rdtscp(&aux);
+	do {
+		t0 = rdtscp(&aux);
+		delay_until(strategy, t0 + ns * ghz, ns);
+		t1 = rdtscp(&aux);
+		samples[nr] = (t1 - t0) / ghz - ns;
+		sum += samples[nr];
+		nr++;
+	} while (t1 - start < budget && nr < DELAY_MAX_SAMPLES);
+	end = rdtscp(&aux);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c1);
+
+	cpu = ((c1.tv_sec - c0.tv_sec) * 1e9 + c1.tv_nsec - c0.tv_nsec) * 100 /
+		((end - start) / ghz);
+	qsort(samples, nr, sizeof(*samples), cmp_double);
+	fprintf(stderr, "delay %8luns %-12s samples %'9lu overshoot avg %9.1f p50 %9.1f p99 %9.1f "
+		"max %10.1f ns cpu %5.1f%%", ns, delay_strategies[strategy].name, nr, sum / nr,
+		samples[nr / 2], samples[nr * 99 / 100], samples[nr - 1], cpu);
+	if (have_sibling)
+		fprintf(stderr, " sibling %5.1f%%",
+			sibling_rate(loops0, end - start) * 100 / sibling_base);
+	fprintf(stderr, "\n");
+}
+
+void run_delay(void)
+{
+	pthread_t sibling;
+	double *samples;
+	double sibling_base = 0;
+	unsigned long start, loops0;
+	unsigned int aux;
+	int waitpkg = has_waitpkg();
+	int cpu, sibling_cpu;
+	int strategy;
+	unsigned long i;
+
+	cpu = sched_getcpu();
+	if (cpu < 0 || pin_to_cpu(cpu)) {
+		perror("pinning to a cpu");
+		exit(1);
+	}
+	/* the default 50us slack would swamp the hybrids, pacing code sets it too */
+	prctl(PR_SET_TIMERSLACK, wakeup_slack_ns > 0 ? wakeup_slack_ns : 1);
+	samples = malloc(DELAY_MAX_SAMPLES * sizeof(*samples));
+	if (!samples) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	fprintf(stderr, "tsc %.3f GHz, cpu %d, waitpkg %s, timer slack %ld ns\n", tsc_ghz(), cpu,
+		waitpkg ? "yes" : "no (skipping tpause and umwait)", (long)prctl(PR_GET_TIMERSLACK));
+
+	/* sibling throughput while we sleep is the baseline */
+	sibling_cpu = smt_sibling(cpu);
+	if (sibling_cpu >= 0) {
+		sibling_stop = 0;
+		if (pthread_create(&sibling, NULL, delay_sibling_thread, &sibling_cpu)) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+		usleep(100000);
+		loops0 = sibling_loops;
+		start = rdtscp(&aux);
+		usleep(runtime * 100000);
+		sibling_base = sibling_rate(loops0, rdtscp(&aux) - start);
+		fprintf(stderr, "smt sibling cpu %d, %'.0f loops/s while we sleep\n", sibling_cpu,
+			sibling_base);
+	} else {
+		fprintf(stderr, "no smt sibling, skipping the sibling impact\n");
+	}
+
+	for (i = 0; i < (delay_ns ? 1 : DELAY_NR_SWEEP); i++) {
+		unsigned long ns = delay_ns ? delay_ns : delay_sweep[i];
+
+		for (strategy = 0; strategy < DELAY_NR_STRATEGIES; strategy++) {
+			if (delay_strategies[strategy].waitpkg && !waitpkg)
+				continue;
+			delay_measure(strategy, ns, samples, sibling_base, sibling_cpu >= 0);
+		}
+	}
+
+	if (sibling_cpu >= 0) {
+		sibling_stop = 1;
+		pthread_join(sibling, NULL);
+	}
+	free(samples);
+}
+
+/*
+ * raw sample capture.  Histograms throw away when things happened, so
+ * capture=DIR has a thread pinned to every cpu read the clock in a loop
+ * and store every iteration.  The records go to anonymous memory each
+ * thread prefaults on its own cpu, so the hot loop only does plain
+ * stores, and the files are written once the run is over.  Shared file
+ * mappings can't promise that: writeback write protects the pages again
+ * and the next store faults and may be throttled.  tsc analyze reads the
+ * files back.
+ *
+ * File format, version 1, little endian:
+ *
+ * struct capture_header, header_size bytes (records start there)
+ * nr_records struct capture_record, record_size bytes each
+ *
+ * record.tsc is rdtscp after the clock read, record.delta is TSC cycles
+ * since the record before it (the first record has delta 0) and
+ * record.cpu comes from the rdtscp aux value.  tsc_khz converts cycles
+ * to time.  complete is only set once nr_records is final.
+ */
+#define CAPTURE_MAGIC "TSCCAPT"
+#define CAPTURE_VERSION 1
+
+/* delta didn't fit in 32 bits */
+#define CAPTURE_SATURATED (1 << 0)
+/* the cpu changed since the last record */
+#define CAPTURE_MIGRATED (1 << 1)
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t complete;
+	uint64_t tsc_khz;
+	uint64_t start_tsc;
+	uint64_t start_ns;
+	uint64_t nr_records;
+	int32_t tid;
+	int32_t pinned_cpu;
+	char clock[32];
+};
+
+struct capture_record {
+	uint64_t tsc;
+	uint32_t delta;
+	uint16_t cpu;
+	uint16_t flags;
+};
+
+#define CAPTURE_HEADER_SIZE (64 * ((sizeof(struct capture_header) + 63) / 64))
+/* how long capture_rate() runs the loop */
+#define CAPTURE_PROBE_MS 50
+/* largest buffer per thread unless capture_mb= asks for more */
+#define CAPTURE_DEFAULT_MB 512
+
+/* capture=DIR and capture_mb=N per thread, 0 sizes the buffers from runtime */
+static char *capture_dir;
+static unsigned long capture_mb;
+
+/* the workers start together once every buffer is prefaulted */
+static pthread_barrier_t capture_barrier;
+
+struct capture_thread {
+	pthread_t thread;
+	int cpu;
+	int fd;
+	char path[PATH_MAX];
+	struct capture_header hdr;
+	struct capture_record *rec;
+	unsigned long max_records;
+};
+
+/* opens and preallocates the file now, so a full disk fails before the run */
+static void capture_open(struct capture_thread *ct, int index, unsigned long max_records)
+{
+	snprintf(ct->path, sizeof(ct->path), "%s/capture.%d.bin", capture_dir, index);
+	ct->max_records = max_records;
+	ct->fd = open(ct->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (ct->fd < 0) {
+		fprintf(stderr, "unable to open %s: %s\n", ct->path, strerror(errno));
+		exit(1);
+	}
+	errno = posix_fallocate(ct->fd, 0, CAPTURE_HEADER_SIZE +
+			       max_records * sizeof(struct capture_record));
+	if (errno) {
+		fprintf(stderr, "unable to allocate %s: %s\n", ct->path, strerror(errno));
+		exit(1);
+	}
+	memcpy(ct->hdr.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	ct->hdr.version = CAPTURE_VERSION;
+	ct->hdr.header_size = CAPTURE_HEADER_SIZE;
+	ct->hdr.record_size = sizeof(struct capture_record);
+	ct->hdr.tsc_khz = tsc_ghz() * 1000000;
+	ct->hdr.pinned_cpu = ct->cpu;
+	snprintf(ct->hdr.clock, sizeof(ct->hdr.clock), "%s", tsc_variant);
+	fprintf(stderr, "capturing cpu %d to %s\n", ct->cpu, ct->path);
+}
+
+static void capture_write(struct capture_thread *ct, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(ct->fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf(stderr, "unable to write %s: %s\n", ct->path,
+				ret ? strerror(errno) : "short write");
+			exit(1);
+		}
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+}
+
+static void capture_close(struct capture_thread *ct)
+{
+	char header[CAPTURE_HEADER_SIZE] = { 0 };
+	size_t len = ct->hdr.nr_records * sizeof(struct capture_record);
+
+	ct->hdr.complete = 1;
+	memcpy(header, &ct->hdr, sizeof(ct->hdr));
+	capture_write(ct, header, sizeof(header));
+	capture_write(ct, ct->rec, len);
+	if (ftruncate(ct->fd, CAPTURE_HEADER_SIZE + len))
+		perror("ftruncate");
+	close(ct->fd);
+	munmap(ct->rec, ct->max_records * sizeof(struct capture_record));
+}
+
+void *capture_thread(void *arg)
+{
+	struct capture_thread *ct = arg;
+	struct capture_record *rec;
+	unsigned long max = ct->max_records;
+	unsigned long bytes = max * sizeof(struct capture_record);
+	unsigned long prev, now, delta, off;
+	unsigned long n = 0;
+	unsigned int aux, prev_cpu;
+
+	pin_to_cpu(ct->cpu);
+	/* first touch from here, so the pages are local to this cpu */
+	rec = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rec == MAP_FAILED) {
+		fprintf(stderr, "unable to allocate %luMB for cpu %d: %s\n", bytes >> 20,
+			ct->cpu, strerror(errno));
+		exit(1);
+	}
+	madvise(rec, bytes, MADV_HUGEPAGE);
+	for (off = 0; off < bytes; off += 4096)
+		((volatile char *)rec)[off] = 0;
+	ct->rec = rec;
+	pthread_barrier_wait(&capture_barrier);
+
+	ct->hdr.tid = syscall(SYS_gettid);
+	ct->hdr.start_ns = mono_ns();
+	prev = rdtscp(&aux);
+	ct->hdr.start_tsc = prev;
+	prev_cpu = aux & 0xfff;
+
+	while (!stopping && n < max) {
+		read_tsc(&aux);
+		now = rdtscp(&aux);
+		delta = n ? now - prev : 0;
+		rec[n].tsc = now;
+		rec[n].delta = delta > 0xffffffffUL ? 0xffffffffU : delta;
+		rec[n].cpu = aux & 0xfff;
+		rec[n].flags = (delta > 0xffffffffUL ? CAPTURE_SATURATED : 0) |
+			((aux & 0xfff) != prev_cpu ? CAPTURE_MIGRATED : 0);
+		prev_cpu = aux & 0xfff;
+		prev = now;
+		n++;
+	}
+	ct->hdr.nr_records = n;
+	return NULL;
+}
+
+/* records per second of the capture loop, from a short run on this thread */
+static double capture_rate(void)
+{
+	double ghz = tsc_ghz();
+	unsigned long start, now, end;
+	unsigned long n = 0;
+	unsigned int aux;
+
+	start = rdtscp(&aux);
+	end = start + CAPTURE_PROBE_MS * 1e6 * ghz;
+	do {
+		read_tsc(&aux);
+		now = rdtscp(&aux);
+		n++;
+	} while (now < end);
+	return n / ((now - start) / ghz / 1e9);
+}
+
+/* MemAvailable from /proc/meminfo in bytes, 0 if it isn't there */
+static unsigned long long mem_available(void)
+{
+	unsigned long long kb = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb << 10;
+}
+
+/*
+ * records per thread.  By default they hold the whole run at the measured
+ * rate plus some headroom, since other cpus may read faster, but no more
+ * than CAPTURE_DEFAULT_MB; capture_mb= sets the size outright.  Fails up
+ * front if memory or DIR don't have the room, and warns if the buffers
+ * will fill before the end.
+ */
+static unsigned long capture_size(int nr_files)
+{
+	double rate = capture_rate();
+	unsigned long need = rate * runtime * 1.25;
+	unsigned long records = need;
+	unsigned long long bytes, avail;
+	struct statfs sfs;
+
+	if (capture_mb)
+		records = capture_mb * 1024 * 1024 / sizeof(struct capture_record);
+	else if (records > CAPTURE_DEFAULT_MB * 1024 * 1024 / sizeof(struct capture_record))
+		records = CAPTURE_DEFAULT_MB * 1024 * 1024 / sizeof(struct capture_record);
+	if (records < rate * runtime)
+		fprintf(stderr, "warning: %luMB per cpu holds about %.2f s of the %d s run "
+			"at %'.0f reads/s, raise capture_mb= for more\n",
+			(unsigned long)((records * sizeof(struct capture_record)) >> 20),
+			records / rate, runtime, rate);
+	bytes = (unsigned long long)nr_files * records * sizeof(struct capture_record);
+	avail = mem_available();
+	if (avail && bytes > avail) {
+		fprintf(stderr, "capture needs %lluMB of memory for %d cpus but only %lluMB are "
+			"available, lower runtime= or capture_mb=\n", bytes >> 20, nr_files,
+			avail >> 20);
+		exit(1);
+	}
+	bytes += (unsigned long long)nr_files * CAPTURE_HEADER_SIZE;
+	if (!statfs(capture_dir, &sfs) &&
+	    bytes > (unsigned long long)sfs.f_bavail * sfs.f_bsize) {
+		fprintf(stderr, "capture needs %lluMB in %s for %d files but only %lluMB are free, "
+			"lower runtime= or capture_mb=\n", bytes >> 20, capture_dir, nr_files,
+			((unsigned long long)sfs.f_bavail * sfs.f_bsize) >> 20);
+		exit(1);
+	}
+	fprintf(stderr, "%'.0f reads/s, %luMB capture buffers\n", rate,
+		(unsigned long)((records * sizeof(struct capture_record)) >> 20));
+	return records;
+}
+
+void run_capture(void)
+{
+	struct capture_thread *threads;
+	cpu_set_t set;
+	int nr_cpus, cpu, i, ret;
+	unsigned long total = 0;
+	unsigned long records;
+
+	if (mkdir(capture_dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "unable to create %s: %s\n", capture_dir, strerror(errno));
+		exit(1);
+	}
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+	nr_cpus = CPU_COUNT(&set);
+	threads = calloc(nr_cpus, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	records = capture_size(nr_cpus);
+	for (cpu = 0, i = 0; i < nr_cpus; cpu++) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		threads[i].cpu = cpu;
+		capture_open(&threads[i], i, records);
+		i++;
+	}
+
+	stopping = 0;
+	pthread_barrier_init(&capture_barrier, NULL, nr_cpus + 1);
+	for (i = 0; i < nr_cpus; i++) {
+		ret = pthread_create(&threads[i].thread, NULL, capture_thread, &threads[i]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed: %d\n", ret);
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&capture_barrier);
+	usleep(runtime * USEC_PER_SEC);
+	stopping = 1;
+	for (i = 0; i < nr_cpus; i++)
+		pthread_join(threads[i].thread, NULL);
+	pthread_barrier_destroy(&capture_barrier);
+	/* nothing touches the disk until every worker is done */
+	for (i = 0; i < nr_cpus; i++) {
+		if (threads[i].hdr.nr_records == threads[i].max_records)
+			fprintf(stderr, "cpu %d filled its %luMB buffer before the end of the run\n",
+				threads[i].cpu, (unsigned long)((records *
+				sizeof(struct capture_record)) >> 20));
+		total += threads[i].hdr.nr_records;
+		capture_close(&threads[i]);
+	}
+	fprintf(stderr, "captured %'lu %s samples from %d threads in %s\n", total, tsc_variant,
+		nr_cpus, capture_dir);
+	free(threads);
+}
+
+/*
+ * tsc analyze FILE...  Deltas go into a histogram with one bucket per
+ * cycle up to ANALYZE_EXACT, which is enough for percentiles.  A second
+ * pass adds up how far the slow samples go over the median in
+ * ANALYZE_BIN_NS bins, and an FFT of that finds periodic spikes like the
+ * timer tick.
+ */
+#define ANALYZE_EXACT 65536
+#define ANALYZE_MAX_CPUS 4096
+#define ANALYZE_BIN_NS 10000
+#define ANALYZE_MAX_BINS (1 << 22)
+#define ANALYZE_CHUNK 65536
+#define ANALYZE_PEAKS 5
+
+struct analyze_hist {
+	unsigned long samples;
+	unsigned long above;
+	unsigned long max;
+	unsigned long spikes;
+	unsigned long migrations;
+	unsigned long buckets[ANALYZE_EXACT];
+};
+
+struct analyze_state {
+	struct analyze_hist all;
+	struct analyze_hist *cpus[ANALYZE_MAX_CPUS];
+	unsigned long tsc_khz;
+	unsigned long first_tsc;
+	unsigned long last_tsc;
+	unsigned long threshold;
+	unsigned long median;
+	double *series;
+	unsigned long nr_bins;
+	unsigned long used_bins;
+};
+
+static void analyze_add(struct analyze_hist *h, struct capture_record *r)
+{
+	h->samples++;
+	if (r->delta < ANALYZE_EXACT)
+		h->buckets[r->delta]++;
+	else
+		h->above++;
+	if (r->delta > h->max)
+		h->max = r->delta;
+	if (r->flags & CAPTURE_MIGRATED)
+		h->migrations++;
+}
+
+/* the delta in cycles below which 'pct' percent of the samples fall */
+static unsigned long analyze_percentile(struct analyze_hist *h, double pct)
+{
+	unsigned long i = hist_percentile(h->buckets, ANALYZE_EXACT, h->samples, pct);
+
+	return i < ANALYZE_EXACT ? i : h->max;
+}
+
+static FILE *analyze_open(char *path, struct capture_header *hdr)
+{
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+	    memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) ||
+	    hdr->version != CAPTURE_VERSION ||
+	    hdr->record_size != sizeof(struct capture_record)) {
+		fprintf(stderr, "%s is not a version %d capture file\n", path, CAPTURE_VERSION);
+		fclose(f);
+		return NULL;
+	}
+	if (!hdr->complete)
+		fprintf(stderr, "%s is incomplete, using what was written\n", path);
+	if (fseek(f, hdr->header_size, SEEK_SET)) {
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+/*
+ * streams every record in every file through func.  Incomplete files
+ * are read until the end of the data that is there.
+ */
+static void analyze_pass(char **files, int nr_files, struct analyze_state *st,
+			 void (*func)(struct analyze_state *st, struct capture_record *r))
+{
+	struct capture_record *recs;
+	struct capture_header hdr;
+	size_t got, i;
+	unsigned long left;
+	FILE *f;
+	int n;
+
+	recs = malloc(ANALYZE_CHUNK * sizeof(*recs));
+	if (!recs) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (n = 0; n < nr_files; n++) {
+		f = analyze_open(files[n], &hdr);
+		if (!f)
+			continue;
+		if (!st->tsc_khz)
+			st->tsc_khz = hdr.tsc_khz;
+		left = hdr.complete ? hdr.nr_records : ~0UL;
+		while (left) {
+			got = fread(recs, sizeof(*recs), left < ANALYZE_CHUNK ? left : ANALYZE_CHUNK, f);
+			if (!got)
+				break;
+			for (i = 0; i < got; i++) {
+				/* an incomplete file may have zeroed records at the end */
+				if (!recs[i].tsc)
+					break;
+				func(st, &recs[i]);
+			}
+			if (i < got)
+				break;
+			left -= got;
+		}
+		fclose(f);
+	}
+	free(recs);
+}
+
+static void analyze_first(struct analyze_state *st, struct capture_record *r)
+{
+	struct analyze_hist **h = &st->cpus[r->cpu % ANALYZE_MAX_CPUS];
+
+	if (!*h) {
+		*h = calloc(1, sizeof(**h));
+		if (!*h) {
+			fprintf(stderr, "calloc failed\n");
+			exit(1);
+		}
+	}
+	analyze_add(&st->all, r);
+	analyze_add(*h, r);
+	if (!st->first_tsc || r->tsc < st->first_tsc)
+		st->first_tsc = r->tsc;
+	if (r->tsc > st->last_tsc)
+		st->last_tsc = r->tsc;
+}
+
+static void analyze_second(struct analyze_state *st, struct capture_record *r)
+{
+	unsigned long bin;
+
+	if (r->delta < st->threshold)
+		return;
+	st->all.spikes++;
+	st->cpus[r->cpu % ANALYZE_MAX_CPUS]->spikes++;
+	bin = (r->tsc - st->first_tsc) * 1000000 / st->tsc_khz / ANALYZE_BIN_NS;
+	if (bin < st->nr_bins)
+		st->series[bin] += r->delta - st->median;
+}
+
+/* in place iterative radix 2 FFT, n is a power of two */
+static void fft(double *re, double *im, unsigned long n)
+{
+	unsigned long i, j, k, len;
+
+	for (i = 1, j = 0; i < n; i++) {
+		unsigned long bit = n >> 1;
+
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			double t = re[i];
+
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+	for (len = 2; len <= n; len <<= 1) {
+		double ang = -2 * M_PI / len;
+		double wr = cos(ang), wi = sin(ang);
+
+		for (i = 0; i < n; i += len) {
+			double cr = 1, ci = 0;
+
+			for (k = 0; k < len / 2; k++) {
+				unsigned long a = i + k, b = i + k + len / 2;
+				double tr = re[b] * cr - im[b] * ci;
+				double ti = re[b] * ci + im[b] * cr;
+				double nr;
+
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+				nr = cr * wr - ci * wi;
+				ci = cr * wi + ci * wr;
+				cr = nr;
+			}
+		}
+	}
+}
+
+/* the strongest local maxima of the spike spectrum */
+static void analyze_periodicity(struct analyze_state *st)
+{
+	unsigned long n = st->nr_bins;
+	unsigned long used = st->used_bins;
+	double *im, *power;
+	double mean = 0, total = 0;
+	unsigned long peaks[ANALYZE_PEAKS] = { 0 };
+	unsigned long i, lowest;
+	int p, q;
+
+	im = calloc(n, sizeof(*im));
+	power = calloc(n / 2, sizeof(*power));
+	if (!im || !power) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	/* the padding after the capture stays zero */
+	for (i = 0; i < used; i++)
+		mean += st->series[i];
+	mean /= used;
+	for (i = 0; i < used; i++)
+		st->series[i] -= mean;
+	fft(st->series, im, n);
+	for (i = 1; i < n / 2; i++) {
+		power[i] = st->series[i] * st->series[i] + im[i] * im[i];
+		total += power[i];
+	}
+	mean = total / (n / 2 - 1);
+
+	/* a period needs to repeat at least four times to count */
+	lowest = 4 * n / used;
+	for (i = lowest > 2 ? lowest : 2; i < n / 2 - 1; i++) {
+		if (power[i] < power[i - 1] || power[i] < power[i + 1])
+			continue;
+		for (p = 0; p < ANALYZE_PEAKS; p++) {
+			if (!peaks[p] || power[i] > power[peaks[p]]) {
+				for (q = ANALYZE_PEAKS - 1; q > p; q--)
+					peaks[q] = peaks[q - 1];
+				peaks[p] = i;
+				break;
+			}
+		}
+	}
+
+	fprintf(stderr, "periodicity of slow samples (%d us bins, %lu bins):\n",
+		ANALYZE_BIN_NS / 1000, n);
+	for (p = 0; p < ANALYZE_PEAKS && peaks[p]; p++) {
+		double hz = peaks[p] * 1e9 / ((double)n * ANALYZE_BIN_NS);
+
+		fprintf(stderr, "\tperiod %10.3f ms (%9.2f Hz) power %8.1fx mean\n", 1000 / hz, hz,
+			mean ? power[peaks[p]] / mean : 0);
+	}
+	free(im);
+	free(power);
+}
+
+static void analyze_report_hist(char *name, struct analyze_hist *h, double ns)
+{
+	fprintf(stderr, "%-8s samples %'12lu p50 %7.1f p99 %7.1f p99.9 %8.1f p99.99 %9.1f "
+		"max %11.1f ns spikes %'9lu migrations %'lu\n", name, h->samples,
+		analyze_percentile(h, 50) * ns, analyze_percentile(h, 99) * ns,
+		analyze_percentile(h, 99.9) * ns, analyze_percentile(h, 99.99) * ns,
+		h->max * ns, h->spikes, h->migrations);
+}
+
+void run_analyze(char **files, int nr_files)
+{
+	struct analyze_state *st;
+	unsigned long span_ns;
+	double ns;
+	char name[16];
+	int i;
+
+	if (!nr_files) {
+		fprintf(stderr, "usage: tsc analyze FILE...\n");
+		exit(1);
+	}
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	analyze_pass(files, nr_files, st, analyze_first);
+	if (!st->all.samples || !st->tsc_khz) {
+		fprintf(stderr, "no samples\n");
+		exit(1);
+	}
+	ns = 1e6 / st->tsc_khz;
+	span_ns = (st->last_tsc - st->first_tsc) * ns;
+
+	/* slow means ten times the median, and at least p99.9 */
+	st->median = analyze_percentile(&st->all, 50);
+	st->threshold = analyze_percentile(&st->all, 99.9);
+	if (st->threshold < st->median * 10)
+		st->threshold = st->median * 10;
+	for (st->nr_bins = 64; st->nr_bins < span_ns / ANALYZE_BIN_NS &&
+	     st->nr_bins < ANALYZE_MAX_BINS; st->nr_bins *= 2)
+		;
+	st->used_bins = span_ns / ANALYZE_BIN_NS + 1;
+	if (st->used_bins > st->nr_bins)
+		st->used_bins = st->nr_bins;
+	st->series = calloc(st->nr_bins, sizeof(*st->series));
+	if (!st->series) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	analyze_pass(files, nr_files, st, analyze_second);
+
+	fprintf(stderr, "%d files, %.3f s, tsc %.3f GHz, slow samples are over %.1f ns\n",
+		nr_files, span_ns / 1e9, st->tsc_khz / 1e6, st->threshold * ns);
+	analyze_report_hist("all", &st->all, ns);
+	for (i = 0; i < ANALYZE_MAX_CPUS; i++) {
+		if (!st->cpus[i])
+			continue;
+		snprintf(name, sizeof(name), "cpu %d", i);
+		analyze_report_hist(name, st->cpus[i], ns);
+	}
+	analyze_periodicity(st);
+
+	for (i = 0; i < ANALYZE_MAX_CPUS; i++)
+		free(st->cpus[i]);
+	free(st->series);
+	free(st);
+}
+
+/*
+ * the vDSO retries its seqlock when the timekeeper is updated on the
+ * tick, so slow clock_gettime() calls should bunch up at one tick phase.
+ * Each read is timed with the TSC and folded modulo the tick period.
+ * Coarse clocks only move on the tick, so CLOCK_MONOTONIC_COARSE tells us
+ * where the tick is.  On a nohz_full cpu with one task the tick stops and
+ * the slow reads should spread out.
+ */
+#define TICKPHASE_BINS 20
+/* re-map the TSC onto CLOCK_MONOTONIC this often, so drift can't smear the phase */
+#define TICKPHASE_ANCHOR_MS 100
+#define TICKPHASE_CALIBRATE 100000
+
+/* hz=N, zero means CONFIG_HZ or measure it */
+static long tick_hz = 0;
+
+static int tickphase_clocks[] = {
+	CLOCK_REALTIME, CLOCK_MONOTONIC, CLOCK_MONOTONIC_RAW, CLOCK_BOOTTIME, CLOCK_TAI,
+	CLOCK_REALTIME_COARSE, CLOCK_MONOTONIC_COARSE,
+};
+
+static char *tickphase_clock_names[] = {
+	"CLOCK_REALTIME", "CLOCK_MONOTONIC", "CLOCK_MONOTONIC_RAW", "CLOCK_BOOTTIME",
+	"CLOCK_TAI", "CLOCK_REALTIME_COARSE", "CLOCK_MONOTONIC_COARSE",
+};
+
+#define TICKPHASE_NR_CLOCKS (sizeof(tickphase_clocks) / sizeof(tickphase_clocks[0]))
+
+struct tickphase_bin {
+	unsigned long samples;
+	unsigned long slow;
+	double slow_cycles;
+};
+
+/* CONFIG_HZ from the kernel config in /boot, or 0 */
+static long config_hz(void)
+{
+	struct utsname u;
+	char path[PATH_MAX];
+	char line[256];
+	long hz = 0;
+	FILE *f;
+
+	if (uname(&u))
+		return 0;
+	snprintf(path, sizeof(path), "/boot/config-%s", u.release);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "CONFIG_HZ=%ld", &hz) == 1)
+			break;
+	}
+	fclose(f);
+	return hz;
+}
+
+/* the smallest step of CLOCK_MONOTONIC_COARSE while we keep the cpu busy */
+static unsigned long measure_tick_ns(void)
+{
+	unsigned long step = ~0UL;
+	unsigned long last, now;
+	int i;
+
+	last = 0;
+	for (i = 0; i < 20; i++) {
+		struct timespec ts;
+
+		do {
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+			now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		} while (now == last);
+		if (last && now - last < step)
+			step = now - last;
+		last = now;
+	}
+	return step;
+}
+
+/* median cycles of one clock_gettime(clk) call */
+static unsigned long tickphase_median(int clk, unsigned long *costs)
+{
+	struct timespec ts;
+	unsigned long t0;
+	unsigned int aux;
+	int i;
+
+	for (i = 0; i < TICKPHASE_CALIBRATE; i++) {
+		t0 = rdtscp(&aux);
+		clock_gettime(clk, &ts);
+		costs[i] = rdtscp(&aux) - t0;
+	}
+	qsort(costs, TICKPHASE_CALIBRATE, sizeof(*costs), cmp_ulong);
+	return costs[TICKPHASE_CALIBRATE / 2];
+}
+
+static void tickphase_measure(int clk, unsigned long period_ns, unsigned long threshold,
+			      struct tickphase_bin *bins)
+{
+	double ghz = tsc_ghz();
+	unsigned long end, anchor_tsc, anchor_ns, offset_ns, t0, t1, ns;
+	unsigned long anchor_cycles = TICKPHASE_ANCHOR_MS * 1000000UL * ghz;
+	struct timespec ts;
+	unsigned int aux;
+	int bin;
+
+	memset(bins, 0, TICKPHASE_BINS * sizeof(*bins));
+	end = rdtscp(&aux) + runtime * 1e9 * ghz;
+	anchor_tsc = 0;
+	anchor_ns = 0;
+	offset_ns = 0;
+	while (1) {
+		t0 = rdtscp(&aux);
+		clock_gettime(clk, &ts);
+		t1 = rdtscp(&aux);
+		if (t0 - anchor_tsc > anchor_cycles) {
+			if (t0 > end)
+				break;
+			/* the coarse clock is the time of the last tick */
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+			offset_ns = (ts.tv_sec * 1000000000ULL + ts.tv_nsec) % period_ns;
+			anchor_tsc = rdtscp(&aux);
+			anchor_ns = mono_ns();
+			continue;
+		}
+		ns = anchor_ns + (t0 - anchor_tsc) / ghz;
+		bin = ((ns + period_ns - offset_ns) % period_ns) * TICKPHASE_BINS / period_ns;
+		bins[bin].samples++;
+		if (t1 - t0 > threshold) {
+			bins[bin].slow++;
+			bins[bin].slow_cycles += t1 - t0;
+		}
+	}
+}
+
+static int cpu_in_list(char *path, int cpu)
+{
+	char buf[4096];
+	char *p = buf;
+	long lo, hi;
+
+	if (read_sysfs(path, buf, sizeof(buf)))
+		return 0;
+	while (*p) {
+		lo = strtol(p, &p, 10);
+		hi = lo;
+		if (*p == '-')
+			hi = strtol(p + 1, &p, 10);
+		if (cpu >= lo && cpu <= hi)
+			return 1;
+		if (*p != ',')
+			break;
+		p++;
+	}
+	return 0;
+}
+
+void run_tickphase(void)
+{
+	struct tickphase_bin bins[TICKPHASE_BINS];
+	unsigned long *costs;
+	unsigned long period_ns, median, threshold;
+	unsigned long samples, slow;
+	struct timespec ts;
+	double ns = 1 / tsc_ghz();
+	double peak;
+	long hz;
+	char *source;
+	unsigned long i;
+	int b, cpu;
+
+	cpu = sched_getcpu();
+	if (cpu < 0 || pin_to_cpu(cpu)) {
+		perror("pinning to a cpu");
+		exit(1);
+	}
+	if (tick_hz) {
+		hz = tick_hz;
+		source = "hz=";
+		period_ns = 1000000000UL / hz;
+	} else if ((hz = config_hz())) {
+		source = "CONFIG_HZ";
+		period_ns = 1000000000UL / hz;
+	} else {
+		source = "measured";
+		period_ns = measure_tick_ns();
+		hz = 1000000000UL / period_ns;
+	}
+	fprintf(stderr, "cpu %d%s, tick %ld Hz (%s), %lu ns period, %d phase bins\n", cpu,
+		cpu_in_list("/sys/devices/system/cpu/nohz_full", cpu) ? " (nohz_full)" : "",
+		hz, source, period_ns, TICKPHASE_BINS);
+	if (!clock_getres(CLOCK_MONOTONIC_COARSE, &ts) && ts.tv_nsec != (long)period_ns)
+		fprintf(stderr, "warning: coarse clock resolution is %ld ns\n", ts.tv_nsec);
+
+	costs = malloc(TICKPHASE_CALIBRATE * sizeof(*costs));
+	if (!costs) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (i = 0; i < TICKPHASE_NR_CLOCKS; i++) {
+		if (clock_gettime(tickphase_clocks[i], &ts) < 0)
+			continue;
+		/* slow means twice the median, anything that did the work twice */
+		median = tickphase_median(tickphase_clocks[i], costs);
+		threshold = median * 2;
+		tickphase_measure(tickphase_clocks[i], period_ns, threshold, bins);
+
+		samples = 0;
+		slow = 0;
+		peak = 0;
+		for (b = 0; b < TICKPHASE_BINS; b++) {
+			samples += bins[b].samples;
+			slow += bins[b].slow;
+			if (bins[b].samples && (double)bins[b].slow / bins[b].samples > peak)
+				peak = (double)bins[b].slow / bins[b].samples;
+		}
+		fprintf(stderr, "%s median %.1f ns, slow over %.1f ns, %'lu reads, %.4f%% slow, "
+			"peak phase %.1fx the average\n", tickphase_clock_names[i], median * ns,
+			threshold * ns, samples, samples ? slow * 100.0 / samples : 0,
+			slow ? peak * samples / slow : 0);
+		for (b = 0; b < TICKPHASE_BINS; b++) {
+			struct tickphase_bin *tb = &bins[b];
+
+			fprintf(stderr, "\tphase %7.1f-%7.1f us reads %'11lu slow %8.4f%% slow cost %8.1f ns\n",
+				(double)period_ns * b / TICKPHASE_BINS / 1000,
+				(double)period_ns * (b + 1) / TICKPHASE_BINS / 1000, tb->samples,
+				tb->samples ? tb->slow * 100.0 / tb->samples : 0,
+				tb->slow ? tb->slow_cycles / tb->slow * ns : 0);
+		}
+	}
+	free(costs);
+}
+
+/*
+ * containers run with cpu.max quotas and more threads than cpus.  This
+ * runs the clock read and ipc loops with ratio= threads per cpu, cut into
+ * short windows, and reads the cgroup cpu.stat throttling counters around
+ * every window.  Windows where the cgroup was throttled are reported on
+ * their own so they don't get mixed in with the clean ones.
+ */
+#define OVERSUB_WINDOW_MS 250
+/* log linear buckets, 8 per power of two */
+#define LAT_BUCKETS 496
+
+/* ratio=N threads per cpu */
+static int oversub_ratio = 2;
+static volatile int oversub_window;
+static int oversub_nr_windows;
+
+struct oversub_stats {
+	unsigned long loops;
+	unsigned long hist[LAT_BUCKETS];
+};
+
+struct oversub_thread {
+	pthread_t thread;
+	struct oversub_stats *windows;
+};
+
+struct cgroup_cpu {
+	char stat[2 * PATH_MAX + 16];
+	char limit[128];
+	int v1;
+};
+
+struct cgroup_cpu_stat {
+	unsigned long nr_periods;
+	unsigned long nr_throttled;
+	unsigned long throttled_usec;
+};
+
+static inline int lat_bucket(unsigned long v)
+{
+	int log;
+
+	if (v < 16)
+		return v;
+	log = 63 - __builtin_clzl(v);
+	return 16 + (log - 4) * 8 + ((v >> (log - 3)) & 7);
+}
+
+static unsigned long lat_bucket_start(int b)
+{
+	int log;
+
+	if (b < 16)
+		return b;
+	log = (b - 16) / 8 + 4;
+	return (unsigned long)(8 + (b - 16) % 8) << (log - 3);
+}
+
+static unsigned long lat_percentile(unsigned long *hist, unsigned long total, double pct)
+{
+	unsigned long b = hist_percentile(hist, LAT_BUCKETS, total, pct);
+
+	return b < LAT_BUCKETS ? lat_bucket_start(b) : 0;
+}
+
+/* the mount point of a cgroup hierarchy, v2 when opt is NULL */
+static int cgroup_mount(char *opt, char *mnt, size_t len)
+{
+	char dev[64], dir[PATH_MAX], type[64], opts[512];
+	char line[1024];
+	FILE *f;
+	int found = 0;
+
+	f = fopen("/proc/mounts", "r");
+	if (!f)
+		return 0;
+	while (!found && fgets(line, sizeof(line), f)) {
+		char *tok, *save;
+
+		if (sscanf(line, "%63s %4095s %63s %511s", dev, dir, type, opts) != 4)
+			continue;
+		if (!opt) {
+			found = strcmp(type, "cgroup2") == 0;
+			continue;
+		}
+		if (strcmp(type, "cgroup"))
+			continue;
+		for (tok = strtok_r(opts, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (strcmp(tok, opt) == 0)
+				found = 1;
+		}
+	}
+	fclose(f);
+	if (found)
+		snprintf(mnt, len, "%s", dir);
+	return found;
+}
+
+static int read_cgroup_cpu_stat(struct cgroup_cpu *cg, struct cgroup_cpu_stat *st)
+{
+	char key[64];
+	unsigned long val;
+	int found = 0;
+	FILE *f;
+
+	memset(st, 0, sizeof(*st));
+	f = fopen(cg->stat, "r");
+	if (!f)
+		return -1;
+	while (fscanf(f, "%63s %lu", key, &val) == 2) {
+		if (strcmp(key, "nr_periods") == 0) {
+			st->nr_periods = val;
+		} else if (strcmp(key, "nr_throttled") == 0) {
+			st->nr_throttled = val;
+			found = 1;
+		} else if (strcmp(key, "throttled_usec") == 0) {
+			st->throttled_usec = val;
+		} else if (strcmp(key, "throttled_time") == 0) {
+			/* v1 counts in ns */
+			st->throttled_usec = val / 1000;
+		}
+	}
+	fclose(f);
+	return found ? 0 : -1;
+}
+
+/*
+ * finds our cpu.stat with throttling counters, cgroup v2 first and the
+ * v1 cpu controller on hybrid systems
+ */
+static int find_cgroup_cpu(struct cgroup_cpu *cg)
+{
+	struct cgroup_cpu_stat st;
+	char v2[PATH_MAX] = "", v1[PATH_MAX] = "";
+	int have_v2 = 0, have_v1 = 0;
+	char line[PATH_MAX + 64];
+	char mnt[PATH_MAX];
+	char path[2 * PATH_MAX + 32];
+	char buf[64], buf2[64];
+	FILE *f;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		char *ctrl = strchr(line, ':');
+		char *cgpath = ctrl ? strchr(ctrl + 1, ':') : NULL;
+		char *tok, *save;
+
+		if (!cgpath)
+			continue;
+		*cgpath++ = '\0';
+		cgpath[strcspn(cgpath, "\n")] = '\0';
+		ctrl++;
+		if (strcmp(cgpath, "/") == 0)
+			*cgpath = '\0';
+		if (!*ctrl) {
+			snprintf(v2, sizeof(v2), "%s", cgpath);
+			have_v2 = 1;
+			continue;
+		}
+		for (tok = strtok_r(ctrl, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (strcmp(tok, "cpu") == 0) {
+				snprintf(v1, sizeof(v1), "%s", cgpath);
+				have_v1 = 1;
+			}
+		}
+	}
+	fclose(f);
+
+	if (have_v2 && cgroup_mount(NULL, mnt, sizeof(mnt))) {
+		snprintf(cg->stat, sizeof(cg->stat), "%s%s/cpu.stat", mnt, v2);
+		cg->v1 = 0;
+		if (!read_cgroup_cpu_stat(cg, &st)) {
+			snprintf(path, sizeof(path), "%s%s/cpu.max", mnt, v2);
+			if (read_sysfs(path, cg->limit, sizeof(cg->limit)))
+				strcpy(cg->limit, "max");
+			return 0;
+		}
+	}
+	if (have_v1 && cgroup_mount("cpu", mnt, sizeof(mnt))) {
+		snprintf(cg->stat, sizeof(cg->stat), "%s%s/cpu.stat", mnt, v1);
+		cg->v1 = 1;
+		if (!read_cgroup_cpu_stat(cg, &st)) {
+			snprintf(path, sizeof(path), "%s%s/cpu.cfs_quota_us", mnt, v1);
+			if (read_sysfs(path, buf, sizeof(buf)))
+				strcpy(buf, "-1");
+			snprintf(path, sizeof(path), "%s%s/cpu.cfs_period_us", mnt, v1);
+			if (read_sysfs(path, buf2, sizeof(buf2)))
+				strcpy(buf2, "100000");
+			snprintf(cg->limit, sizeof(cg->limit), "%s %s",
+				 strcmp(buf, "-1") ? buf : "max", buf2);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* read to read gaps of the clock, preemption shows up in the tail */
+void *oversub_clock_thread(void *arg)
+{
+	struct oversub_thread *ot = arg;
+	unsigned long prev, now;
+	unsigned int aux;
+	int w;
+
+	prev = rdtscp(&aux);
+	while (!stopping) {
+		read_tsc(&aux);
+		now = rdtscp(&aux);
+		w = oversub_window;
+		ot->windows[w].loops++;
+		ot->windows[w].hist[lat_bucket(now - prev)]++;
+		prev = now;
+	}
+	return NULL;
+}
+
+void *oversub_ipc_thread(void *arg)
+{
+	struct oversub_thread *ot = arg;
+	unsigned long loops;
+
+	while (!stopping) {
+		loops = 0;
+		if (run_mode & MODE_HIGH_IPC) {
+			if (compact_matrix)
+				high_ipc_compact(global_matrix32, &loops, read_tsc);
+			else
+				high_ipc(global_matrix, &loops, read_tsc);
+		} else {
+			if (compact_matrix)
+				low_ipc_compact(global_matrix32, &loops, read_tsc);
+			else
+				low_ipc(global_matrix, &loops, read_tsc);
+		}
+		ot->windows[oversub_window].loops += loops;
+	}
+	return NULL;
+}
+
+struct oversub_window_info {
+	unsigned long usecs;
+	unsigned long throttled;
+	unsigned long throttled_usec;
+};
+
+/*
+ * one row for the clean windows and one for the throttled ones.  The
+ * first run of each workload (ratio 1) sets *baseline, later runs are
+ * compared against it.
+ */
+static void oversub_report(char *name, int nr_threads, int ratio, struct oversub_thread *threads,
+			   struct oversub_window_info *info, int clock, int have_cgroup,
+			   double *baseline)
+{
+	unsigned long hist[LAT_BUCKETS];
+	unsigned long loops, usecs, throttled_usec;
+	double ns = 1 / tsc_ghz();
+	double rate;
+	int throttled, nr, w, t, b, max;
+
+	for (throttled = 0; throttled < 2; throttled++) {
+		memset(hist, 0, sizeof(hist));
+		loops = usecs = throttled_usec = 0;
+		nr = 0;
+		for (w = 0; w < oversub_nr_windows; w++) {
+			if (!!info[w].throttled != throttled)
+				continue;
+			nr++;
+			usecs += info[w].usecs;
+			throttled_usec += info[w].throttled_usec;
+			for (t = 0; t < nr_threads; t++) {
+				loops += threads[t].windows[w].loops;
+				for (b = 0; b < LAT_BUCKETS; b++)
+					hist[b] += threads[t].windows[w].hist[b];
+			}
+		}
+		if (!nr)
+			continue;
+		rate = usecs ? loops * 1e6 / usecs : 0;
+		if (ratio == 1 && (!throttled || *baseline == 0))
+			*baseline = rate;
+		fprintf(stderr, "%-9s ratio %2d threads %3d %-9s windows %3d %s %'14.0f",
+			name, ratio, nr_threads,
+			!have_cgroup ? "unknown" : throttled ? "THROTTLED" : "clean", nr,
+			clock ? "calls/s" : "loops/s", rate);
+		if (ratio > 1 && *baseline > 0)
+			fprintf(stderr, " (%.2fx ratio 1)", rate / *baseline);
+		if (clock) {
+			for (max = LAT_BUCKETS - 1; max > 0 && !hist[max]; max--)
+				;
+			fprintf(stderr, " gap p50 %.0f p99 %.0f p99.9 %.0f p99.99 %.0f max %.0f ns",
+				lat_percentile(hist, loops, 50) * ns,
+				lat_percentile(hist, loops, 99) * ns,
+				lat_percentile(hist, loops, 99.9) * ns,
+				lat_percentile(hist, loops, 99.99) * ns,
+				lat_bucket_start(max) * ns);
+		}
+		if (throttled)
+			fprintf(stderr, " throttled %.1f ms", throttled_usec / 1000.0);
+		fprintf(stderr, "\n");
+	}
+}
+
+static void oversub_run(char *name, thread_func func, int ratio, int nr_cpus,
+			struct cgroup_cpu *cg, int have_cgroup, double *baseline)
+{
+	struct oversub_window_info *info;
+	struct oversub_thread *threads;
+	struct cgroup_cpu_stat before, after;
+	struct timeval start, now;
+	int nr_threads = ratio * nr_cpus;
+	int t, w, ret;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	info = calloc(oversub_nr_windows, sizeof(*info));
+	if (!threads || !info) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	oversub_window = 0;
+	stopping = 0;
+	for (t = 0; t < nr_threads; t++) {
+		threads[t].windows = calloc(oversub_nr_windows, sizeof(struct oversub_stats));
+		if (!threads[t].windows) {
+			fprintf(stderr, "calloc failed\n");
+			exit(1);
+		}
+		ret = pthread_create(&threads[t].thread, NULL, func, &threads[t]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed: %d\n", ret);
+			exit(1);
+		}
+	}
+	for (w = 0; w < oversub_nr_windows; w++) {
+		oversub_window = w;
+		if (have_cgroup)
+			read_cgroup_cpu_stat(cg, &before);
+		gettimeofday(&start, NULL);
+		usleep(OVERSUB_WINDOW_MS * 1000);
+		gettimeofday(&now, NULL);
+		/* the threads are still counting into this window until it changes */
+		info[w].usecs = tvdelta(&start, &now);
+		if (have_cgroup) {
+			read_cgroup_cpu_stat(cg, &after);
+			info[w].throttled = after.nr_throttled - before.nr_throttled;
+			info[w].throttled_usec = after.throttled_usec - before.throttled_usec;
+		}
+	}
+	stopping = 1;
+	for (t = 0; t < nr_threads; t++)
+		pthread_join(threads[t].thread, NULL);
+
+	oversub_report(name, nr_threads, ratio, threads, info, func == oversub_clock_thread,
+		       have_cgroup, baseline);
+	for (t = 0; t < nr_threads; t++)
+		free(threads[t].windows);
+	free(threads);
+	free(info);
+}
+
+void run_oversub(void)
+{
+	struct cgroup_cpu cg;
+	cpu_set_t set;
+	double baseline = 0;
+	int have_cgroup;
+	int nr_cpus;
+	char *ipc = (run_mode & MODE_HIGH_IPC) ? "high_ipc" : "low_ipc";
+
+	if (oversub_ratio < 1) {
+		fprintf(stderr, "ratio must be at least 1\n");
+		exit(1);
+	}
+	if (sched_getaffinity(0, sizeof(set), &set)) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+	nr_cpus = CPU_COUNT(&set);
+	oversub_nr_windows = runtime * 1000 / OVERSUB_WINDOW_MS;
+	if (oversub_nr_windows < 1)
+		oversub_nr_windows = 1;
+
+	have_cgroup = find_cgroup_cpu(&cg) == 0;
+	if (have_cgroup)
+		fprintf(stderr, "cgroup %s %s, cpu limit %s\n", cg.v1 ? "v1" : "v2", cg.stat,
+			cg.limit);
+	else
+		fprintf(stderr, "no cgroup cpu.stat with throttling counters, windows can't be flagged\n");
+	fprintf(stderr, "%d cpus, %d windows of %d ms, clock %s\n", nr_cpus, oversub_nr_windows,
+		OVERSUB_WINDOW_MS, tsc_variant);
+
+	/* ratio 1 first, so there is a baseline to compare with */
+	oversub_run(tsc_variant, oversub_clock_thread, 1, nr_cpus, &cg, have_cgroup, &baseline);
+	if (oversub_ratio > 1)
+		oversub_run(tsc_variant, oversub_clock_thread, oversub_ratio, nr_cpus, &cg,
+			    have_cgroup, &baseline);
+	baseline = 0;
+	oversub_run(ipc, oversub_ipc_thread, 1, nr_cpus, &cg, have_cgroup, &baseline);
+	if (oversub_ratio > 1)
+		oversub_run(ipc, oversub_ipc_thread, oversub_ratio, nr_cpus, &cg, have_cgroup,
+			    &baseline);
+}
+
+/*
+ * the compact layout is only useful if the low IPC loop still misses the
+ * cache like it does with the original layout.  Run both, one after the
+ * other so we never need memory for both, and compare.
+ */
+void run_layout_check(void)
+{
+	struct thread_data td[2] = { { 0 } };
+	char *names[2] = { "original", "compact" };
+	struct perf_counters pc;
+	int have_perf;
+	int i;
+
+	have_perf = perf_open(&pc) == 0;
+	if (have_perf)
+		perf_close(&pc);
+	else
+		fprintf(stderr, "perf counters unavailable, only comparing loops/s\n");
+
+	/* both layouts are built fresh in memory */
+	matrix_file = NULL;
+	for (i = 0; i < 2; i++) {
+		compact_matrix = i;
+		alloc_matrix();
+		td[i].count_ipc = 1;
+		run_for_secs(runtime, low_ipc_thread, &td[i]);
+		free(compact_matrix ? (void *)global_matrix32 : (void *)global_matrix);
+		set_matrix(NULL);
+	}
+
+	fprintf(stderr, "layout     entries    MB        loops/s   ipc  llc mpki\n");
+	for (i = 0; i < 2; i++)
+		fprintf(stderr, "%-8s %9lu %5lu %'14lu %5.2f %9.2f\n", names[i], matrix_size,
+			(matrix_size * (i ? sizeof(*global_matrix32) : sizeof(*global_matrix))) >> 20,
+			td[i].calls_per_sec, td[i].ipc, td[i].mpki);
+	if (have_perf && td[0].mpki > 0)
+		fprintf(stderr, "compact/original miss rate %.2f\n", td[1].mpki / td[0].mpki);
+}
+
+struct cxx_c_variant {
+	char *name;
+	int mode;
+};
+
+static struct cxx_c_variant cxx_c_variants[] = {
+	{ "notsc", MODE_NO_TSC },
+	{ "rdtsc", MODE_RDTSC },
+	{ "rdtscp", MODE_RDTSCP },
+	{ "rdtsc_lfence", MODE_RDTSC_LFENCE },
+	{ "clock_gettime", MODE_GETTIME },
+};
+
+#define NR_CXX_C_VARIANTS (sizeof(cxx_c_variants) / sizeof(cxx_c_variants[0]))
+
+/*
+ * the C loops call the clock through the noinline read_tsc(), the C++
+ * loops have it inlined through a template.  Run both with the same
+ * matrix.  The compilers treat the two loops a little differently, so
+ * each ratio is against the loop without reads from the same language.
+ */
+void run_cxx(void)
+{
+	struct cxx_bench_result c_res[NR_CXX_C_VARIANTS];
+	struct cxx_bench_result cxx_res[CXX_BENCH_MAX];
+	struct cxx_bench_args args;
+	struct thread_data td = { 0 };
+	thread_func ipc_func;
+	int high = !!(run_mode & MODE_HIGH_IPC);
+	double base, cxx_base;
+	int nr;
+	unsigned long i;
+
+	if (compact_matrix) {
+		fprintf(stderr, "cxx only supports the original matrix layout\n");
+		exit(1);
+	}
+	ipc_func = high ? high_ipc_thread : low_ipc_thread;
+
+	for (i = 0; i < NR_CXX_C_VARIANTS; i++) {
+		run_mode = (run_mode & ~TSC_MODE_MASK) | cxx_c_variants[i].mode;
+		tsc_variant = cxx_c_variants[i].name;
+		skip_rdtsc = cxx_c_variants[i].mode == MODE_NO_TSC;
+		c_res[i].name = tsc_variant;
+		c_res[i].calls_per_sec = 0;
+		if (!skip_rdtsc) {
+			run_for_secs(runtime, read_tsc_thread, &td);
+			c_res[i].calls_per_sec = td.calls_per_sec;
+		}
+		run_for_secs(runtime, ipc_func, &td);
+		c_res[i].loops_per_sec = td.calls_per_sec;
+	}
+	skip_rdtsc = 0;
+
+	args.matrix = global_matrix;
+	args.matrix_size = matrix_size;
+	args.high_ipc_matrix = high_ipc_matrix;
+	args.factor = factor;
+	args.runtime = runtime;
+	args.high_ipc = high;
+	args.interrupted = &interrupted;
+	nr = cxx_bench(&args, cxx_res, CXX_BENCH_MAX);
+	if (interrupted)
+		journal_interrupted();
+
+	base = c_res[0].loops_per_sec;
+	cxx_base = nr ? cxx_res[0].loops_per_sec : 0;
+	fprintf(stderr, "lang clock                        calls/s      %s IPC loops/s  ratio\n",
+		high ? "high" : " low");
+	for (i = 0; i < NR_CXX_C_VARIANTS + nr; i++) {
+		struct cxx_bench_result *r;
+		int cxx = i >= NR_CXX_C_VARIANTS;
+		double b = cxx ? cxx_base : base;
+
+		r = cxx ? &cxx_res[i - NR_CXX_C_VARIANTS] : &c_res[i];
+		fprintf(stderr, "%-4s %-22s %'14lu %'21lu %6.2f\n", cxx ? "c++" : "c",
+			r->name, r->calls_per_sec, r->loops_per_sec,
+			b ? r->loops_per_sec / b : 0);
+	}
+}
+
+/*
+ * disabled instrumentation.  read_tsc() checks skip_rdtsc before doing
+ * anything, which is how most tracing gets turned off.  These are the
+ * same loops with the read behind different kinds of off switches, so we
+ * can see what a tracepoint costs when nobody is using it.
+ */
+static volatile int trace_volatile;
+static int trace_plain;
+static __thread int trace_tls;
+/* what the per thread flag is set to when a loop thread starts */
+static int trace_tls_wanted;
+
+/*
+ * the asm goto site is a 5 byte nop, and enabling it patches in a jmp to
+ * the tracing code.  Every site records itself in the trace_sites
+ * section with the same relative offsets the kernel uses for static keys.
+ */
+struct trace_site_entry {
+	int code;
+	int target;
+};
+
+extern struct trace_site_entry __start_trace_sites[];
+extern struct trace_site_entry __stop_trace_sites[];
+
+static inline __attribute__((always_inline)) int trace_key_enabled(void)
+{
+	__asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+		     ".pushsection trace_sites, \"a\"\n\t"
+		     ".balign 4\n\t"
+		     ".long 1b - ., %l[enabled] - .\n\t"
+		     ".popsection\n\t"
+		     : : : : enabled);
+	return 0;
+enabled:
+	return 1;
+}
+
+#define TRACE_SITE_NONE(val, aux) do { } while (0)
+#define TRACE_SITE_VOLATILE(val, aux) \
+	do { if (trace_volatile) val += read_tsc(aux); } while (0)
+#define TRACE_SITE_PLAIN(val, aux) \
+	do { if (trace_plain) val += read_tsc(aux); } while (0)
+#define TRACE_SITE_TLS(val, aux) \
+	do { if (trace_tls) val += read_tsc(aux); } while (0)
+#define TRACE_SITE_ASM_GOTO(val, aux) \
+	do { if (trace_key_enabled()) val += read_tsc(aux); } while (0)
+
+/* low_ipc() and high_ipc() with the read behind SITE */
+#define TRACE_LOOPS(name, SITE)							\
+static unsigned long low_ipc_##name(unsigned long *loops)			\
+{										\
+	int i, j, k;								\
+	int src = 0;								\
+	int dst = 0;								\
+	unsigned int aux __attribute__((unused));				\
+	unsigned long index = rand() % matrix_size;				\
+	volatile unsigned long val __attribute__((unused)) = 0;			\
+										\
+	for (i = 0; i < 1024; i++) {						\
+		src = global_matrix[index] % matrix_size;			\
+		index = (index + 1) % matrix_size;				\
+		dst = global_matrix[src] % matrix_size;				\
+										\
+		for (j = 0; j < 256; j++) {					\
+			dst = global_matrix[(dst + j) % matrix_size] % matrix_size; \
+			if ((i * j) % 500 == 0) {				\
+				SITE(val, &aux);				\
+				*loops += 1;					\
+			}							\
+		}								\
+		for (k = 0; k < 2 * factor; k++) {				\
+			global_matrix[dst] += global_matrix[(src + k) % matrix_size] + \
+				global_matrix[(dst + k) % matrix_size];		\
+		}								\
+		if (stopping)							\
+			break;							\
+	}									\
+	return global_matrix[dst] + val;					\
+}										\
+										\
+static void high_ipc_##name(unsigned long *loops)				\
+{										\
+	unsigned long i, j, k;							\
+	unsigned long n = high_ipc_matrix;					\
+	unsigned long *m1 = &global_matrix[0];					\
+	unsigned long *m2 = &global_matrix[n * n];				\
+	unsigned long *m3 = &global_matrix[2 * n * n];				\
+	unsigned long ops_count = 0;						\
+	unsigned int aux __attribute__((unused));				\
+	volatile unsigned long val __attribute__((unused)) = 0;			\
+										\
+	for (i = 0; i < n; i++) {						\
+		for (j = 0; j < n; j++) {					\
+			m3[i * n + j] = 0;					\
+			for (k = 0; k < n; k++) {				\
+				m3[i * n + j] += m1[i * n + k] * m2[k * n + j];	\
+				ops_count++;					\
+				if (ops_count % 500 == 0) {			\
+					SITE(val, &aux);			\
+					*loops += 1;				\
+				}						\
+				if (stopping)					\
+					return;					\
+			}							\
+		}								\
+	}									\
+}
+
+TRACE_LOOPS(none, TRACE_SITE_NONE)
+TRACE_LOOPS(volatile, TRACE_SITE_VOLATILE)
+TRACE_LOOPS(plain, TRACE_SITE_PLAIN)
+TRACE_LOOPS(tls, TRACE_SITE_TLS)
+TRACE_LOOPS(asm_goto, TRACE_SITE_ASM_GOTO)
+
+/* patches every asm goto site to a jmp (on) or back to the nop */
+static int trace_patch_sites(int on)
+{
+	static const unsigned char nop5[] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	struct trace_site_entry *e;
+
+	for (e = __start_trace_sites; e < __stop_trace_sites; e++) {
+		unsigned char *code = (unsigned char *)&e->code + e->code;
+		unsigned char *target = (unsigned char *)&e->target + e->target;
+		unsigned long start = (unsigned long)code & ~(page - 1);
+		unsigned long len = (unsigned long)code + sizeof(nop5) - start;
+		unsigned char insn[5];
+		int rel;
+
+		if (on) {
+			rel = target - (code + sizeof(insn));
+			insn[0] = 0xe9;
+			memcpy(insn + 1, &rel, sizeof(rel));
+		} else {
+			memcpy(insn, nop5, sizeof(insn));
+		}
+		if (mprotect((void *)start, len, PROT_READ | PROT_WRITE | PROT_EXEC))
+			return -1;
+		memcpy(code, insn, sizeof(insn));
+		if (mprotect((void *)start, len, PROT_READ | PROT_EXEC))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * the switches are noinline so the compiler can't see the flags change
+ * and the toggle loop doesn't collapse
+ */
+static __attribute__((noinline)) int trace_toggle_none(int on)
+{
+	(void)on;
+	return 0;
+}
+
+static __attribute__((noinline)) int trace_toggle_volatile(int on)
+{
+	trace_volatile = on;
+	return 0;
+}
+
+static __attribute__((noinline)) int trace_toggle_plain(int on)
+{
+	trace_plain = on;
+	return 0;
+}
+
+static __attribute__((noinline)) int trace_toggle_tls(int on)
+{
+	trace_tls_wanted = on;
+	trace_tls = on;
+	return 0;
+}
+
+static __attribute__((noinline)) int trace_toggle_asm_goto(int on)
+{
+	return trace_patch_sites(on);
+}
+
+struct trace_form {
+	char *name;
+	unsigned long (*low)(unsigned long *loops);
+	void (*high)(unsigned long *loops);
+	int (*toggle)(int on);
+	unsigned long off_loops[2];
+	unsigned long on_loops[2];
+	double toggle_ns;
+};
+
+#define TRACE_FORM(name) \
+	{ #name, low_ipc_##name, high_ipc_##name, trace_toggle_##name, { 0 }, { 0 }, 0 }
+
+static struct trace_form trace_forms[] = {
+	TRACE_FORM(none),
+	TRACE_FORM(volatile),
+	TRACE_FORM(plain),
+	TRACE_FORM(tls),
+	TRACE_FORM(asm_goto),
+};
+
+#define NR_TRACE_FORMS (sizeof(trace_forms) / sizeof(trace_forms[0]))
+
+static struct trace_form *trace_form;
+static int trace_high_ipc;
+static int trace_enabled;
+
+void *trace_ipc_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	unsigned long loops = 0;
+	unsigned long long delta;
+	struct timeval now;
+	struct timeval start;
+
+	/* the per thread flag has to be set from the thread itself */
+	trace_tls = trace_tls_wanted;
+	gettimeofday(&start, NULL);
+	while (!stopping) {
+		if (trace_high_ipc)
+			trace_form->high(&loops);
+		else
+			trace_form->low(&loops);
+	}
+	gettimeofday(&now, NULL);
+	delta = tvdelta(&start, &now);
+	td->calls_per_sec = (loops * USEC_PER_SEC) / delta;
+	fprintf(stderr, "%s IPC (%s tracing %s) loops/s %'lu\n",
+		trace_high_ipc ? "High" : "low", trace_form->name,
+		trace_enabled ? "on" : "off", td->calls_per_sec);
+	return NULL;
+}
+
+/* ns per switch, timed with no loop running so patching is safe */
+static double trace_toggle_cost(struct trace_form *f)
+{
+	struct timespec t0, t1;
+	int rounds = f->toggle == trace_toggle_asm_goto ? 1000 : 1000000;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < rounds; i++) {
+		if (f->toggle(1) || f->toggle(0))
+			return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + t1.tv_nsec - t0.tv_nsec) / (2.0 * rounds);
+}
+
+void run_tracepoints(void)
+{
+	struct thread_data td = { 0 };
+	unsigned long nr_sites = __stop_trace_sites - __start_trace_sites;
+	int patchable;
+	unsigned long i;
+	int ipc;
+
+	if (compact_matrix) {
+		fprintf(stderr, "tracepoints only supports the original matrix layout\n");
+		exit(1);
+	}
+
+	patchable = trace_patch_sites(0) == 0;
+	if (!patchable)
+		fprintf(stderr, "unable to patch the asm goto sites (%s), skipping them\n",
+			strerror(errno));
+	fprintf(stderr, "%lu asm goto sites, clock %s\n", nr_sites, tsc_variant);
+
+	for (i = 0; i < NR_TRACE_FORMS; i++) {
+		struct trace_form *f = &trace_forms[i];
+
+		if (f->toggle == trace_toggle_asm_goto && !patchable)
+			continue;
+		trace_form = f;
+		for (ipc = 0; ipc < 2; ipc++) {
+			trace_high_ipc = ipc;
+			trace_enabled = 0;
+			f->toggle(0);
+			run_for_secs(runtime, trace_ipc_thread, &td);
+			f->off_loops[ipc] = td.calls_per_sec;
+			if (f->toggle == trace_toggle_none)
+				continue;
+			trace_enabled = 1;
+			f->toggle(1);
+			run_for_secs(runtime, trace_ipc_thread, &td);
+			f->on_loops[ipc] = td.calls_per_sec;
+			trace_enabled = 0;
+			f->toggle(0);
+		}
+		f->toggle_ns = trace_toggle_cost(f);
+	}
+
+	fprintf(stderr, "site       ipc      off loops/s  ratio       on loops/s  ratio  toggle ns\n");
+	for (i = 0; i < NR_TRACE_FORMS; i++) {
+		struct trace_form *f = &trace_forms[i];
+
+		if (!f->off_loops[0])
+			continue;
+		for (ipc = 0; ipc < 2; ipc++) {
+			double base = trace_forms[0].off_loops[ipc];
+
+			fprintf(stderr, "%-10s %-4s %'16lu %6.3f %'16lu %6.3f %10.1f\n",
+				f->name, ipc ? "high" : "low", f->off_loops[ipc],
+				base ? f->off_loops[ipc] / base : 0, f->on_loops[ipc],
+				base ? f->on_loops[ipc] / base : 0, f->toggle_ns);
+		}
+	}
+}
+
+/*
+ * profilers get their visibility from samples instead of timestamps.
+ * This runs the ipc loop under a perf_event_open() sampler drained from
+ * its mmap ring, and under a timer_create() SIGPROF sampler, so their
+ * overhead per event can be compared with the inline clock reads.
+ */
+#define SAMPLE_MMAP_PAGES 64
+#define SAMPLE_IPS 4096
+
+/* sample_hz=N, one sampling frequency instead of the sweep */
+static unsigned long sample_hz;
+static unsigned long sample_sweep[] = { 100, 1000, 10000 };
+
+enum sample_methods {
+	SAMPLE_PERF,
+	SAMPLE_TIMER,
+	NR_SAMPLE_METHODS,
+};
+
+static char *sample_method_names[] = { "perf", "SIGPROF" };
+
+struct sample_target {
+	thread_func func;
+	struct thread_data *td;
+	volatile pid_t tid;
+	volatile int go;
+};
+
+struct sample_result {
+	unsigned long loops_per_sec;
+	unsigned long samples;
+	unsigned long lost;
+	double secs;
+	/* cpu the sampler used outside the target, draining the ring */
+	double reader_ms;
+};
+
+/* what the SIGPROF handler saw, a ring of interrupted ips */
+static volatile unsigned long sigprof_samples;
+static unsigned long sigprof_ips[SAMPLE_IPS];
+
+static void sigprof_handler(int sig, siginfo_t *info, void *ctx)
+{
+	ucontext_t *uc = ctx;
+
+	(void)sig;
+	(void)info;
+	sigprof_ips[sigprof_samples % SAMPLE_IPS] = uc->uc_mcontext.gregs[REG_RIP];
+	sigprof_samples++;
+}
+
+/* the ipc thread, held back until the sampler is attached to it */
+static void *sample_target_thread(void *arg)
+{
+	struct sample_target *st = arg;
+
+	st->tid = syscall(SYS_gettid);
+	while (!st->go)
+		sched_yield();
+	return st->func(st->td);
+}
+
+/*
+ * cycles at hz samples a second when the pmu is there, otherwise the
+ * thread's cpu clock every 1/hz seconds
+ */
+static int sample_perf_open(pid_t tid, unsigned long hz, char **event)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.freq = 1;
+	attr.sample_freq = hz;
+	attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.watermark = 1;
+	attr.wakeup_watermark = SAMPLE_MMAP_PAGES * getpagesize() / 2;
+	*event = "cycles";
+	fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+	if (fd >= 0)
+		return fd;
+
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_TASK_CLOCK;
+	attr.freq = 0;
+	attr.sample_period = 1000000000UL / hz;
+	*event = "task-clock";
+	return syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+}
+
+/* consumes everything in the ring, the way perf record does */
+static void sample_perf_drain(struct perf_event_mmap_page *meta, struct sample_result *res)
+{
+	unsigned long size = SAMPLE_MMAP_PAGES * getpagesize();
+	char *data = (char *)meta + getpagesize();
+	unsigned long head, tail;
+	char rec[256];
+
+	head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+	tail = meta->data_tail;
+	while (tail < head) {
+		struct perf_event_header *hdr;
+		unsigned long off = tail % size;
+		unsigned long len;
+
+		/* records can wrap around the end of the ring */
+		hdr = (struct perf_event_header *)(data + off);
+		len = hdr->size;
+		if (!len)
+			break;
+		if (len > sizeof(rec))
+			len = sizeof(rec);
+		if (off + len > size) {
+			memcpy(rec, data + off, size - off);
+			memcpy(rec + size - off, data, len - (size - off));
+		} else {
+			memcpy(rec, data + off, len);
+		}
+		hdr = (struct perf_event_header *)rec;
+		if (hdr->type == PERF_RECORD_SAMPLE)
+			res->samples++;
+		else if (hdr->type == PERF_RECORD_LOST)
+			res->lost += ((unsigned long *)(hdr + 1))[1];
+		tail += hdr->size;
+	}
+	__atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static double thread_cpu_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* returns -1 if the sampler can't be set up here */
+static int sample_run(int method, unsigned long hz, thread_func func, struct sample_result *res,
+		      char **event)
+{
+	struct thread_data td = { 0 };
+	struct sample_target st = { 0 };
+	struct perf_event_mmap_page *meta = NULL;
+	struct itimerspec its = { 0 };
+	struct sigaction sa;
+	struct sigevent sev;
+	struct pollfd pfd;
+	timer_t timer;
+	pthread_t thread;
+	clockid_t cpu_clock;
+	unsigned long mmap_len = (SAMPLE_MMAP_PAGES + 1) * getpagesize();
+	unsigned long start, now;
+	double cpu_start;
+	int fd = -1;
+	int ret;
+
+	memset(res, 0, sizeof(*res));
+	td.quiet = 1;
+	st.func = func;
+	st.td = &td;
+	stopping = 0;
+	ret = pthread_create(&thread, NULL, sample_target_thread, &st);
+	if (ret) {
+		fprintf(stderr, "pthread_create failed: %d\n", ret);
+		exit(1);
+	}
+	while (!st.tid)
+		sched_yield();
+
+	if (method == SAMPLE_PERF) {
+		fd = sample_perf_open(st.tid, hz, event);
+		if (fd >= 0) {
+			meta = mmap(NULL, mmap_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (meta == MAP_FAILED) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		if (fd < 0) {
+			fprintf(stderr, "perf_event_open sampling failed: %s\n", strerror(errno));
+			ret = -1;
+		} else {
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	} else {
+		*event = "thread cputime";
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = sigprof_handler;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigaction(SIGPROF, &sa, NULL);
+		sigprof_samples = 0;
+
+		/* like ITIMER_PROF, but only for the ipc thread and delivered to it */
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = SIGPROF;
+		sev._sigev_un._tid = st.tid;
+		ret = pthread_getcpuclockid(thread, &cpu_clock);
+		if (!ret)
+			ret = timer_create(cpu_clock, &sev, &timer);
+		if (ret) {
+			fprintf(stderr, "timer_create failed: %s\n", strerror(errno));
+			ret = -1;
+		} else {
+			its.it_interval.tv_nsec = 1000000000UL / hz;
+			its.it_value = its.it_interval;
+			timer_settime(timer, 0, &its, NULL);
+		}
+	}
+
+	cpu_start = thread_cpu_ms();
+	start = mono_ns();
+	st.go = 1;
+	if (ret) {
+		/* still let the thread run so it can be joined */
+		stopping = 1;
+		pthread_join(thread, NULL);
+		return -1;
+	}
+
+	now = start;
+	/* the rates below come from the time actually run, so a ^C just cuts it short */
+	while (now - start < runtime * 1000000000UL && !interrupted) {
+		if (fd >= 0) {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, 100);
+			sample_perf_drain(meta, res);
+		} else {
+			usleep(100000);
+		}
+		now = mono_ns();
+	}
+	stopping = 1;
+	pthread_join(thread, NULL);
+
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		sample_perf_drain(meta, res);
+		munmap(meta, mmap_len);
+		close(fd);
+	} else {
+		timer_delete(timer);
+		signal(SIGPROF, SIG_DFL);
+		res->samples = sigprof_samples;
+	}
+	res->reader_ms = thread_cpu_ms() - cpu_start;
+	res->secs = (mono_ns() - start) / 1e9;
+	res->loops_per_sec = td.calls_per_sec;
+	return 0;
+}
+
+/*
+ * ns each event costs the loop, from how much slower it ran than the
+ * baseline and how many events it produced a second
+ */
+static void sample_report(char *name, char *event, unsigned long hz, unsigned long loops_per_sec,
+			  double events_per_sec, double base, struct sample_result *res)
+{
+	double lost = base ? 1 - loops_per_sec / base : 0;
+	char rate[32] = "-";
+
+	if (hz)
+		snprintf(rate, sizeof(rate), "%lu", hz);
+	fprintf(stderr, "%-14s %-15s %6s %'14lu %7.2f%% %'14.0f", name, event, rate,
+		loops_per_sec, lost * 100, events_per_sec);
+	/* faster than the baseline is just noise */
+	if (events_per_sec && lost > 0)
+		fprintf(stderr, " %9.1f", lost * 1e9 / events_per_sec);
+	else
+		fprintf(stderr, " %9s", "-");
+	if (res)
+		fprintf(stderr, " reader %.1f ms lost %lu", res->reader_ms, res->lost);
+	fprintf(stderr, "\n");
+}
+
+void run_sampling(void)
+{
+	struct thread_data td = { 0 };
+	struct sample_result res;
+	unsigned long *hzs = sample_sweep;
+	int nr_hz = sizeof(sample_sweep) / sizeof(sample_sweep[0]);
+	int high = !!(run_mode & MODE_HIGH_IPC);
+	thread_func ipc_func = high ? high_ipc_thread : low_ipc_thread;
+	unsigned long inline_loops[NR_CXX_C_VARIANTS];
+	char *event;
+	double base;
+	unsigned long i;
+	int method, h;
+
+	if (sample_hz) {
+		hzs = &sample_hz;
+		nr_hz = 1;
+	}
+
+	td.quiet = 1;
+	/* warm up the matrix so the baseline isn't the slow one */
+	skip_rdtsc = 1;
+	run_for_msecs(CALIBRATE_PROBE_MSECS, ipc_func, &td);
+	for (i = 0; i < NR_CXX_C_VARIANTS; i++) {
+		run_mode = (run_mode & ~TSC_MODE_MASK) | cxx_c_variants[i].mode;
+		tsc_variant = cxx_c_variants[i].name;
+		skip_rdtsc = cxx_c_variants[i].mode == MODE_NO_TSC;
+		run_for_secs(runtime, ipc_func, &td);
+		inline_loops[i] = td.calls_per_sec;
+		fprintf(stderr, "inline %s loops/s %'lu\n", tsc_variant, td.calls_per_sec);
+	}
+
+	/* the samplers run without any clock reads in the loop */
+	run_mode = (run_mode & ~TSC_MODE_MASK) | MODE_NO_TSC;
+	tsc_variant = "notsc";
+	skip_rdtsc = 1;
+
+	fprintf(stderr, "%-14s %-15s %6s %14s %8s %14s %9s\n", "method", "event", "hz",
+		high ? "high loops/s" : "low loops/s", "slower", "events/s", "ns/event");
+	base = inline_loops[0];
+	sample_report("none", "-", 0, inline_loops[0], 0, base, NULL);
+	/* the ipc loops read the clock once per loop */
+	for (i = 1; i < NR_CXX_C_VARIANTS; i++)
+		sample_report("inline", cxx_c_variants[i].name, 0, inline_loops[i],
+			      inline_loops[i], base, NULL);
+
+	for (method = 0; method < NR_SAMPLE_METHODS; method++) {
+		for (h = 0; h < nr_hz; h++) {
+			if (sample_run(method, hzs[h], ipc_func, &res, &event))
+				break;
+			sample_report(sample_method_names[method], event, hzs[h],
+				      res.loops_per_sec, res.samples / res.secs, base, &res);
+			/* no point sweeping on, the row above is all of this one we got */
+			if (interrupted) {
+				fprintf(stderr, "%s at %lu hz is partial, %.1f of %d secs\n",
+					sample_method_names[method], hzs[h], res.secs, runtime);
+				journal_interrupted();
+			}
+		}
+	}
+}
+
+/*
+ * the synth numbers, fit per clock to a model of what each stamp costs:
+ *
+ * cycles/stamp = c0 + c1 * ipc + c2 * mpki + c3 * 1000 / insns between stamps
+ *
+ * ipc and insns describe the hot path, mpki is its last level cache
+ * misses per thousand instructions.  The fit is ordinary least squares
+ * over a grid of synth loops, and the covariance of the coefficients
+ * gives error bars for anything predicted from it.  advise reads the
+ * saved model back and answers for one hot path.
+ */
+#define MODEL_FEATURES 4
+#define MODEL_MAX_POINTS 64
+#define MODEL_MAX_CLOCKS 8
+
+static char *model_feature_names[] = { "", "ipc", "mpki", "kinsn^-1" };
+static double model_ipcs[] = { 0.25, 0.5, 1.0, 2.0, 3.0 };
+static int model_spacings[] = { 250, 1000, 4000 };
+
+/* model=FILE, where the fit is saved for advise */
+static char *model_file;
+
+struct model_point {
+	double ipc;
+	double mpki;
+	double insns;
+	double cycles;
+};
+
+struct model_fit {
+	char clock[32];
+	int n;
+	double sigma2;
+	double coef[MODEL_FEATURES];
+	double cov[MODEL_FEATURES][MODEL_FEATURES];
+};
+
+static void model_features(double ipc, double mpki, double insns, double *x)
+{
+	x[0] = 1;
+	x[1] = ipc;
+	x[2] = mpki;
+	x[3] = 1000 / insns;
+}
+
+/* inverts the n x n matrix a in place, returns -1 if it is singular */
+static int invert_matrix(double a[MODEL_FEATURES][MODEL_FEATURES], int n)
+{
+	double inv[MODEL_FEATURES][MODEL_FEATURES] = { { 0 } };
+	int i, j, k, pivot;
+
+	for (i = 0; i < n; i++)
+		inv[i][i] = 1;
+	for (i = 0; i < n; i++) {
+		pivot = i;
+		for (j = i + 1; j < n; j++) {
+			if (fabs(a[j][i]) > fabs(a[pivot][i]))
+				pivot = j;
+		}
+		if (fabs(a[pivot][i]) < 1e-12)
+			return -1;
+		for (k = 0; k < n; k++) {
+			double t = a[i][k];
+
+			a[i][k] = a[pivot][k];
+			a[pivot][k] = t;
+			t = inv[i][k];
+			inv[i][k] = inv[pivot][k];
+			inv[pivot][k] = t;
+		}
+		for (j = 0; j < n; j++) {
+			double f;
+
+			if (j == i)
+				continue;
+			f = a[j][i] / a[i][i];
+			for (k = 0; k < n; k++) {
+				a[j][k] -= f * a[i][k];
+				inv[j][k] -= f * inv[i][k];
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		double d = a[i][i];
+
+		for (k = 0; k < n; k++)
+			a[i][k] = inv[i][k] / d;
+	}
+	return 0;
+}
+
+/*
+ * least squares over the points.  A feature that doesn't vary in the
+ * grid (mpki when nothing missed the cache) can't be fit, so it is left
+ * out and its coefficient stays 0.
+ */
+static int model_fit_points(struct model_point *pts, int n, struct model_fit *fit)
+{
+	double xtx[MODEL_FEATURES][MODEL_FEATURES] = { { 0 } };
+	double xty[MODEL_FEATURES] = { 0 };
+	double x[MODEL_FEATURES], lo[MODEL_FEATURES], hi[MODEL_FEATURES];
+	int idx[MODEL_FEATURES];
+	double rss = 0;
+	int nr = 0;
+	int i, j, k;
+
+	for (j = 0; j < MODEL_FEATURES; j++) {
+		lo[j] = 1e300;
+		hi[j] = -1e300;
+	}
+	for (i = 0; i < n; i++) {
+		model_features(pts[i].ipc, pts[i].mpki, pts[i].insns, x);
+		for (j = 0; j < MODEL_FEATURES; j++) {
+			if (x[j] < lo[j])
+				lo[j] = x[j];
+			if (x[j] > hi[j])
+				hi[j] = x[j];
+		}
+	}
+	for (j = 0; j < MODEL_FEATURES; j++) {
+		if (j == 0 || hi[j] - lo[j] > 1e-3 * (fabs(hi[j]) + 1e-9))
+			idx[nr++] = j;
+	}
+	if (n <= nr)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		model_features(pts[i].ipc, pts[i].mpki, pts[i].insns, x);
+		for (j = 0; j < nr; j++) {
+			xty[j] += x[idx[j]] * pts[i].cycles;
+			for (k = 0; k < nr; k++)
+				xtx[j][k] += x[idx[j]] * x[idx[k]];
+		}
+	}
+	if (invert_matrix(xtx, nr))
+		return -1;
+
+	memset(fit->coef, 0, sizeof(fit->coef));
+	memset(fit->cov, 0, sizeof(fit->cov));
+	for (j = 0; j < nr; j++) {
+		for (k = 0; k < nr; k++)
+			fit->coef[idx[j]] += xtx[j][k] * xty[k];
+	}
+	for (i = 0; i < n; i++) {
+		double pred = 0;
+
+		model_features(pts[i].ipc, pts[i].mpki, pts[i].insns, x);
+		for (j = 0; j < MODEL_FEATURES; j++)
+			pred += fit->coef[j] * x[j];
+		rss += (pts[i].cycles - pred) * (pts[i].cycles - pred);
+	}
+	fit->n = n;
+	fit->sigma2 = rss / (n - nr);
+	for (j = 0; j < nr; j++) {
+		for (k = 0; k < nr; k++)
+			fit->cov[idx[j]][idx[k]] = fit->sigma2 * xtx[j][k];
+	}
+	return 0;
+}
+
+/* cycles per stamp and the standard error of a single new measurement */
+static double model_predict(struct model_fit *fit, double ipc, double mpki, double insns,
+			    double *err)
+{
+	double x[MODEL_FEATURES];
+	double pred = 0, var = fit->sigma2;
+	int j, k;
+
+	model_features(ipc, mpki, insns, x);
+	for (j = 0; j < MODEL_FEATURES; j++) {
+		pred += fit->coef[j] * x[j];
+		for (k = 0; k < MODEL_FEATURES; k++)
+			var += x[j] * fit->cov[j][k] * x[k];
+	}
+	*err = sqrt(var);
+	return pred;
+}
+
+/*
+ * misses per thousand instructions of the tuned loop, from perf when it
+ * counts cache misses.  Otherwise every load misses when the chase buffer
+ * is the DRAM sized one, and none do in the smaller ones.
+ */
+static double model_mpki(struct synth_mix *m, struct perf_counters *pc, int have_perf)
+{
+	struct synth_sample s;
+	struct jit j;
+	synth_func func;
+	unsigned long iters;
+	int bodies = synth_bodies(m);
+
+	if (have_perf && pc->fds[PERF_CACHE_MISSES] >= 0) {
+		func = synth_generate(m, bodies, 0, &j);
+		iters = synth_calibrate(func, 20);
+		synth_run(func, iters, pc, have_perf, &s);
+		synth_free(&j);
+		if (s.insns)
+			return (double)pc->values[PERF_CACHE_MISSES] * 1000 / s.insns;
+	}
+	if (synth_buf_entries != synth_levels[0])
+		return 0;
+	return (double)m->loads * 1000 / synth_body_insns(m);
+}
+
+static void model_print(struct model_fit *fit)
+{
+	int j;
+
+	fprintf(stderr, "%-14s cycles/stamp =", fit->clock);
+	for (j = 0; j < MODEL_FEATURES; j++)
+		fprintf(stderr, "%s %.2f (+-%.2f)%s%s", j ? " +" : "", fit->coef[j],
+			sqrt(fit->cov[j][j]), j ? " " : "", model_feature_names[j]);
+	fprintf(stderr, "  sigma %.2f n %d\n", sqrt(fit->sigma2), fit->n);
+}
+
+static void model_save(FILE *f, struct model_fit *fit)
+{
+	int j, k;
+
+	fprintf(f, "clock %s n %d sigma2 %g coef", fit->clock, fit->n, fit->sigma2);
+	for (j = 0; j < MODEL_FEATURES; j++)
+		fprintf(f, " %g", fit->coef[j]);
+	fprintf(f, " cov");
+	for (j = 0; j < MODEL_FEATURES; j++) {
+		for (k = 0; k < MODEL_FEATURES; k++)
+			fprintf(f, " %g", fit->cov[j][k]);
+	}
+	fprintf(f, "\n");
+}
+
+/*
+ * tunes the synth loop to every ipc and spacing in the grid once, then
+ * times each clock stamped into it
+ */
+void run_model(void)
+{
+	struct model_point pts[NR_CXX_C_VARIANTS][MODEL_MAX_POINTS];
+	struct model_fit fits[NR_CXX_C_VARIANTS];
+	struct perf_counters pc;
+	struct synth_mix m;
+	double ipc, mpki, overhead, cycles;
+	int nr_ipcs = sizeof(model_ipcs) / sizeof(model_ipcs[0]);
+	int nr_spacings = sizeof(model_spacings) / sizeof(model_spacings[0]);
+	int have_perf, n = 0;
+	int s, p, insns;
+	unsigned long c;
+	FILE *f = NULL;
+
+	if (model_file) {
+		f = fopen(model_file, "w");
+		if (!f) {
+			perror(model_file);
+			exit(1);
+		}
+		fprintf(f, "# tsc overhead model, cycles/stamp = c0 + c1 ipc + c2 mpki + "
+			"c3 1000/insns\nghz %.4f\n", tsc_ghz());
+	}
+	have_perf = perf_open(&pc) == 0;
+	if (!have_perf)
+		fprintf(stderr, "perf counters unavailable, IPC uses TSC cycles and mpki is estimated\n");
+
+	for (s = 0; s < nr_spacings; s++) {
+		stamp_every = model_spacings[s];
+		for (p = 0; p < nr_ipcs; p++) {
+			m = synth_mix;
+			ipc = synth_tune(&m, model_ipcs[p], &pc, have_perf);
+			mpki = model_mpki(&m, &pc, have_perf);
+			insns = synth_bodies(&m) * synth_body_insns(&m);
+			/* clock 0 is notsc, the loop without stamps */
+			for (c = 1; c < NR_CXX_C_VARIANTS; c++) {
+				run_mode = (run_mode & ~TSC_MODE_MASK) | cxx_c_variants[c].mode;
+				tsc_variant = cxx_c_variants[c].name;
+				overhead = synth_overhead(&m, &pc, have_perf, &ipc, &cycles,
+							  runtime * 20);
+				pts[c][n].ipc = ipc;
+				pts[c][n].mpki = mpki;
+				pts[c][n].insns = insns;
+				pts[c][n].cycles = cycles;
+				fprintf(stderr, "ipc %5.2f mpki %6.2f every %5d insns %-14s "
+					"%7.1f cycles/stamp overhead %6.2f%%\n", ipc, mpki,
+					insns, tsc_variant, cycles, overhead);
+				if (f)
+					fprintf(f, "# point %s ipc %.3f mpki %.3f insns %d cycles "
+						"%.2f\n", tsc_variant, ipc, mpki, insns, cycles);
+			}
+			n++;
+		}
+	}
+	if (have_perf)
+		perf_close(&pc);
+
+	for (c = 1; c < NR_CXX_C_VARIANTS; c++) {
+		snprintf(fits[c].clock, sizeof(fits[c].clock), "%s", cxx_c_variants[c].name);
+		if (model_fit_points(pts[c], n, &fits[c])) {
+			fprintf(stderr, "%s: not enough distinct points to fit\n", fits[c].clock);
+			continue;
+		}
+		model_print(&fits[c]);
+		if (f)
+			model_save(f, &fits[c]);
+	}
+	if (f) {
+		fclose(f);
+		fprintf(stderr, "model saved to %s, try tsc advise %s overhead=1 insns=2000 "
+			"ipc=1.5\n", model_file, model_file);
+	}
+}
+
+static int model_load(char *path, struct model_fit *fits, int max, double *ghz)
+{
+	char line[2048];
+	char *p, *end;
+	int nr = 0;
+	int j;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	*ghz = 0;
+	while (nr < max && fgets(line, sizeof(line), f)) {
+		struct model_fit *fit = &fits[nr];
+
+		if (sscanf(line, "ghz %lf", ghz) == 1)
+			continue;
+		if (sscanf(line, "clock %31s n %d sigma2 %lf", fit->clock, &fit->n,
+			   &fit->sigma2) != 3)
+			continue;
+		p = strstr(line, " coef ");
+		if (!p)
+			continue;
+		p += 6;
+		for (j = 0; j < MODEL_FEATURES; j++, p = end)
+			fit->coef[j] = strtod(p, &end);
+		p = strstr(p, " cov ");
+		if (!p)
+			continue;
+		p += 5;
+		for (j = 0; j < MODEL_FEATURES * MODEL_FEATURES; j++, p = end)
+			fit->cov[j / MODEL_FEATURES][j % MODEL_FEATURES] = strtod(p, &end);
+		nr++;
+	}
+	fclose(f);
+	if (!*ghz)
+		*ghz = tsc_ghz();
+	return nr;
+}
+
+/* what each clock guarantees, the cheapest one that fits the budget wins */
+static char *advise_clock_note(char *clock)
+{
+	if (strcmp(clock, "rdtsc") == 0)
+		return "cycles, can move past nearby instructions";
+	if (strcmp(clock, "rdtscp") == 0)
+		return "cycles, waits for earlier instructions";
+	if (strcmp(clock, "rdtsc_lfence") == 0)
+		return "cycles, fully ordered";
+	return "ns, portable";
+}
+
+/*
+ * advise MODEL overhead=PCT insns=N ipc=X [mpki=M]: predicts the cost of
+ * each clock on a hot path that stamps every N instructions, and how
+ * often it could stamp and stay under PCT percent.  The ranges are two
+ * standard errors of the prediction.
+ */
+void run_advise(char **args, int nr_args)
+{
+	struct model_fit fits[MODEL_MAX_CLOCKS];
+	double target = 1, insns = 0, ipc = 0, mpki = 0;
+	double ghz, cycles, err, work, hi;
+	char *path = NULL;
+	int best = -1;
+	int nr, i;
+
+	for (i = 0; i < nr_args; i++) {
+		if (strncmp(args[i], "overhead=", 9) == 0)
+			target = atof(args[i] + 9);
+		else if (strncmp(args[i], "insns=", 6) == 0)
+			insns = atof(args[i] + 6);
+		else if (strncmp(args[i], "ipc=", 4) == 0)
+			ipc = atof(args[i] + 4);
+		else if (strncmp(args[i], "mpki=", 5) == 0)
+			mpki = atof(args[i] + 5);
+		else
+			path = args[i];
+	}
+	if (!path || target <= 0 || insns <= 0 || ipc <= 0) {
+		fprintf(stderr, "usage: tsc advise MODEL overhead=PCT insns=N ipc=X [mpki=M]\n");
+		fprintf(stderr, "\tMODEL is written by tsc model=FILE\n");
+		exit(1);
+	}
+	nr = model_load(path, fits, MODEL_MAX_CLOCKS, &ghz);
+	if (!nr) {
+		fprintf(stderr, "no clocks in %s\n", path);
+		exit(1);
+	}
+
+	/* the hot path spends insns / ipc cycles between stamps */
+	work = insns / ipc;
+	fprintf(stderr, "hot path: stamp every %.0f insns at ipc %.2f mpki %.2f, %.0f cycles "
+		"apart, budget %.2f%%, tsc %.3f GHz\n", insns, ipc, mpki, work, target, ghz);
+	fprintf(stderr, "%-14s %17s %18s %16s %14s\n", "clock", "cycles/stamp", "overhead",
+		"max stamps/s", "min insns");
+	for (i = 0; i < nr; i++) {
+		cycles = model_predict(&fits[i], ipc, mpki, insns, &err);
+		hi = cycles + 2 * err;
+		if (hi <= 0)
+			hi = err;
+		fprintf(stderr, "%-14s %8.1f +- %6.1f %8.3f%% +- %5.3f %'16.0f %14.0f  %s\n",
+			fits[i].clock, cycles, 2 * err, cycles * 100 / work,
+			2 * err * 100 / work, target / 100 * ghz * 1e9 / hi,
+			hi * ipc * 100 / target, advise_clock_note(fits[i].clock));
+		if (hi * 100 / work <= target &&
+		    (best < 0 || cycles < model_predict(&fits[best], ipc, mpki, insns, &err)))
+			best = i;
+	}
+	if (best < 0) {
+		fprintf(stderr, "no clock stays under %.2f%% at this rate, stamp less often\n",
+			target);
+		return;
+	}
+	fprintf(stderr, "recommended: %s, it stays under %.2f%% even at the top of its "
+		"error bar\n", fits[best].clock, target);
+}
+
+/*
+ * low_ipc() waits on dependent loads and high_ipc() stays in the cache,
+ * scans over big arrays are limited by memory bandwidth instead.  These
+ * are the STREAM copy, scale, add and triad kernels with a read_tsc()
+ * every lines= cache lines, to see if the clock reads get in the way of
+ * the hardware prefetchers.
+ */
+#define STREAM_PASSES 10
+#define STREAM_DOUBLES_PER_LINE (64 / sizeof(double))
+
+enum stream_kernels {
+	STREAM_COPY,
+	STREAM_SCALE,
+	STREAM_ADD,
+	STREAM_TRIAD,
+	NR_STREAM_KERNELS,
+};
+
+static char *stream_kernel_names[] = { "copy", "scale", "add", "triad" };
+/* bytes moved per element, counted the way STREAM does */
+static int stream_kernel_bytes[] = { 16, 16, 24, 24 };
+
+/* stream_mb=N per array, lines=N between stamps */
+static unsigned long stream_mb = 256;
+static int stream_lines = 16;
+
+static double *stream_a, *stream_b, *stream_c;
+static unsigned long stream_elems;
+static pthread_barrier_t stream_barrier;
+
+struct stream_thread {
+	pthread_t thread;
+	unsigned long start;
+	unsigned long end;
+	unsigned long stamps;
+};
+
+static void stream_run_kernel(struct stream_thread *st, int kernel)
+{
+	unsigned long block = stream_lines * STREAM_DOUBLES_PER_LINE;
+	double *a = stream_a, *b = stream_b, *c = stream_c;
+	double scalar = 3.0;
+	unsigned long i, j, lim;
+	unsigned int aux;
+
+	for (i = st->start; i < st->end; i = lim) {
+		lim = i + block < st->end ? i + block : st->end;
+		switch (kernel) {
+		case STREAM_COPY:
+			for (j = i; j < lim; j++)
+				c[j] = a[j];
+			break;
+		case STREAM_SCALE:
+			for (j = i; j < lim; j++)
+				b[j] = scalar * c[j];
+			break;
+		case STREAM_ADD:
+			for (j = i; j < lim; j++)
+				c[j] = a[j] + b[j];
+			break;
+		case STREAM_TRIAD:
+			for (j = i; j < lim; j++)
+				a[j] = b[j] + scalar * c[j];
+			break;
+		}
+		read_tsc(&aux);
+		st->stamps++;
+	}
+}
+
+/*
+ * each thread touches its own slice first so the pages land on its
+ * node, then runs every pass of every kernel between two barriers
+ */
+void *stream_thread(void *arg)
+{
+	struct stream_thread *st = arg;
+	unsigned long i;
+	int k, p;
+
+	for (i = st->start; i < st->end; i++) {
+		stream_a[i] = 1.0;
+		stream_b[i] = 2.0;
+		stream_c[i] = 0.0;
+	}
+	for (k = 0; k < NR_STREAM_KERNELS; k++) {
+		for (p = 0; p < STREAM_PASSES; p++) {
+			pthread_barrier_wait(&stream_barrier);
+			stream_run_kernel(st, k);
+			pthread_barrier_wait(&stream_barrier);
+		}
+	}
+	return NULL;
+}
+
+/* best GB/s of each kernel over the passes, like STREAM reports */
+static void stream_measure(double *gbs, unsigned long *stamps)
+{
+	struct stream_thread *threads;
+	struct timespec t0, t1;
+	double secs, best;
+	int t, k, p, ret;
+
+	threads = calloc(bench_threads, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	pthread_barrier_init(&stream_barrier, NULL, bench_threads + 1);
+	for (t = 0; t < bench_threads; t++) {
+		/* slices are whole cache lines */
+		threads[t].start = stream_elems / bench_threads * t &
+			~(STREAM_DOUBLES_PER_LINE - 1);
+		threads[t].end = t == bench_threads - 1 ? stream_elems :
+			stream_elems / bench_threads * (t + 1) & ~(STREAM_DOUBLES_PER_LINE - 1);
+		ret = pthread_create(&threads[t].thread, NULL, stream_thread, &threads[t]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed: %d\n", ret);
+			exit(1);
+		}
+	}
+	for (k = 0; k < NR_STREAM_KERNELS; k++) {
+		best = 0;
+		for (p = 0; p < STREAM_PASSES; p++) {
+			pthread_barrier_wait(&stream_barrier);
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			pthread_barrier_wait(&stream_barrier);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+			if (secs > 0 && (!best || secs < best))
+				best = secs;
+		}
+		gbs[k] = best ? (double)stream_kernel_bytes[k] * stream_elems / best / 1e9 : 0;
+	}
+	*stamps = 0;
+	for (t = 0; t < bench_threads; t++) {
+		pthread_join(threads[t].thread, NULL);
+		*stamps += threads[t].stamps;
+	}
+	pthread_barrier_destroy(&stream_barrier);
+	free(threads);
+}
+
+static double *stream_alloc(unsigned long bytes)
+{
+	double *p;
+
+	p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	/* huge pages keep the TLB out of the bandwidth numbers */
+	madvise(p, bytes, MADV_HUGEPAGE);
+	return p;
+}
+
+void run_stream(void)
+{
+	double gbs[NR_CXX_C_VARIANTS][NR_STREAM_KERNELS];
+	unsigned long bytes = stream_mb << 20;
+	unsigned long stamps;
+	unsigned long i;
+	int k;
+
+	if (bench_threads < 1 || stream_lines < 1) {
+		fprintf(stderr, "threads and lines must be at least 1\n");
+		exit(1);
+	}
+	stream_elems = bytes / sizeof(double);
+	stream_a = stream_alloc(bytes);
+	stream_b = stream_alloc(bytes);
+	stream_c = stream_alloc(bytes);
+	fprintf(stderr, "stream: 3 arrays of %lu MB, %d threads, stamp every %d lines, "
+		"best of %d passes\n", stream_mb, bench_threads, stream_lines, STREAM_PASSES);
+
+	for (i = 0; i < NR_CXX_C_VARIANTS; i++) {
+		run_mode = (run_mode & ~TSC_MODE_MASK) | cxx_c_variants[i].mode;
+		tsc_variant = cxx_c_variants[i].name;
+		skip_rdtsc = cxx_c_variants[i].mode == MODE_NO_TSC;
+		stream_measure(gbs[i], &stamps);
+		fprintf(stderr, "%-14s", tsc_variant);
+		for (k = 0; k < NR_STREAM_KERNELS; k++)
+			fprintf(stderr, " %s %.2f GB/s", stream_kernel_names[k], gbs[i][k]);
+		fprintf(stderr, " stamps %'lu\n", stamps);
+	}
+	skip_rdtsc = 0;
+
+	fprintf(stderr, "%-14s", "clock");
+	for (k = 0; k < NR_STREAM_KERNELS; k++)
+		fprintf(stderr, " %9s GB/s ratio", stream_kernel_names[k]);
+	fprintf(stderr, "\n");
+	for (i = 0; i < NR_CXX_C_VARIANTS; i++) {
+		fprintf(stderr, "%-14s", cxx_c_variants[i].name);
+		for (k = 0; k < NR_STREAM_KERNELS; k++)
+			fprintf(stderr, " %14.2f %5.3f", gbs[i][k],
+				gbs[0][k] ? gbs[i][k] / gbs[0][k] : 0);
+		fprintf(stderr, "\n");
+	}
+	munmap(stream_a, bytes);
+	munmap(stream_b, bytes);
+	munmap(stream_c, bytes);
+}
+
+/*
+ * allocation profilers stamp malloc() calls, which is where clock reads
+ * most often show up in flame graphs.  Each thread keeps a ring of live
+ * blocks and replaces a random one on every op, with sizes from a mix
+ * that is mostly small objects.  stamp_pct= percent of the mallocs are
+ * timed with the clock into a per thread histogram.  malloc is whatever
+ * the dynamic linker found, so LD_PRELOAD jemalloc or tcmalloc to
+ * compare them.
+ */
+#define ALLOC_SLOTS 4096
+
+/* stamp_pct=X percent of allocations get timed */
+static double alloc_stamp_pct = 1;
+
+struct alloc_size_class {
+	int pct;
+	unsigned long min;
+	unsigned long max;
+};
+
+static struct alloc_size_class alloc_mix[] = {
+	{ 50, 8, 64 },
+	{ 25, 64, 256 },
+	{ 15, 256, 1024 },
+	{ 8, 1024, 8192 },
+	{ 2, 8192, 65536 },
+};
+
+#define NR_ALLOC_SIZE_CLASSES (sizeof(alloc_mix) / sizeof(alloc_mix[0]))
+
+struct alloc_thread {
+	pthread_t thread;
+	unsigned long seed;
+	/* stamp when the 32 bit random number is below this */
+	unsigned long threshold;
+	unsigned long allocs;
+	unsigned long stamped;
+	unsigned long hist[LAT_BUCKETS];
+};
+
+static inline unsigned long xorshift64(unsigned long *s)
+{
+	unsigned long x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*s = x;
+	return x;
+}
+
+static unsigned long alloc_size(unsigned long r)
+{
+	unsigned int pct = r % 100;
+	unsigned long i;
+
+	r >>= 8;
+	for (i = 0; i < NR_ALLOC_SIZE_CLASSES - 1; i++) {
+		if (pct < (unsigned int)alloc_mix[i].pct)
+			break;
+		pct -= alloc_mix[i].pct;
+	}
+	return alloc_mix[i].min + r % (alloc_mix[i].max - alloc_mix[i].min);
+}
+
+void *alloc_thread(void *arg)
+{
+	struct alloc_thread *at = arg;
+	char **slots;
+	unsigned long r, t0, t1;
+	unsigned int aux;
+	char *p;
+	int i;
+
+	slots = calloc(ALLOC_SLOTS, sizeof(*slots));
+	if (!slots) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	while (!stopping) {
+		for (i = 0; i < 1024; i++) {
+			r = xorshift64(&at->seed);
+			free(slots[r % ALLOC_SLOTS]);
+			if ((r >> 32) < at->threshold) {
+				t0 = read_tsc(&aux);
+				p = malloc(alloc_size(r >> 12));
+				t1 = read_tsc(&aux);
+				at->hist[lat_bucket(t1 - t0)]++;
+				at->stamped++;
+			} else {
+				p = malloc(alloc_size(r >> 12));
+			}
+			if (!p) {
+				fprintf(stderr, "malloc failed\n");
+				exit(1);
+			}
+			/* touch it, like the caller would */
+			*p = 0;
+			slots[r % ALLOC_SLOTS] = p;
+		}
+		at->allocs += 1024;
+	}
+	for (i = 0; i < ALLOC_SLOTS; i++)
+		free(slots[i]);
+	free(slots);
+	return NULL;
+}
+
+/* the allocator behind malloc(), from its symbols and the object it is in */
+static void alloc_describe(char *buf, int len)
+{
+	Dl_info info;
+	char *name = "glibc";
+	char *path = "?";
+
+	if (dlsym(RTLD_DEFAULT, "mallctl"))
+		name = "jemalloc";
+	else if (dlsym(RTLD_DEFAULT, "tc_malloc"))
+		name = "tcmalloc";
+	else if (dlsym(RTLD_DEFAULT, "mi_malloc"))
+		name = "mimalloc";
+	if (dladdr((void *)malloc, &info) && info.dli_fname)
+		path = (char *)info.dli_fname;
+	snprintf(buf, len, "%s (%s)", name, path);
+}
+
+static void alloc_measure(double pct, unsigned long *allocs_per_sec, unsigned long *stamped,
+			  unsigned long *hist)
+{
+	struct alloc_thread *threads;
+	struct timeval start, now;
+	unsigned long allocs = 0;
+	int t, b, ret;
+
+	threads = calloc(bench_threads, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	stopping = 0;
+	gettimeofday(&start, NULL);
+	for (t = 0; t < bench_threads; t++) {
+		threads[t].seed = 0x9e3779b97f4a7c15UL * (t + 1);
+		threads[t].threshold = pct / 100 * 4294967296.0;
+		ret = pthread_create(&threads[t].thread, NULL, alloc_thread, &threads[t]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed: %d\n", ret);
+			exit(1);
+		}
+	}
+	sleep(runtime);
+	stopping = 1;
+	memset(hist, 0, LAT_BUCKETS * sizeof(*hist));
+	*stamped = 0;
+	for (t = 0; t < bench_threads; t++) {
+		pthread_join(threads[t].thread, NULL);
+		allocs += threads[t].allocs;
+		*stamped += threads[t].stamped;
+		for (b = 0; b < LAT_BUCKETS; b++)
+			hist[b] += threads[t].hist[b];
+	}
+	gettimeofday(&now, NULL);
+	*allocs_per_sec = allocs * USEC_PER_SEC / tvdelta(&start, &now);
+	free(threads);
+}
+
+static void alloc_report(char *name, unsigned long allocs_per_sec, unsigned long base,
+			 unsigned long stamped, unsigned long *hist, double ns_per_unit)
+{
+	fprintf(stderr, "%-14s %'14lu %7.2f%% %'12lu", name, allocs_per_sec,
+		base ? (1 - (double)allocs_per_sec / base) * 100 : 0, stamped);
+	if (stamped && ns_per_unit > 0)
+		fprintf(stderr, "   p50 %5.0f p99 %6.0f p99.9 %7.0f ns",
+			lat_percentile(hist, stamped, 50) * ns_per_unit,
+			lat_percentile(hist, stamped, 99) * ns_per_unit,
+			lat_percentile(hist, stamped, 99.9) * ns_per_unit);
+	fprintf(stderr, "\n");
+}
+
+void run_alloc(void)
+{
+	unsigned long hist[LAT_BUCKETS];
+	unsigned long base, allocs_per_sec, stamped;
+	char allocator[PATH_MAX + 32];
+	double ns_per_unit;
+	unsigned long i;
+
+	if (bench_threads < 1 || alloc_stamp_pct < 0 || alloc_stamp_pct > 100) {
+		fprintf(stderr, "threads must be at least 1 and stamp_pct between 0 and 100\n");
+		exit(1);
+	}
+	alloc_describe(allocator, sizeof(allocator));
+	fprintf(stderr, "malloc from %s, %d threads, %.2f%% of allocations stamped\n",
+		allocator, bench_threads, alloc_stamp_pct);
+
+	/* no stamping at all, the baseline */
+	alloc_measure(0, &base, &stamped, hist);
+	fprintf(stderr, "%-14s %14s %8s %12s\n", "clock", "allocs/s", "slower", "stamped");
+	alloc_report("off", base, base, 0, hist, 0);
+
+	/* notsc times nothing, but pays for the coin flip and the histogram */
+	for (i = 0; i < NR_CXX_C_VARIANTS; i++) {
+		run_mode = (run_mode & ~TSC_MODE_MASK) | cxx_c_variants[i].mode;
+		tsc_variant = cxx_c_variants[i].name;
+		skip_rdtsc = cxx_c_variants[i].mode == MODE_NO_TSC;
+		alloc_measure(alloc_stamp_pct, &allocs_per_sec, &stamped, hist);
+		if (skip_rdtsc)
+			ns_per_unit = 0;
+		else if (run_mode & MODE_GETTIME)
+			ns_per_unit = 1;
+		else
+			ns_per_unit = 1 / tsc_ghz();
+		alloc_report(tsc_variant, allocs_per_sec, base, stamped, hist, ns_per_unit);
+	}
+	skip_rdtsc = 0;
+}
+
+/*
+ * cmp runs the two copies of the loop one after the other, so anything
+ * the package does in between (frequency, turbo budget, temperature)
+ * ends up in the ratio.  twin runs them at the same time on two cores of
+ * one package, compares them over the same short intervals and swaps the
+ * cores every second so neither copy keeps the faster core.
+ */
+#define TWIN_INTERVAL_MS 250
+#define TWIN_SWAP_INTERVALS 4
+
+struct twin_thread {
+	pthread_t thread;
+	int skip;
+	/* where the twin starts, -1 with a single cpu */
+	int cpu;
+	unsigned long loops;
+	/*
+	 * each twin writes to its own copy of the matrix, so they don't
+	 * share lines and neither gets the better pages
+	 */
+	void *matrix;
+	unsigned long bytes;
+};
+
+/* the twins start together once both have their copy of the matrix */
+static pthread_barrier_t twin_barrier;
+
+static inline __attribute__((always_inline)) void
+twin_loop(struct twin_thread *tt, unsigned long *loops, read_func read)
+{
+	if (run_mode & MODE_HIGH_IPC) {
+		if (compact_matrix)
+			high_ipc_compact(tt->matrix, loops, read);
+		else
+			high_ipc(tt->matrix, loops, read);
+	} else {
+		if (compact_matrix)
+			low_ipc_compact(tt->matrix, loops, read);
+		else
+			low_ipc(tt->matrix, loops, read);
+	}
+}
+
+void *twin_ipc_thread(void *arg)
+{
+	struct twin_thread *tt = arg;
+	void *src = compact_matrix ? (void *)global_matrix32 : (void *)global_matrix;
+	unsigned long loops;
+
+	/* first touch from the starting cpu, the same way for both twins */
+	if (tt->cpu >= 0)
+		pin_to_cpu(tt->cpu);
+	tt->matrix = mmap(NULL, tt->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+	if (tt->matrix == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	madvise(tt->matrix, tt->bytes, MADV_HUGEPAGE);
+	memcpy(tt->matrix, src, tt->bytes);
+	pthread_barrier_wait(&twin_barrier);
+
+	while (!stopping) {
+		loops = 0;
+		/* both get a direct call, the unstamped one to read_none() */
+		if (tt->skip)
+			twin_loop(tt, &loops, read_none);
+		else
+			twin_loop(tt, &loops, read_tsc);
+		__atomic_add_fetch(&tt->loops, loops, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static int cpu_topology(int cpu, char *what)
+{
+	char path[128], buf[32];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+	if (read_sysfs(path, buf, sizeof(buf)))
+		return -1;
+	return atoi(buf);
+}
+
+/*
+ * two allowed cpus in the same package on different cores, so they
+ * don't share a core's execution units.  Falls back to SMT siblings and
+ * then to any two cpus.  Returns -1 with only one cpu.
+ */
+static int twin_cpus(int *a, int *b)
+{
+	cpu_set_t set;
+	int pass, i, j;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+	for (pass = 0; pass < 3; pass++) {
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (!CPU_ISSET(i, &set))
+				continue;
+			for (j = i + 1; j < CPU_SETSIZE; j++) {
+				if (!CPU_ISSET(j, &set))
+					continue;
+				if (pass < 2 && cpu_topology(i, "physical_package_id") !=
+				    cpu_topology(j, "physical_package_id"))
+					continue;
+				if (pass < 1 && (cpu_topology(i, "core_id") ==
+						 cpu_topology(j, "core_id")))
+					continue;
+				*a = i;
+				*b = j;
+				return pass;
+			}
+		}
+	}
+	return -1;
+}
+
+static void twin_pin(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+void run_twin(void)
+{
+	struct twin_thread tt[2] = { { .skip = 0 }, { .skip = 1 } };
+	static char *pair_names[] = { "same package, different cores",
+		"SMT siblings", "different packages" };
+	unsigned long prev[2], now[2], sum[2][2] = { { 0 } };
+	double *ratios, bias[2] = { 0 }, mean = 0, var = 0;
+	int nr_bias[2] = { 0 };
+	int nr_intervals = runtime * 1000 / TWIN_INTERVAL_MS;
+	int cpus[2] = { -1, -1 };
+	unsigned long bytes;
+	int nr = 0, side = 0;
+	int pair, i, t, ret;
+
+	if (nr_intervals < 2 * TWIN_SWAP_INTERVALS)
+		nr_intervals = 2 * TWIN_SWAP_INTERVALS;
+	ratios = calloc(nr_intervals, sizeof(*ratios));
+	if (!ratios) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	pair = twin_cpus(&cpus[0], &cpus[1]);
+	if (pair < 0)
+		fprintf(stderr, "only one cpu, the twins share it and nothing is swapped\n");
+	else
+		fprintf(stderr, "twins on cpus %d and %d (%s), swapped every %d ms\n", cpus[0],
+			cpus[1], pair_names[pair], TWIN_INTERVAL_MS * TWIN_SWAP_INTERVALS);
+
+	/* high_ipc only uses the three small matrices at the start */
+	bytes = matrix_entry_size() * ((run_mode & MODE_HIGH_IPC) ?
+		3 * high_ipc_matrix * high_ipc_matrix : matrix_size);
+
+	stopping = 0;
+	pthread_barrier_init(&twin_barrier, NULL, 3);
+	for (t = 0; t < 2; t++) {
+		tt[t].cpu = cpus[t];
+		tt[t].bytes = bytes;
+		ret = pthread_create(&tt[t].thread, NULL, twin_ipc_thread, &tt[t]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed: %d\n", ret);
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&twin_barrier);
+
+	for (t = 0; t < 2; t++)
+		prev[t] = __atomic_load_n(&tt[t].loops, __ATOMIC_RELAXED);
+	for (i = 0; i < nr_intervals; i++) {
+		usleep(TWIN_INTERVAL_MS * 1000);
+		for (t = 0; t < 2; t++)
+			now[t] = __atomic_load_n(&tt[t].loops, __ATOMIC_RELAXED);
+
+		/* the interval after a swap has the migration in it, skip it */
+		if (i % TWIN_SWAP_INTERVALS && now[1] > prev[1]) {
+			ratios[nr++] = (double)(now[0] - prev[0]) / (now[1] - prev[1]);
+			bias[side] += ratios[nr - 1];
+			nr_bias[side]++;
+			for (t = 0; t < 2; t++)
+				sum[side][t] += now[t] - prev[t];
+		}
+		if (pair >= 0 && (i + 1) % TWIN_SWAP_INTERVALS == 0) {
+			side = !side;
+			twin_pin(tt[0].thread, cpus[side]);
+			twin_pin(tt[1].thread, cpus[!side]);
+		}
+		prev[0] = now[0];
+		prev[1] = now[1];
+	}
+	stopping = 1;
+	for (t = 0; t < 2; t++)
+		pthread_join(tt[t].thread, NULL);
+	pthread_barrier_destroy(&twin_barrier);
+	for (t = 0; t < 2; t++)
+		munmap(tt[t].matrix, bytes);
+
+	if (!nr) {
+		fprintf(stderr, "no intervals to compare\n");
+		exit(1);
+	}
+	for (i = 0; i < nr; i++)
+		mean += ratios[i];
+	mean /= nr;
+	for (i = 0; i < nr; i++)
+		var += (ratios[i] - mean) * (ratios[i] - mean);
+	var = nr > 1 ? var / (nr - 1) : 0;
+	qsort(ratios, nr, sizeof(*ratios), cmp_double);
+
+	fprintf(stderr, "%s IPC (%s) loops/s %'lu\n", (run_mode & MODE_HIGH_IPC) ? "High" : "low",
+		tsc_variant, (sum[0][0] + sum[1][0]) * 1000 / (nr * TWIN_INTERVAL_MS));
+	fprintf(stderr, "%s IPC (no %s) loops/s %'lu\n", (run_mode & MODE_HIGH_IPC) ? "High" : "low",
+		tsc_variant, (sum[0][1] + sum[1][1]) * 1000 / (nr * TWIN_INTERVAL_MS));
+	fprintf(stderr, "interval ratios over %d x %d ms: median %.3f mean %.3f +- %.3f (95%%) "
+		"min %.3f max %.3f\n", nr, TWIN_INTERVAL_MS, ratios[nr / 2], mean,
+		1.96 * sqrt(var / nr), ratios[0], ratios[nr - 1]);
+	if (pair >= 0 && nr_bias[0] && nr_bias[1])
+		fprintf(stderr, "stamped twin on cpu %d: %.3f, on cpu %d: %.3f\n", cpus[0],
+			bias[0] / nr_bias[0], cpus[1], bias[1] / nr_bias[1]);
+	fprintf(stderr, "ratio %.2f\n", (double)(sum[0][0] + sum[1][0]) / (sum[0][1] + sum[1][1]));
+	free(ratios);
+}
+
+/*
+ * CLOCK_MONOTONIC and CLOCK_REALTIME follow NTP's frequency corrections,
+ * slews and steps, CLOCK_MONOTONIC_RAW and the TSC don't.  This times
+ * every clock_gettime(CLOCK_MONOTONIC) in short windows and tracks how
+ * far MONOTONIC and REALTIME drift from MONOTONIC_RAW in each one.  With
+ * ntp_adjust (root, on a disposable VM) it applies frequency offsets,
+ * steps and a slew with adjtimex() between windows and puts everything
+ * back at the end.  Otherwise it just watches what ntpd or chrony do.
+ */
+#define NTP_WINDOW_MS 500
+#define NTP_CHECK_EVERY 1024
+/* four clock reads, anything slower was interrupted */
+#define NTP_CHECK_MAX_NS 2000
+#define NTP_FREQ_PPM 100
+#define NTP_STEP_NS 10000000L
+#define NTP_SLEW_US 5000
+
+/* ntp_adjust, apply adjustments instead of only watching */
+static int ntp_adjust;
+/* what we did to REALTIME so far, so an interrupted run can put it back */
+static long ntp_offset_ns;
+static long ntp_slewing_us;
+
+struct ntp_window {
+	unsigned long reads;
+	unsigned long hist[LAT_BUCKETS];
+	double secs;
+	/* drift from MONOTONIC_RAW over the window, in ppm */
+	double mono_ppm;
+	double real_ppm;
+	/* biggest jump of REALTIME - RAW between two checks */
+	long real_jump_ns;
+};
+
+static inline long ts_ns(struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+typedef int (*ntp_event_func)(long arg);
+
+/*
+ * one window of timed reads, with the adjustment (if any) made halfway
+ * through so the reads around it are in the window
+ */
+static void ntp_measure(struct ntp_window *w, ntp_event_func event, long arg)
+{
+	struct timespec raw, raw2, mono, real, ts;
+	long raw0 = 0, mono0 = 0, real0 = 0, prev_off = 0, off;
+	long start, now, mid = 0;
+	unsigned long c0, c1;
+	unsigned int aux;
+	int i;
+
+	memset(w, 0, sizeof(*w));
+	clock_gettime(CLOCK_MONOTONIC_RAW, &raw);
+	start = ts_ns(&raw);
+	do {
+		for (i = 0; i < NTP_CHECK_EVERY; i++) {
+			c0 = rdtscp(&aux);
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			c1 = rdtscp(&aux);
+			w->hist[lat_bucket(c1 - c0)]++;
+		}
+		w->reads += NTP_CHECK_EVERY;
+
+		/*
+		 * RAW on both sides of the others, checks where we were
+		 * preempted in the middle would look like steps
+		 */
+		clock_gettime(CLOCK_MONOTONIC_RAW, &raw);
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		clock_gettime(CLOCK_REALTIME, &real);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &raw2);
+		now = ts_ns(&raw2);
+		if (now - ts_ns(&raw) < NTP_CHECK_MAX_NS) {
+			mid = (ts_ns(&raw) + now) / 2;
+			off = ts_ns(&real) - mid;
+			if (!raw0) {
+				raw0 = mid;
+				mono0 = ts_ns(&mono);
+				real0 = ts_ns(&real);
+			} else if (labs(off - prev_off) > labs(w->real_jump_ns)) {
+				w->real_jump_ns = off - prev_off;
+			}
+			prev_off = off;
+			w->mono_ppm = ((double)(ts_ns(&mono) - mono0) / (mid - raw0) - 1) * 1e6;
+			w->real_ppm = ((double)(ts_ns(&real) - real0 - w->real_jump_ns) /
+				       (mid - raw0) - 1) * 1e6;
+		}
+		if (event && now - start >= NTP_WINDOW_MS * 500000L) {
+			if (event(arg))
+				fprintf(stderr, "adjtimex: %s\n", strerror(errno));
+			event = NULL;
+		}
+	} while (now - start < NTP_WINDOW_MS * 1000000L && !interrupted);
+	w->secs = (now - start) / 1e9;
+}
+
+static void ntp_report(char *label, struct ntp_window *w)
+{
+	double ns = 1 / tsc_ghz();
+	unsigned long median = lat_percentile(w->hist, w->reads, 50);
+	unsigned long slow = 0;
+	int b;
+
+	/* the seqlock retries show up as reads over twice the median */
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		if (lat_bucket_start(b) > 2 * median)
+			slow += w->hist[b];
+	}
+	fprintf(stderr, "%-16s reads/s %'11.0f p50 %5.0f p99 %6.0f p99.9 %7.0f ns slow %7.4f%% "
+		"mono %+9.2f ppm real %+9.2f ppm", label, w->reads / w->secs, median * ns,
+		lat_percentile(w->hist, w->reads, 99) * ns,
+		lat_percentile(w->hist, w->reads, 99.9) * ns, slow * 100.0 / w->reads,
+		w->mono_ppm, w->real_ppm);
+	if (labs(w->real_jump_ns) > 1000)
+		fprintf(stderr, " real step %+.3f ms", w->real_jump_ns / 1e6);
+	fprintf(stderr, "\n");
+}
+
+static void ntp_print_state(char *when)
+{
+	struct timex tx;
+	int state;
+
+	memset(&tx, 0, sizeof(tx));
+	state = adjtimex(&tx);
+	fprintf(stderr, "%s: %s freq %+.3f ppm offset %ld tick %ld status 0x%x%s\n", when,
+		state == TIME_ERROR ? "unsynchronized" : "synchronized",
+		tx.freq / 65536.0, tx.offset, tx.tick, tx.status,
+		(tx.status & STA_NANO) ? " (ns offsets)" : "");
+}
+
+static int ntp_set_freq(long freq)
+{
+	struct timex tx;
+
+	memset(&tx, 0, sizeof(tx));
+	tx.modes = ADJ_FREQUENCY;
+	tx.freq = freq;
+	return adjtimex(&tx) < 0 ? -1 : 0;
+}
+
+static int ntp_step(long ns)
+{
+	struct timex tx;
+
+	memset(&tx, 0, sizeof(tx));
+	tx.modes = ADJ_SETOFFSET | ADJ_NANO;
+	tx.time.tv_sec = ns / 1000000000L;
+	tx.time.tv_usec = ns % 1000000000L;
+	/* the kernel wants a positive nanosecond field */
+	if (tx.time.tv_usec < 0) {
+		tx.time.tv_sec--;
+		tx.time.tv_usec += 1000000000L;
+	}
+	if (adjtimex(&tx) < 0)
+		return -1;
+	ntp_offset_ns += ns;
+	return 0;
+}
+
+/* old style adjtime() slew, the kernel spreads it out at 500 ppm */
+static int ntp_slew(long usecs, long *left)
+{
+	struct timeval delta = { 0, usecs }, old;
+
+	if (adjtime(&delta, &old))
+		return -1;
+	if (left)
+		*left = old.tv_sec * 1000000L + old.tv_usec;
+	return 0;
+}
+
+static void ntp_passive(void)
+{
+	struct ntp_window w;
+	double prev = 0;
+	char label[32];
+	int nr = runtime * 1000 / NTP_WINDOW_MS;
+	int i;
+
+	if (nr < 1)
+		nr = 1;
+	for (i = 0; i < nr && !interrupted; i++) {
+		ntp_measure(&w, NULL, 0);
+		/* a change in the slew rate means the daemon adjusted us */
+		snprintf(label, sizeof(label), "window %d%s", i,
+			 i && fabs(w.mono_ppm - prev) > 0.5 ? " ADJ" : "");
+		ntp_report(label, &w);
+		prev = w.mono_ppm;
+	}
+}
+
+static int ntp_slew_start(long usecs)
+{
+	if (ntp_slew(usecs, NULL))
+		return -1;
+	ntp_slewing_us = usecs;
+	return 0;
+}
+
+/* stops the slew, the part it already did is added to ntp_offset_ns */
+static int ntp_slew_stop(void)
+{
+	long left;
+
+	if (!ntp_slewing_us)
+		return 0;
+	if (ntp_slew(0, &left))
+		return -1;
+	ntp_offset_ns += (ntp_slewing_us - left) * 1000L;
+	ntp_slewing_us = 0;
+	return 0;
+}
+
+/* stops the slew and steps back whatever it already did */
+static int ntp_slew_undo(void)
+{
+	long before = ntp_offset_ns;
+
+	if (ntp_slew_stop())
+		return -1;
+	return ntp_step(before - ntp_offset_ns);
+}
+
+/*
+ * puts the frequency back, stops a slew and undoes every step and slew
+ * we made, for runs that were interrupted between an adjustment and
+ * the event that undoes it
+ */
+static void ntp_restore(long orig_freq)
+{
+	long offset;
+
+	ntp_set_freq(orig_freq);
+	ntp_slew_stop();
+	offset = ntp_offset_ns;
+	if (!offset)
+		return;
+	if (ntp_step(-offset))
+		fprintf(stderr, "adjtimex: %s, REALTIME is still off by %+.3f ms\n",
+			strerror(errno), offset / 1e6);
+	else
+		fprintf(stderr, "stepped REALTIME back by %+.3f ms\n", -offset / 1e6);
+}
+
+struct ntp_event {
+	char *label;
+	ntp_event_func func;
+	long arg;
+};
+
+/* ntp_slew_undo() as an event, which always gets an argument */
+static int ntp_slew_undo_event(long unused)
+{
+	(void)unused;
+	return ntp_slew_undo();
+}
+
+/*
+ * each adjustment gets the window it happens in and the one after it,
+ * where things have settled
+ */
+static void ntp_active(long orig_freq)
+{
+	struct ntp_event events[] = {
+		{ "freq +100ppm", ntp_set_freq, orig_freq + (NTP_FREQ_PPM << 16) },
+		{ "freq -100ppm", ntp_set_freq, orig_freq - (NTP_FREQ_PPM << 16) },
+		{ "freq restored", ntp_set_freq, orig_freq },
+		{ "step +10ms", ntp_step, NTP_STEP_NS },
+		{ "step -10ms", ntp_step, -NTP_STEP_NS },
+		{ "slew +5ms", ntp_slew_start, NTP_SLEW_US },
+		{ "slew undone", ntp_slew_undo_event, 0 },
+	};
+	struct ntp_window w;
+	unsigned long i;
+
+	ntp_measure(&w, NULL, 0);
+	ntp_report("baseline", &w);
+	for (i = 0; i < sizeof(events) / sizeof(events[0]) && !interrupted; i++) {
+		ntp_measure(&w, events[i].func, events[i].arg);
+		ntp_report(events[i].label, &w);
+		ntp_measure(&w, NULL, 0);
+		ntp_report("  after", &w);
+	}
+}
+
+void run_ntp(void)
+{
+	struct timex tx;
+	int privileged = 0;
+
+	memset(&tx, 0, sizeof(tx));
+	if (adjtimex(&tx) < 0) {
+		perror("adjtimex");
+		exit(1);
+	}
+	ntp_print_state("before");
+
+	/* writing back the frequency we have changes nothing, but needs CAP_SYS_TIME */
+	if (ntp_adjust) {
+		privileged = ntp_set_freq(tx.freq) == 0;
+		if (!privileged)
+			fprintf(stderr, "adjtimex: %s, watching passively instead\n",
+				strerror(errno));
+		else if (!(tx.status & STA_UNSYNC) || tx.offset)
+			fprintf(stderr, "warning: an NTP daemon looks active, it will fight "
+				"the adjustments\n");
+	}
+	if (privileged) {
+		ntp_active(tx.freq);
+		/* in case we were interrupted halfway */
+		ntp_restore(tx.freq);
+		/* ADJ_NANO sticks, put the offset units back too */
+		if (!(tx.status & STA_NANO)) {
+			tx.modes = ADJ_MICRO;
+			adjtimex(&tx);
+		}
+	} else {
+		ntp_passive();
+	}
+	ntp_print_state("after");
+	if (interrupted)
+		journal_interrupted();
+}
+
+/*
+ * the first clock read in a request often comes right after a wakeup,
+ * with the vDSO code, the vvar page and their TLB entries cold.  This
+ * times single reads after a sleep (idle_us= deep), after a migration to
+ * another core and after walking a thrash_mb= buffer that pushes
+ * everything out of the caches and the TLB, next to back to back warm
+ * reads.  The clocks take turns trial by trial so they all see the same
+ * conditions.  notsc is the cost of calling read_tsc() and the two
+ * rdtscp around it, the floor for the others.
+ */
+#define COLD_WARM_TRIALS 1000
+#define COLD_MAX_TRIALS 1000
+#define COLD_THRASH_TRIALS 30
+#define COLD_MAX_IDLE_STATES 16
+
+/* idle_us=N, a single sleep depth instead of the sweep */
+static long cold_idle_us;
+/* thrash_mb=N, the eviction buffer */
+static unsigned long cold_thrash_mb = 64;
+
+static unsigned long cold_samples[NR_CXX_C_VARIANTS][COLD_MAX_TRIALS];
+static int cold_nr[NR_CXX_C_VARIANTS];
+/* warm p50 of each clock, the reference for the other rows */
+static unsigned long cold_warm[NR_CXX_C_VARIANTS];
+
+static int cold_cpus[2];
+static int cold_on;
+static unsigned long cold_wrong_cpu;
+static volatile unsigned char *cold_buf;
+
+typedef void (*cold_prep_func)(long arg);
+
+static inline unsigned long cold_stamp(unsigned int *aux)
+{
+	unsigned long c0, c1;
+
+	c0 = rdtscp(aux);
+	read_tsc(aux);
+	c1 = rdtscp(aux);
+	return c1 - c0;
+}
+
+static void cold_prep_warm(long arg)
+{
+	unsigned int aux;
+	int i;
+
+	(void)arg;
+	for (i = 0; i < 16; i++)
+		cold_stamp(&aux);
+}
+
+static void cold_prep_idle(long us)
+{
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+	clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+/* sched_setaffinity() returns on the new cpu */
+static void cold_prep_migrate(long arg)
+{
+	(void)arg;
+	cold_on = !cold_on;
+	pin_to_cpu(cold_cpus[cold_on]);
+}
+
+/* writes every line so the dirty lines have to go too, one TLB miss per page */
+static void cold_prep_thrash(long bytes)
+{
+	long i;
+
+	for (i = 0; i < bytes; i += 64)
+		cold_buf[i]++;
+}
+
+/* usage counts of each cpuidle state on 'cpu', returns how many states */
+static int cold_idle_usage(int cpu, unsigned long *usage, char names[][16])
+{
+	char path[128];
+	char buf[64];
+	int i;
+
+	for (i = 0; i < COLD_MAX_IDLE_STATES; i++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/usage", cpu, i);
+		if (read_sysfs(path, buf, sizeof(buf)))
+			break;
+		usage[i] = strtoul(buf, NULL, 10);
+		if (names) {
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/name", cpu, i);
+			if (read_sysfs(path, buf, sizeof(buf)))
+				snprintf(buf, sizeof(buf), "state%d", i);
+			buf[strcspn(buf, "\n")] = '\0';
+			snprintf(names[i], 16, "%.15s", buf);
+		}
+	}
+	return i;
+}
+
+/* 'trials' first reads with every clock, each one after prep(arg) */
+static void cold_run(cold_prep_func prep, long arg, int trials)
+{
+	unsigned int aux;
+	unsigned long i;
+	int t;
+
+	memset(cold_nr, 0, sizeof(cold_nr));
+	for (t = 0; t < trials && !interrupted; t++) {
+		for (i = 0; i < NR_CXX_C_VARIANTS; i++) {
+			run_mode = (run_mode & ~TSC_MODE_MASK) | cxx_c_variants[i].mode;
+			skip_rdtsc = cxx_c_variants[i].mode == MODE_NO_TSC;
+			prep(arg);
+			cold_samples[i][cold_nr[i]++] = cold_stamp(&aux);
+			if (prep == cold_prep_migrate && (int)(aux & 0xfff) != cold_cpus[cold_on])
+				cold_wrong_cpu++;
+		}
+	}
+	skip_rdtsc = 0;
+}
+
+static void cold_report(char *label)
+{
+	double ns = 1 / tsc_ghz();
+	unsigned long i, p50;
+	int nr;
+
+	fprintf(stderr, "%s, %d trials\n", label, cold_nr[0]);
+	for (i = 0; i < NR_CXX_C_VARIANTS; i++) {
+		nr = cold_nr[i];
+		if (!nr)
+			continue;
+		qsort(cold_samples[i], nr, sizeof(unsigned long), cmp_ulong);
+		p50 = cold_samples[i][nr / 2];
+		if (!cold_warm[i])
+			cold_warm[i] = p50;
+		fprintf(stderr, "  %-14s p50 %7.0f p90 %7.0f p99 %7.0f max %8.0f ns %6.1fx warm\n",
+			cxx_c_variants[i].name, p50 * ns, cold_samples[i][nr * 90 / 100] * ns,
+			cold_samples[i][nr * 99 / 100] * ns, cold_samples[i][nr - 1] * ns,
+			(double)p50 / cold_warm[i]);
+	}
+}
+
+static void cold_idle(long us)
+{
+	char names[COLD_MAX_IDLE_STATES][16];
+	unsigned long before[COLD_MAX_IDLE_STATES];
+	unsigned long after[COLD_MAX_IDLE_STATES];
+	unsigned long total = 0;
+	char label[64];
+	int trials, states, i;
+
+	/* about a second of sleeping for each depth */
+	trials = 1000000 / us / NR_CXX_C_VARIANTS;
+	if (trials > COLD_MAX_TRIALS)
+		trials = COLD_MAX_TRIALS;
+	if (trials < 10)
+		trials = 10;
+
+	states = cold_idle_usage(cold_cpus[0], before, names);
+	cold_run(cold_prep_idle, us, trials);
+	snprintf(label, sizeof(label), "after %ld us idle", us);
+	cold_report(label);
+
+	if (states && cold_idle_usage(cold_cpus[0], after, NULL) == states) {
+		for (i = 0; i < states; i++)
+			total += after[i] - before[i];
+		if (!total)
+			return;
+		fprintf(stderr, "  cpuidle");
+		for (i = 0; i < states; i++) {
+			if (after[i] != before[i])
+				fprintf(stderr, " %s %.0f%%", names[i],
+					(after[i] - before[i]) * 100.0 / total);
+		}
+		fprintf(stderr, "\n");
+	}
+}
+
+void run_cold(void)
+{
+	static long idle_sweep[] = { 50, 1000, 20000 };
+	unsigned long bytes = cold_thrash_mb << 20;
+	cpu_set_t orig;
+	unsigned long i;
+	int pair;
+
+	if (sched_getaffinity(0, sizeof(orig), &orig)) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+	pair = twin_cpus(&cold_cpus[0], &cold_cpus[1]);
+	if (pair < 0)
+		cold_cpus[0] = sched_getcpu();
+	pin_to_cpu(cold_cpus[0]);
+	fprintf(stderr, "cpu %d, tsc %.3f GHz\n", cold_cpus[0], tsc_ghz());
+
+	cold_buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (cold_buf == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	/* small pages, so the walk needs a TLB entry per 4KB */
+	madvise((void *)cold_buf, bytes, MADV_NOHUGEPAGE);
+	cold_prep_thrash(bytes);
+
+	cold_run(cold_prep_warm, 0, COLD_WARM_TRIALS);
+	cold_report("warm");
+
+	if (cold_idle_us) {
+		cold_idle(cold_idle_us);
+	} else {
+		for (i = 0; i < sizeof(idle_sweep) / sizeof(idle_sweep[0]) && !interrupted; i++)
+			cold_idle(idle_sweep[i]);
+	}
+
+	if (pair < 0) {
+		fprintf(stderr, "after migration: only one cpu, skipped\n");
+	} else if (!interrupted) {
+		cold_run(cold_prep_migrate, 0, COLD_MAX_TRIALS / 4);
+		fprintf(stderr, "migrating between cpu %d and %d (%s)\n", cold_cpus[0],
+			cold_cpus[1], pair == 0 ? "different cores" :
+			pair == 1 ? "SMT siblings" : "different packages");
+		cold_report("after migration");
+		if (cold_wrong_cpu)
+			fprintf(stderr, "  %lu reads not on the cpu we moved to\n", cold_wrong_cpu);
+		pin_to_cpu(cold_cpus[0]);
+	}
+
+	if (!interrupted) {
+		char label[64];
+
+		cold_run(cold_prep_thrash, bytes, COLD_THRASH_TRIALS);
+		snprintf(label, sizeof(label), "after %luMB cache/TLB thrash", cold_thrash_mb);
+		cold_report(label);
+	}
+
+	munmap((void *)cold_buf, bytes);
+	sched_setaffinity(0, sizeof(orig), &orig);
+	if (interrupted)
+		journal_interrupted();
+}
+
+#define MAX_VARIANTS 64
+#define MAX_METRICS 64
+
+/* a number the plan printed, and what it was for each variant */
+struct variant_metric {
+	char name[260];
+	double values[MAX_VARIANTS];
+	int have[MAX_VARIANTS];
+};
+
+static struct variant_metric variant_metrics[MAX_METRICS];
+static int nr_variant_metrics;
+
+/* the lines worth comparing between builds */
+static int variant_metric_wanted(char *name)
+{
+	return strstr(name, "/s") || strstr(name, "ratio") || strstr(name, "ipc") ||
+		strstr(name, "overhead") || strstr(name, "cycles");
+}
+
+static void record_variant_metric(char *name, double val, int variant)
+{
+	int i;
+
+	if (!variant_metric_wanted(name))
+		return;
+	for (i = 0; i < nr_variant_metrics; i++) {
+		if (strcmp(variant_metrics[i].name, name) == 0)
+			break;
+	}
+	if (i == nr_variant_metrics) {
+		if (nr_variant_metrics == MAX_METRICS)
+			return;
+		snprintf(variant_metrics[i].name, sizeof(variant_metrics[i].name), "%s", name);
+		nr_variant_metrics++;
+	}
+	variant_metrics[i].values[variant] = val;
+	variant_metrics[i].have[variant] = 1;
+}
+
+/*
+ * splits an output line into "some words <number>" pairs.  The first pair
+ * names the line, later pairs on the same line are named after it, so
+ * "low IPC (rdtsc) loops/s 1,234 ipc 0.55" gives us "low IPC (rdtsc) loops/s"
+ * and "low IPC (rdtsc) loops/s ipc"
+ */
+static void parse_variant_line(char *line, int variant)
+{
+	char first[128] = "";
+	char words[128] = "";
+	char name[260];
+	char *tok;
+	char *save;
+
+	for (tok = strtok_r(line, " \t\n", &save); tok; tok = strtok_r(NULL, " \t\n", &save)) {
+		char num[64];
+		char *end;
+		double val;
+		int i, n = 0;
+
+		for (i = 0; tok[i] && n < (int)sizeof(num) - 1; i++) {
+			if (tok[i] != ',')
+				num[n++] = tok[i];
+		}
+		num[n] = '\0';
+		val = strtod(num, &end);
+		if (n && *end == '\0' && words[0]) {
+			if (!first[0]) {
+				snprintf(first, sizeof(first), "%s", words);
+				snprintf(name, sizeof(name), "%s", words);
+			} else {
+				snprintf(name, sizeof(name), "%s %s", first, words);
+			}
+			record_variant_metric(name, val, variant);
+			words[0] = '\0';
+			continue;
+		}
+		if (words[0] && strlen(words) + strlen(tok) + 2 < sizeof(words))
+			strcat(words, " ");
+		if (strlen(words) + strlen(tok) + 1 < sizeof(words))
+			strcat(words, tok);
+	}
+}
+
+/* runs one variant with the plan and collects the numbers it prints */
+static int run_variant(char *path, char **plan, int nr_plan, int variant)
+{
+	char *args[nr_plan + 2];
+	char line[512];
+	int fds[2];
+	int status;
+	FILE *f;
+	pid_t pid;
+	int i;
+
+	args[0] = path;
+	for (i = 0; i < nr_plan; i++)
+		args[i + 1] = plan[i];
+	args[nr_plan + 1] = NULL;
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], 1);
+		dup2(fds[1], 2);
+		execv(path, args);
+		perror("execv");
+		_exit(1);
+	}
+	close(fds[1]);
+	f = fdopen(fds[0], "r");
+	while (fgets(line, sizeof(line), f)) {
+		fprintf(stderr, "  %s", line);
+		parse_variant_line(line, variant);
+	}
+	fclose(f);
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+ * runs the same plan with every build variant next to this binary and
+ * prints each number they reported, with the spread between variants
+ */
+void run_variants(char *self, char **plan, int nr_plan)
+{
+	char pattern[PATH_MAX];
+	char *names[MAX_VARIANTS];
+	char *dir;
+	glob_t g;
+	int nr = 0;
+	size_t i;
+	int m, v;
+
+	dir = dirname(strdup(self));
+	snprintf(pattern, sizeof(pattern), "%s/tsc.*-*", dir);
+	if (glob(pattern, 0, NULL, &g) || !g.gl_pathc) {
+		fprintf(stderr, "no variants found, run make variants first\n");
+		exit(1);
+	}
+	for (i = 0; i < g.gl_pathc && nr < MAX_VARIANTS; i++) {
+		char *path = g.gl_pathv[i];
+
+		if (access(path, X_OK))
+			continue;
+		fprintf(stderr, "%s\n", basename(path));
+		if (run_variant(path, plan, nr_plan, nr))
+			fprintf(stderr, "%s failed\n", basename(path));
+		names[nr++] = basename(path);
+	}
+
+	for (m = 0; m < nr_variant_metrics; m++) {
+		struct variant_metric *vm = &variant_metrics[m];
+		double lo = 0, hi = 0;
+		int found = 0;
+
+		fprintf(stderr, "\n%s\n", vm->name);
+		for (v = 0; v < nr; v++) {
+			if (!vm->have[v])
+				continue;
+			fprintf(stderr, "  %-24s %'16.2f\n", names[v], vm->values[v]);
+			if (!found || vm->values[v] < lo)
+				lo = vm->values[v];
+			if (!found || vm->values[v] > hi)
+				hi = vm->values[v];
+			found++;
+		}
+		if (found > 1 && lo > 0)
+			fprintf(stderr, "  spread min %'.2f max %'.2f (%.1f%%)\n", lo, hi,
+				(hi - lo) * 100 / lo);
+	}
+	/* names point into the glob results */
+	globfree(&g);
+}
+
+#if 0
+void test_clock_gettime(void)
+{
         struct timespec tsc = { 0 };
         struct timespec tsc2 = { 0 };
 	int ret;
@@ -380,11 +7295,19 @@ void test_clock_gettime(void)
 int main(int ac, char **av)
 {
 	unsigned long i;
-        int numbers[2048];
         struct thread_data td = { 0 };
  
 	// test_clock_gettime();
 
+	/* the journal options have to be known before any phase runs */
+        for (i = 1; i < (unsigned long)ac; i++) {
+		if (strncmp(av[i], "journal=", 8) == 0)
+			journal_file = av[i] + 8;
+		else if (strcmp(av[i], "resume") == 0)
+			journal_resume = 1;
+	}
+	journal_init(ac, av);
+
         for (i = 1; i < (unsigned long)ac; i++) {
                 char *str = av[i];
                 if (strcmp(str, "low_ipc") == 0) {
@@ -421,18 +7344,254 @@ int main(int ac, char **av)
                 } else if (strncmp(str, "factor=", 7) == 0) {
 			factor = atoi(str + 7);
 			fprintf(stderr, "factor %d\n", factor);
+                } else if (strncmp(str, "costs=", 6) == 0) {
+			cost_file = str + 6;
+			run_mode |= MODE_COSTS;
+                } else if (strcmp(str, "timens") == 0) {
+                        fprintf(stderr, "time namespace run\n");
+                        run_mode |= MODE_TIMENS;
+                } else if (strcmp(str, "virt") == 0) {
+                        fprintf(stderr, "virtualization run\n");
+                        run_mode |= MODE_VIRT;
+                } else if (strcmp(str, "cycle_clocksources") == 0) {
+                        fprintf(stderr, "cycling through clocksources\n");
+                        run_mode |= MODE_VIRT | MODE_CYCLE_CLOCKSOURCES;
+                } else if (strcmp(str, "uarch") == 0) {
+                        fprintf(stderr, "timestamp instruction characterization\n");
+                        run_mode |= MODE_UARCH;
+                } else if (strcmp(str, "synth") == 0) {
+                        fprintf(stderr, "synthetic workload run\n");
+                        run_mode |= MODE_SYNTH;
+                } else if (strncmp(str, "ipc=", 4) == 0) {
+			target_ipc = atof(str + 4);
+			fprintf(stderr, "target ipc %.2f\n", target_ipc);
+                } else if (strncmp(str, "mix=", 4) == 0) {
+			if (sscanf(str + 4, "%d,%d,%d,%d", &synth_mix.loads, &synth_mix.alu,
+				   &synth_mix.branches, &synth_mix.depth) != 4 ||
+			    synth_mix.loads < 0 || synth_mix.alu < 0 ||
+			    synth_mix.branches < 0 || synth_mix.depth < 1 ||
+			    synth_body_insns(&synth_mix) == 0) {
+				fprintf(stderr, "mix=loads,alu,branches,depth\n");
+				exit(1);
+			}
+			synth_mix_set = 1;
+                } else if (strncmp(str, "stamp_every=", 12) == 0) {
+			stamp_every = atoi(str + 12);
+			fprintf(stderr, "stamp every %d instructions\n", stamp_every);
+                } else if (strncmp(str, "runtime=", 8) == 0) {
+			runtime = atoi(str + 8);
+			fprintf(stderr, "runtime %d seconds\n", runtime);
+                } else if (strcmp(str, "variants") == 0) {
+			/* everything after variants is the plan for each build */
+			setlocale(LC_ALL, "");
+			run_variants(av[0], av + i + 1, ac - i - 1);
+			return 0;
+                } else if (strncmp(str, "matrix_file=", 12) == 0) {
+			matrix_file = str + 12;
+                } else if (strcmp(str, "compact") == 0) {
+                        fprintf(stderr, "compact matrix layout\n");
+			compact_matrix = 1;
+                } else if (strcmp(str, "layout_check") == 0) {
+                        fprintf(stderr, "comparing matrix layouts\n");
+			run_mode |= MODE_LAYOUT_CHECK;
+                } else if (strcmp(str, "cxx") == 0) {
+                        fprintf(stderr, "c++ clock library run\n");
+			run_mode |= MODE_CXX;
+                } else if (strcmp(str, "tracepoints") == 0) {
+                        fprintf(stderr, "disabled instrumentation run\n");
+			run_mode |= MODE_TRACEPOINTS;
+                } else if (strcmp(str, "icache") == 0) {
+                        fprintf(stderr, "i-cache pressure run\n");
+			run_mode |= MODE_ICACHE;
+                } else if (strncmp(str, "functions=", 10) == 0) {
+			icache_functions = strtoul(str + 10, NULL, 10);
+			if (!icache_functions) {
+				fprintf(stderr, "functions must be at least 1\n");
+				exit(1);
+			}
+                } else if (strcmp(str, "wakeup") == 0) {
+                        fprintf(stderr, "wakeup latency run\n");
+			run_mode |= MODE_WAKEUP;
+                } else if (strncmp(str, "period_us=", 10) == 0) {
+			wakeup_period_us = atol(str + 10);
+                } else if (strncmp(str, "slack_ns=", 9) == 0) {
+			wakeup_slack_ns = atol(str + 9);
+                } else if (strcmp(str, "delay") == 0) {
+                        fprintf(stderr, "delay primitive run\n");
+			run_mode |= MODE_DELAY;
+                } else if (strncmp(str, "delay_ns=", 9) == 0) {
+			delay_ns = strtoul(str + 9, NULL, 10);
+                } else if (strncmp(str, "capture=", 8) == 0) {
+			capture_dir = str + 8;
+			run_mode |= MODE_CAPTURE;
+                } else if (strncmp(str, "capture_mb=", 11) == 0) {
+			capture_mb = strtoul(str + 11, NULL, 10);
+			if (!capture_mb) {
+				fprintf(stderr, "capture_mb must be at least 1\n");
+				exit(1);
+			}
+                } else if (strcmp(str, "analyze") == 0) {
+			/* everything after analyze is a capture file */
+			setlocale(LC_ALL, "");
+			run_analyze(av + i + 1, ac - i - 1);
+			return 0;
+                } else if (strcmp(str, "tickphase") == 0) {
+                        fprintf(stderr, "tick phase run\n");
+			run_mode |= MODE_TICKPHASE;
+                } else if (strncmp(str, "hz=", 3) == 0) {
+			tick_hz = atol(str + 3);
+			if (tick_hz <= 0) {
+				fprintf(stderr, "hz must be at least 1\n");
+				exit(1);
+			}
+                } else if (strcmp(str, "oversub") == 0) {
+                        fprintf(stderr, "oversubscribed run\n");
+			run_mode |= MODE_OVERSUB;
+                } else if (strncmp(str, "ratio=", 6) == 0) {
+			oversub_ratio = atoi(str + 6);
+                } else if (strcmp(str, "sampling") == 0) {
+                        fprintf(stderr, "sampling profiler run\n");
+			run_mode |= MODE_SAMPLING;
+                } else if (strncmp(str, "sample_hz=", 10) == 0) {
+			sample_hz = strtoul(str + 10, NULL, 10);
+			if (!sample_hz || sample_hz > 1000000) {
+				fprintf(stderr, "sample_hz must be between 1 and 1000000\n");
+				exit(1);
+			}
+                } else if (strncmp(str, "journal=", 8) == 0 || strcmp(str, "resume") == 0) {
+			/* handled before the other arguments */
+                } else if (strcmp(str, "model") == 0) {
+                        fprintf(stderr, "overhead model run\n");
+			run_mode |= MODE_MODEL;
+                } else if (strncmp(str, "model=", 6) == 0) {
+			model_file = str + 6;
+			run_mode |= MODE_MODEL;
+                } else if (strcmp(str, "advise") == 0) {
+			/* everything after advise is the model and the hot path */
+			setlocale(LC_ALL, "");
+			run_advise(av + i + 1, ac - i - 1);
+			return 0;
+                } else if (strcmp(str, "stream") == 0) {
+                        fprintf(stderr, "memory bandwidth run\n");
+			run_mode |= MODE_STREAM;
+                } else if (strncmp(str, "stream_mb=", 10) == 0) {
+			stream_mb = strtoul(str + 10, NULL, 10);
+			if (!stream_mb) {
+				fprintf(stderr, "stream_mb must be at least 1\n");
+				exit(1);
+			}
+                } else if (strncmp(str, "threads=", 8) == 0) {
+			bench_threads = atoi(str + 8);
+                } else if (strncmp(str, "lines=", 6) == 0) {
+			stream_lines = atoi(str + 6);
+                } else if (strcmp(str, "alloc") == 0) {
+                        fprintf(stderr, "malloc/free run\n");
+			run_mode |= MODE_ALLOC;
+                } else if (strncmp(str, "stamp_pct=", 10) == 0) {
+			alloc_stamp_pct = atof(str + 10);
+                } else if (strcmp(str, "twin") == 0) {
+                        fprintf(stderr, "concurrent twin comparison run\n");
+			run_mode |= MODE_TWIN | MODE_CMP;
+                } else if (strcmp(str, "ntp") == 0) {
+                        fprintf(stderr, "ntp adjustment run\n");
+			run_mode |= MODE_NTP;
+                } else if (strcmp(str, "ntp_adjust") == 0) {
+			ntp_adjust = 1;
+			run_mode |= MODE_NTP;
+                } else if (strcmp(str, "cold") == 0) {
+                        fprintf(stderr, "cold first read run\n");
+			run_mode |= MODE_COLD;
+                } else if (strncmp(str, "idle_us=", 8) == 0) {
+			cold_idle_us = atol(str + 8);
+			if (cold_idle_us <= 0) {
+				fprintf(stderr, "idle_us must be at least 1\n");
+				exit(1);
+			}
+                } else if (strncmp(str, "thrash_mb=", 10) == 0) {
+			cold_thrash_mb = strtoul(str + 10, NULL, 10);
+			if (!cold_thrash_mb) {
+				fprintf(stderr, "thrash_mb must be at least 1\n");
+				exit(1);
+			}
+                } else if (strncmp(str, "matrix_mb=", 10) == 0) {
+			matrix_size = strtoul(str + 10, NULL, 10) * 1024 * 1024 / sizeof(unsigned long);
+			if (!matrix_size) {
+				fprintf(stderr, "matrix_mb must be at least 1\n");
+				exit(1);
+			}
                 } else {
-                        fprintf(stderr, "usage: %s [ipc_mode] [cmp] [clock] [factor=N]\n", av[0]);
+                        fprintf(stderr, "usage: %s [ipc_mode] [cmp [twin]] [clock] [factor=N] [costs=FILE] [timens] [virt [cycle_clocksources]] [uarch]\n"
+				"\t[synth [ipc=X] [mix=L,A,B,D] [stamp_every=N]]\n"
+				"\t[matrix_file=PATH] [compact] [matrix_mb=N] [layout_check]\n"
+				"\t[runtime=N] [variants <plan>] [cxx] [tracepoints]\n"
+				"\t[icache [functions=N]] [wakeup [period_us=N] [slack_ns=N]]\n"
+				"\t[delay [delay_ns=N] [slack_ns=N]] [capture=DIR [capture_mb=N]] [analyze FILE...]\n"
+				"\t[tickphase [hz=N]]\n"
+				"\t[oversub [ratio=N]] [sampling [sample_hz=N]] [journal=FILE [resume]]\n"
+				"\t[model[=FILE]] [advise FILE overhead=PCT insns=N ipc=X [mpki=M]]\n"
+				"\t[stream [stream_mb=N] [threads=N] [lines=N]] [alloc [threads=N] [stamp_pct=X]]\n"
+				"\t[ntp [ntp_adjust]] [cold [idle_us=N] [thrash_mb=N]]\n",
+				av[0]);
                         fprintf(stderr, "\tvalid ipc modes are low_ipc and high_ipc\n");
                         fprintf(stderr, "\tvalid clock modes are notsc, rdtscp, rdtsc, rdtsc_lfence, clock_gettime, clock_gettime_non_monotonic\n");
                         fprintf(stderr, "\tcmp: compares the ipc mode with and without tsc reads\n");
                         fprintf(stderr, "\tfactor=N: allows tuning the IPC of the low_ipc loop.  Higher factors result in higher IPC\n");
+                        fprintf(stderr, "\tcosts=FILE: write the ns/call of each clock to FILE for libclockprof.so\n");
+                        fprintf(stderr, "\ttimens: compares the clock and ipc mode in the root and a time namespace\n");
+                        fprintf(stderr, "\tvirt: hypervisor, clocksource, pvclock page and rdtsc trapping checks\n");
+                        fprintf(stderr, "\tcycle_clocksources: (root) rerun the clock and ipc mode with every clocksource\n");
+                        fprintf(stderr, "\tuarch: throughput, latency and port contention of each timestamp instruction\n");
+                        fprintf(stderr, "\tsynth: generated loops, timestamp overhead as a function of IPC\n");
+                        fprintf(stderr, "\tipc=X: tune the ipc mode or synth loop to IPC X with perf counters\n");
+                        fprintf(stderr, "\tmix=L,A,B,D: loads, alu ops, branches and alu dependency depth per synth body\n");
+                        fprintf(stderr, "\tstamp_every=N: instructions between synth timestamps\n");
+                        fprintf(stderr, "\tmatrix_file=PATH: build the matrix once in a shm or hugetlbfs file and reuse it\n");
+                        fprintf(stderr, "\tcompact: 32 bit matrix entries and a power of two size, half the memory\n");
+                        fprintf(stderr, "\tmatrix_mb=N: matrix entries, given as the size in MB of the original layout\n");
+                        fprintf(stderr, "\tlayout_check: compare loops/s and cache misses of both matrix layouts\n");
+                        fprintf(stderr, "\truntime=N: seconds for each run, default 10\n");
+                        fprintf(stderr, "\tvariants <plan>: run the rest of the arguments with every make variants build\n");
+                        fprintf(stderr, "\tcxx: compare the C loops with the C++ clock.hpp and std::chrono versions\n");
+                        fprintf(stderr, "\ttracepoints: cost of clock reads behind flags and patched nops, off and on\n");
+                        fprintf(stderr, "\ticache: thousands of small functions each with a stamp, with front end counters\n");
+                        fprintf(stderr, "\tfunctions=N: number of icache functions, the default sweeps 64 to 16384\n");
+                        fprintf(stderr, "\twakeup: cyclictest style wakeup lateness of each sleep mechanism on every cpu\n");
+                        fprintf(stderr, "\tperiod_us=N: wakeup period, default 1000\n");
+                        fprintf(stderr, "\tslack_ns=N: timer slack for the wakeup and delay threads\n");
+                        fprintf(stderr, "\tdelay: accuracy and cost of spin, tpause, umwait and sleep then spin delays\n");
+                        fprintf(stderr, "\tdelay_ns=N: one delay instead of the 100ns to 1ms sweep\n");
+                        fprintf(stderr, "\tcapture=DIR: write every clock read sample from every cpu to files in DIR\n");
+                        fprintf(stderr, "\tcapture_mb=N: MB of samples per cpu, default holds runtime up to 512MB\n");
+                        fprintf(stderr, "\tanalyze FILE...: percentiles, per cpu stats and periodicity of capture files\n");
+                        fprintf(stderr, "\ttickphase: slow clock_gettime() reads of each clock id by tick phase\n");
+                        fprintf(stderr, "\thz=N: tick rate for tickphase, default CONFIG_HZ or measured\n");
+                        fprintf(stderr, "\toversub: clock and ipc loops with more threads than cpus, flags cgroup throttling\n");
+                        fprintf(stderr, "\tratio=N: threads per cpu for oversub, default 2\n");
+                        fprintf(stderr, "\tsampling: ipc loop under perf and SIGPROF samplers next to inline clock reads\n");
+                        fprintf(stderr, "\tsample_hz=N: one sampling frequency instead of 100, 1000 and 10000\n");
+                        fprintf(stderr, "\tjournal=FILE: append each phase's result to FILE as it finishes\n");
+                        fprintf(stderr, "\tresume: take the phases FILE already has instead of running them\n");
+                        fprintf(stderr, "\tmodel[=FILE]: fit the cost of each clock to ipc, mpki and stamp spacing\n");
+                        fprintf(stderr, "\tadvise FILE overhead=PCT insns=N ipc=X [mpki=M]: pick a clock for a hot path\n");
+                        fprintf(stderr, "\tstream: STREAM copy/scale/add/triad GB/s with a clock read every lines= cache lines\n");
+                        fprintf(stderr, "\tstream_mb=N lines=N: array size and cache lines between stamps\n");
+                        fprintf(stderr, "\talloc: malloc/free of a mix of sizes, stamp_pct= of the mallocs timed\n");
+                        fprintf(stderr, "\tthreads=N: threads for stream and alloc, default 1\n");
+                        fprintf(stderr, "\ttwin: cmp with both copies running at once on two cores, swapped every second\n");
+                        fprintf(stderr, "\tntp: CLOCK_MONOTONIC read cost and drift from MONOTONIC_RAW while NTP adjusts it\n");
+                        fprintf(stderr, "\tntp_adjust: (root, disposable VMs) make frequency changes, steps and a slew\n");
+                        fprintf(stderr, "\tcold: first clock read after idle, a migration and a cache/TLB thrash\n");
+                        fprintf(stderr, "\tidle_us=N thrash_mb=N: one sleep instead of 50us, 1ms and 20ms, buffer size\n");
                         exit(1);
                 }
         }
 
         /* default to low_ipc if nothing was specified */
-        if (!(run_mode & (CLOCK_MODE_MASK | IPC_MODE_MASK))) {
+        if (!(run_mode & (CLOCK_MODE_MASK | IPC_MODE_MASK | MODE_COSTS | MODE_VIRT |
+		       MODE_UARCH | MODE_SYNTH | MODE_CXX | MODE_TRACEPOINTS |
+		       MODE_ICACHE | MODE_WAKEUP | MODE_DELAY | MODE_CAPTURE |
+		       MODE_TICKPHASE | MODE_OVERSUB | MODE_SAMPLING | MODE_MODEL |
+		       MODE_STREAM | MODE_ALLOC | MODE_NTP | MODE_COLD))) {
                 run_mode |= MODE_LOW_IPC;
 		fprintf(stderr, "running default low IPC run\n");
         }
@@ -442,6 +7601,21 @@ int main(int ac, char **av)
 		fprintf(stderr, "running default low IPC run\n");
 	}
 
+	/* only the ipc loops and synth have a knob for ipc= to turn */
+	if (target_ipc > 0 && !(run_mode & (IPC_MODE_MASK | MODE_SYNTH))) {
+		fprintf(stderr, "ipc= needs low_ipc, high_ipc or synth\n");
+		exit(1);
+	}
+
+	/*
+	 * rdtsc doesn't care about namespaces or clocksources, default
+	 * those runs to clock_gettime
+	 */
+	if ((run_mode & (MODE_TIMENS | MODE_VIRT)) && !(run_mode & TSC_MODE_MASK)) {
+		tsc_variant = "clock_gettime";
+		run_mode |= MODE_GETTIME;
+	}
+
         /* default to rdtscp if nothing was specified */
         if (!(run_mode & TSC_MODE_MASK)) {
                 run_mode |= MODE_RDTSCP;
@@ -449,22 +7623,118 @@ int main(int ac, char **av)
 
 	/* just so fprintf gives us %'lu formatting */
 	setlocale(LC_ALL, "");
+	journal_signals();
+
+	/* cost measurement doesn't need the matrix */
+	if (run_mode & MODE_COSTS) {
+		write_clock_costs(cost_file);
+		return 0;
+	}
+
+	if (run_mode & MODE_UARCH) {
+		run_uarch();
+		return 0;
+	}
+
+	if (run_mode & MODE_SYNTH) {
+		run_synth();
+		return 0;
+	}
+
+	if (run_mode & MODE_MODEL) {
+		run_model();
+		return 0;
+	}
+
+	if (run_mode & MODE_STREAM) {
+		run_stream();
+		return 0;
+	}
+
+	if (run_mode & MODE_ALLOC) {
+		run_alloc();
+		return 0;
+	}
+
+	if (run_mode & MODE_NTP) {
+		run_ntp();
+		return 0;
+	}
+
+	if (run_mode & MODE_COLD) {
+		run_cold();
+		return 0;
+	}
+
+	if (run_mode & MODE_ICACHE) {
+		run_icache();
+		return 0;
+	}
+
+	if (run_mode & MODE_WAKEUP) {
+		run_wakeup();
+		return 0;
+	}
+
+	if (run_mode & MODE_DELAY) {
+		run_delay();
+		return 0;
+	}
+
+	if (run_mode & MODE_CAPTURE) {
+		run_capture();
+		return 0;
+	}
+
+	if (run_mode & MODE_TICKPHASE) {
+		run_tickphase();
+		return 0;
+	}
 
         /* the big matrix is just our way to make cache misses and lower IPC */
-	global_matrix = malloc(matrix_size * sizeof(unsigned long));
-	if (!global_matrix) {
-		fprintf(stderr, "malloc failed\n");
-		exit(1);
+	if (run_mode & MODE_LAYOUT_CHECK) {
+		run_layout_check();
+		return 0;
 	}
 
-        /* find some random numbers */
-        for (i = 0; i < 2048; i++) {
-                numbers[i] = rand();
-        }
+	alloc_matrix();
 
-        /* fill the matrix with our randoms */
-	for (i = 0; i < matrix_size; i++) {
-		global_matrix[i] = numbers[i % 2048];
+	if (run_mode & MODE_TIMENS) {
+		run_timens();
+		return 0;
+	}
+
+	if (run_mode & MODE_VIRT) {
+		run_virt();
+		return 0;
+	}
+
+	if (run_mode & MODE_CXX) {
+		run_cxx();
+		return 0;
+	}
+
+	if (run_mode & MODE_TRACEPOINTS) {
+		run_tracepoints();
+		return 0;
+	}
+
+	if (run_mode & MODE_OVERSUB) {
+		run_oversub();
+		return 0;
+	}
+
+	if (run_mode & MODE_SAMPLING) {
+		run_sampling();
+		return 0;
+	}
+
+	if (target_ipc > 0 && !calibrate_ipc(target_ipc))
+		td.count_ipc = 1;
+
+	if (run_mode & MODE_TWIN) {
+		run_twin();
+		return 0;
 	}
 
         if (run_mode & MODE_LOW_IPC) {